@@ -0,0 +1,421 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+
+/**
+ * bench times the parts of email that move the most bytes: the base64
+ * and quoted-printable encoders and writing a message out during DATA.
+ * It's linked against the same objects as email itself, so it measures
+ * exactly what gets shipped.  Run it as
+ *
+ * 	bench [megabytes]
+ *
+ * Each encoder is checked against a plain reference first, so a fast
+ * but wrong result shows up as a failure and not as a good number.
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "email.h"
+#include "mimeutils.h"
+#include "smtpcommands.h"
+#include "error.h"
+
+#define BENCH_DEFAULT_MB  32
+#define BENCH_LINE        76	/* Line length of the text we make up */
+
+static const char ref64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* email.c has main(), so what the rest of the objects want from it is here */
+char *
+getConfValue(const char *tok)
+{
+	return (char *)dhGetItem(table, tok);
+}
+
+void
+setConfValue(const char *tok, const char *val)
+{
+	dhInsert(table, tok, val);
+}
+
+static double
+benchNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+benchReport(const char *what, size_t bytes, double secs)
+{
+	printf("%-28s %10.1f MB/s\n", what, bytes / secs / (1024 * 1024));
+}
+
+/**
+ * Base64 the way it's been done since b64.c: three bytes at a time
+ * with a line break every MAX_B64_LINE characters.  This is what the
+ * other encoders have to match and beat.
+**/
+static size_t
+benchB64Ref(const u_char *in, size_t len, char *out)
+{
+	size_t i, col=0;
+	char *start = out;
+	u_char b[3];
+
+	for (i=0; i < len; i += 3) {
+		memset(b, 0, sizeof(b));
+		memcpy(b, in + i, (len - i < 3) ? len - i : 3);
+		*out++ = ref64[b[0] >> 2];
+		*out++ = ref64[((b[0] & 0x03) << 4) | (b[1] >> 4)];
+		*out++ = (len - i > 1) ? ref64[((b[1] & 0x0f) << 2) | (b[2] >> 6)] : '=';
+		*out++ = (len - i > 2) ? ref64[b[2] & 0x3f] : '=';
+		col += 4;
+		if (col == MAX_B64_LINE || i + 3 >= len) {
+			*out++ = '\r';
+			*out++ = '\n';
+			col = 0;
+		}
+	}
+	return out - start;
+}
+
+/**
+ * Makes up len bytes of mail text: lines of BENCH_LINE characters,
+ * every tenth one starting with a dot so dot-stuffing has work to
+ * do, and the odd character quoted-printable has to escape.
+**/
+static u_char *
+benchText(size_t len)
+{
+	size_t i, col=0, line=0;
+	u_char *text = xmalloc(len + 1);
+
+	for (i=0; i < len; i++) {
+		if (col == BENCH_LINE) {
+			text[i] = '\n';
+			col = 0;
+			line++;
+			continue;
+		}
+		if (col == 0 && line % 10 == 0) {
+			text[i] = '.';
+		} else if (i % 97 == 0) {
+			text[i] = '=';
+		} else if (i % 89 == 0) {
+			text[i] = 0xe9;
+		} else {
+			text[i] = 'a' + (i % 26);
+		}
+		col++;
+	}
+	text[len] = '\0';
+	return text;
+}
+
+static int
+benchB64(const u_char *raw, size_t len)
+{
+	int retval = ERROR;
+	size_t enclen, reflen;
+	double t;
+	char *enc = xmalloc(mimeB64EncodedSize(len) + 1);
+	char *ref = xmalloc(mimeB64EncodedSize(len) + 1);
+	FILE *file=NULL;
+	dstrbuf *out = DSB_NEW;
+
+	t = benchNow();
+	reflen = benchB64Ref(raw, len, ref);
+	benchReport("base64 reference", len, benchNow() - t);
+
+	t = benchNow();
+	enclen = mimeB64EncodeBuf(raw, len, enc, true);
+	benchReport("base64 mimeB64EncodeBuf", len, benchNow() - t);
+	if (enclen != reflen || memcmp(enc, ref, reflen) != 0) {
+		fatal("mimeB64EncodeBuf() doesn't match the reference\n");
+		goto end;
+	}
+
+	if (!(file = tmpfile()) || fwrite(raw, 1, len, file) != len) {
+		fatal("Could not write a temp file");
+		goto end;
+	}
+	rewind(file);
+	t = benchNow();
+	if (mimeB64EncodeFile(file, out) == ERROR) {
+		fatal("mimeB64EncodeFile() failed\n");
+		goto end;
+	}
+	benchReport("base64 mimeB64EncodeFile", len, benchNow() - t);
+	if (out->len != reflen || memcmp(out->str, ref, reflen) != 0) {
+		fatal("mimeB64EncodeFile() doesn't match the reference\n");
+		goto end;
+	}
+	retval = SUCCESS;
+
+end:
+	if (file) {
+		fclose(file);
+	}
+	xfree(enc);
+	xfree(ref);
+	dsbDestroy(out);
+	return retval;
+}
+
+/**
+ * Checks that what mimeQpEncodeString() came up with decodes back
+ * to the text it was given.
+**/
+static bool
+benchQpCheck(const u_char *text, const char *qp)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const char *hi, *lo;
+
+	while (*qp) {
+		if (qp[0] == '=' && qp[1] == '\r' && qp[2] == '\n') {
+			qp += 3;
+		} else if (qp[0] == '=') {
+			if (!qp[1] || !(hi = strchr(hex, qp[1])) ||
+			    !qp[2] || !(lo = strchr(hex, qp[2])) ||
+			    ((hi - hex) << 4 | (lo - hex)) != *text++) {
+				return false;
+			}
+			qp += 3;
+		} else if (qp[0] == '\r' && qp[1] == '\n') {
+			if (*text++ != '\n') {
+				return false;
+			}
+			qp += 2;
+		} else if ((u_char)*qp++ != *text++) {
+			return false;
+		}
+	}
+	return *text == '\0';
+}
+
+static int
+benchQp(const u_char *text, size_t len)
+{
+	double t;
+	bool ok;
+	dstrbuf *qp;
+
+	t = benchNow();
+	qp = mimeQpEncodeString(text, true);
+	benchReport("quoted-printable", len, benchNow() - t);
+	ok = benchQpCheck(text, qp->str);
+	dsbDestroy(qp);
+	if (!ok) {
+		fatal("mimeQpEncodeString() doesn't decode back to it's input\n");
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+/**
+ * A server that takes anything it's given as fast as it can and
+ * throws it away.  It checks the message is dot-stuffed all the way
+ * through by counting the dots it gets at the start of lines.
+**/
+static void
+benchSink(int lfd, size_t dots)
+{
+	int fd;
+	bool data=false, bol=true;
+	size_t got=0;
+	char line[65536];
+	FILE *in, *out;
+
+	if ((fd = accept(lfd, NULL, NULL)) < 0) {
+		_exit(1);
+	}
+	in = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	fputs("220 bench\r\n", out);
+	fflush(out);
+	while (fgets(line, sizeof(line), in)) {
+		if (data) {
+			if (bol && strcmp(line, ".\r\n") == 0) {
+				fputs((got == dots) ? "250 ok\r\n" : "554 not stuffed\r\n", out);
+				fflush(out);
+				data = false;
+			} else if (bol && strncmp(line, "..", 2) == 0) {
+				got++;
+			}
+			bol = (strchr(line, '\n') != NULL);
+		} else if (strncasecmp(line, "DATA", 4) == 0) {
+			fputs("354 go ahead\r\n", out);
+			fflush(out);
+			data = true;
+			bol = true;
+			got = 0;
+		} else if (strncasecmp(line, "QUIT", 4) == 0) {
+			fputs("221 bye\r\n", out);
+			break;
+		} else {
+			fputs("250 ok\r\n", out);
+			fflush(out);
+		}
+	}
+	fclose(out);
+	fclose(in);
+	_exit(0);
+}
+
+/**
+ * Sends text as a message through smtpSendData() in chunks the size
+ * of SEND_CHUNK_SIZE, to a sink in a child process over loopback.
+**/
+static int
+benchSend(const u_char *text, size_t len)
+{
+	int lfd, status, retval = ERROR;
+	size_t i, n, dots=0;
+	double t;
+	pid_t pid;
+	dsocket *sd=NULL;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+
+	for (i=0; i < len; i++) {
+		if (text[i] == '.' && (i == 0 || text[i-1] == '\n')) {
+			dots++;
+		}
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &slen) < 0) {
+		fatal("Could not set up a socket to send to");
+		return ERROR;
+	}
+	if ((pid = fork()) < 0) {
+		fatal("Could not fork");
+		close(lfd);
+		return ERROR;
+	} else if (pid == 0) {
+		benchSink(lfd, dots);
+	}
+	close(lfd);
+
+	sd = dnetConnect("127.0.0.1", ntohs(sin.sin_port));
+	if (!sd || dnetErr(sd)) {
+		fatal("Could not connect to the sink\n");
+		goto end;
+	}
+	if (smtpInit(sd, "localhost") == ERROR ||
+	    smtpSetMailFrom(sd, "bench@localhost") == ERROR ||
+	    smtpSetRcpt(sd, "sink@localhost") == ERROR) {
+		fatal("Sink turned us down: %s\n", smtpGetErr());
+		goto end;
+	}
+
+	t = benchNow();
+	if (smtpStartData(sd) == ERROR) {
+		fatal("Sink turned us down: %s\n", smtpGetErr());
+		goto end;
+	}
+	for (i=0; i < len; i += n) {
+		n = (len - i < Conf.send_chunk_size) ? len - i : Conf.send_chunk_size;
+		if (smtpSendData(sd, (const char *)text + i, n) == ERROR) {
+			fatal("Sending failed: %s\n", smtpGetErr());
+			goto end;
+		}
+	}
+	if (smtpEndData(sd) == ERROR) {
+		fatal("Sink didn't take the message: %s\n", smtpGetErr());
+		goto end;
+	}
+	benchReport("DATA with dot-stuffing", len, benchNow() - t);
+	smtpQuit(sd);
+	retval = SUCCESS;
+
+end:
+	if (sd) {
+		dnetClose(sd);
+	}
+	if (retval == ERROR) {
+		kill(pid, SIGTERM);
+	}
+	waitpid(pid, &status, 0);
+	return retval;
+}
+
+int
+main(int argc, char **argv)
+{
+	int retval = SUCCESS;
+	size_t i, len = BENCH_DEFAULT_MB;
+	u_char *raw, *text;
+
+	if (argc > 1 && (len = strtoul(argv[1], NULL, 10)) == 0) {
+		fprintf(stderr, "Usage: %s [megabytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	len *= 1024 * 1024;
+	/* What conf.c would have set without an email.conf */
+	Conf.timeout = 10;
+	Conf.send_chunk_size = 65536;
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Random bytes for base64, the way attachments mostly are */
+	srand(1);
+	raw = xmalloc(len);
+	for (i=0; i < len; i++) {
+		raw[i] = rand() >> 7;
+	}
+	text = benchText(len);
+
+	printf("Encoding and sending %lu MB\n", (u_long)(len / (1024 * 1024)));
+	if (benchB64(raw, len) == ERROR || benchQp(text, len) == ERROR ||
+	    benchSend(text, len) == ERROR) {
+		retval = ERROR;
+	}
+
+	xfree(raw);
+	xfree(text);
+	return (retval == ERROR) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
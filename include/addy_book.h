@@ -24,5 +24,8 @@
 #define ADDY_BOOK_H  1
 
 dlist getNames(char *addrs);
+dlist getRcpts(dlist to, dlist cc, dlist bcc);
+int readRcptFile(const char *file, dstrbuf *names);
+void freeAddrBook(void);
 
 #endif /* ADDY_BOOK_H */
@@ -0,0 +1,31 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#ifndef __ATTCACHE_H
+#define __ATTCACHE_H   1
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+FILE *attCacheOpen(const char *file, const struct stat *st);
+
+#endif /* __ATTCACHE_H */
@@ -25,5 +25,6 @@
 
 void checkConfig(void);
 void configure(void);
+void freeConfOptions(void);
 
 #endif /* __CONF_H */
@@ -60,14 +60,17 @@ struct addr {
 typedef enum { GPG_SIG=0x01, GPG_ENC=0x02 } GpgCallType;
 
 
+struct msgstream;
+
 /* Globally defined vars */
 dhash table;
 char *conf_file;
-dstrbuf *global_msg;
+struct msgstream *global_msg;
 
 struct mailer_options {
 	bool verbose;
 	bool encoding;
+	bool queue;
 	short html;
 	short priority;
 	short receipt;
@@ -81,6 +84,36 @@ struct mailer_options {
 	dlist bcc;
 } Mopts;
 
+/* The configuration, worked out once by configure() */
+struct conf_options {
+	char *smtp_server;
+	int smtp_port;
+	char *sendmail_bin;
+	char *my_name;
+	char *my_email;
+	char *reply_to;
+	char *signature_file;	/* Paths have ~ and & expanded */
+	char *address_book;
+	char *save_sent_mail;
+	char *temp_dir;
+	char *gpg_bin;
+	char *gpg_pass;
+	char *smtp_auth;
+	char *smtp_auth_user;
+	char *smtp_auth_pass;	/* Filled in once it's been asked for */
+	bool use_tls;
+	char *vcard;
+	char *smtp_relays;
+	char *spool_dir;
+	char *attach_cache_dir;
+	int timeout;		/* Seconds to wait on the server */
+	int smtp_max_messages;	/* 0 for no limit */
+	int smtp_sessions;	/* 0 if it wasn't set */
+	size_t send_chunk_size;
+	size_t bdat_chunk_size;	/* 0 to not use BDAT */
+	size_t attach_cache_size;	/* Bytes the attachment cache can use */
+} Conf;
+
 void usage(void);
 
 char *getConfValue(const char *tok);
@@ -23,7 +23,14 @@
 #ifndef FILE_IO_H
 #define FILE_IO_H   1
 
+/* How much of STDIN is read at a time */
+#define INPUT_BLOCK  (256 * 1024)
+
+size_t readInputBlock(FILE *in, char *raw, size_t len, char *out, bool *cr);
 dstrbuf *readInput(void);
+dstrbuf *readFileInput(const char *filename);
 dstrbuf *editEmail(void);
+const u_char *mapFile(FILE *file, size_t *len);
+int unmapFile(const u_char *map, size_t len);
 
 #endif /* FILE_IO_H */
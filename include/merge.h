@@ -0,0 +1,46 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#ifndef __MERGE_H
+#define __MERGE_H   1
+
+#include <stdio.h>
+
+/* A mail merge data file and the record that was read last */
+struct mergedata {
+	FILE *file;
+	bool jsonl;		/* One JSON object per line, otherwise CSV */
+	int line;		/* Lines read so far */
+	int rec_line;		/* Line the last record started on */
+	dstrbuf *buf;
+	char **names;		/* Field names */
+	size_t nnames;
+	char **values;		/* The record's value for each name */
+	size_t nvalues;
+};
+
+struct mergedata *mergeOpen(const char *file);
+int mergeNext(struct mergedata *m);
+dstrbuf *mergeFill(struct mergedata *m, const char *tmpl, bool header);
+void mergeClose(struct mergedata *m);
+
+#endif /* __MERGE_H */
@@ -26,5 +26,7 @@
 #define __SMTP_H   1
 
 void createMail(void);
+void createBatchMail(const char *batch_file);
+void createMergeMail(const char *merge_file, const char *to);
 
 #endif /* __SMTP_H */
@@ -23,11 +23,17 @@
 #ifndef _MIMEUTILS_H
 #define _MIMEUTILS_H  1
 
+/* Length of a line of base64, not counting the CRLF */
+#define MAX_B64_LINE 72
+
 dstrbuf *mimeMakeBoundary(void);
 dstrbuf *mimeFiletype(const char *filename);
+void mimeFreeTypes(void);
 dstrbuf *mimeFilename(const char *in_name);
 dstrbuf *mimeQpEncodeString(const u_char *str, bool wrap);
 int mimeB64EncodeFile(FILE *in, dstrbuf *out);
+size_t mimeB64EncodedSize(size_t len);
+size_t mimeB64EncodeBuf(const u_char *in, size_t len, char *out, bool maxline);
 dstrbuf *mimeB64EncodeString(const u_char *inbuf, size_t len, bool maxline);
 
 #endif /* _MIMEUTILS_H */
@@ -0,0 +1,84 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#ifndef __MSGSTREAM_H
+#define __MSGSTREAM_H   1
+
+#include <stdio.h>
+
+/* The parts of a message msgStreamNext() hands out in turn */
+typedef enum {
+	MSG_HEAD,
+	MSG_TEXT,
+	MSG_ATTACH_HEAD,
+	MSG_ATTACH_DATA,
+	MSG_TAIL,
+	MSG_END
+} MsgPart;
+
+/**
+ * A message that's handed out a piece at a time.  The headers and
+ * text are built up front, but attachments are read and encoded
+ * as they're asked for, so only a chunk of each is held at once.
+ * The text can also be read from STDIN as it's sent, in which
+ * case size doesn't count it until it's all been read.
+ */
+struct msgstream {
+	dstrbuf *head;		/* Headers and text, or the whole message */
+	bool borrowed;		/* head belongs to someone else */
+	dstrbuf *border;	/* Boundary between the attachments */
+	char **files;		/* Files to attach */
+	size_t nfiles;
+	size_t size;		/* Length of the whole message */
+	MsgPart part;		/* What's handed out next */
+	size_t cur;		/* Which file it's on */
+	FILE *file;
+	bool cached;		/* file is already base64 encoded */
+	const u_char *map;	/* file mapped into memory, if it could be */
+	size_t map_len;
+	size_t map_off;		/* How much of map has been handed out */
+	struct encpool *pool;	/* Encodes big files on a few threads */
+	bool pooled;		/* file is being encoded on the pool */
+	u_char *raw;		/* Bytes read from the file */
+	char *enc;		/* The same bytes base64 encoded */
+	dstrbuf *buf;		/* The last piece handed out */
+	FILE *input;		/* Where the text is read from as it's sent */
+	dstrbuf *after;		/* What follows the text */
+	FILE *spill;		/* A copy of the text to go over again */
+	bool input_cr;		/* The last block of text ended in a CR */
+	size_t text_len;	/* How much text has been read */
+	size_t text_off;	/* How much of it has been handed out */
+	char *text_raw;		/* The text as it was read */
+	char *text;		/* The same with CRLF line endings */
+};
+
+struct msgstream *msgStreamNew(dstrbuf *head, const char *border, dlist attach);
+struct msgstream *msgStreamFromBuf(dstrbuf *msg, bool borrowed);
+int msgStreamSetInput(struct msgstream *s, FILE *in, dstrbuf *after);
+int msgStreamNext(struct msgstream *s, const char **data, size_t *len);
+void msgStreamRewind(struct msgstream *s);
+int msgStreamWrite(struct msgstream *s, FILE *out);
+dstrbuf *msgStreamCopy(struct msgstream *s);
+void msgStreamFree(struct msgstream *s);
+void msgStreamAttachHeaders(const char *border, const char *file, dstrbuf *out);
+
+#endif /* __MSGSTREAM_H */
@@ -23,7 +23,11 @@
 #ifndef PROCESSMAIL_H
 #define PROCESSMAIL_H  1
 
-int processInternal(const char *smbin, dstrbuf *msg);
-int processRemote(const char *host, int port, dstrbuf *msg);
+#include "msgstream.h"
+
+int processInternal(const char *smbin, struct msgstream *msg);
+int processRemote(const char *host, int port, struct msgstream *msg);
+void processRemoteQuit(void);
+bool processRemoteTemporary(void);
 
 #endif /* PROCESSMAIL_H */
@@ -23,6 +23,12 @@
 #ifndef __REMOTESMTP_H
 #define __REMOTESMTP_H   1
 
-int sendmail(dstrbuf *msg);
+#include "smtpengine.h"
+#include "msgstream.h"
+
+int sendmail(struct msgstream *msg);
+bool sendmailTemporary(void);
+void sendmailClose(void);
+int sendmailBatch(smtpjobfeed feed, smtpjobdone done, void *arg);
 
 #endif /* __REMOTESMTP_H */
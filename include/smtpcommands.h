@@ -3,10 +3,37 @@
 
 #include "dnet.h"
 
+/* Extensions an SMTP server may advertise in it's EHLO response */
+#define SMTP_CAP_PIPELINING  0x01
+#define SMTP_CAP_SIZE        0x02
+#define SMTP_CAP_8BITMIME    0x04
+#define SMTP_CAP_CHUNKING    0x08
+#define SMTP_CAP_SMTPUTF8    0x10
+#define SMTP_CAP_STARTTLS    0x20
+#define SMTP_CAP_AUTH        0x40
+
+/* BDAT chunks that can be waiting on a reply when pipelining */
+#define BDAT_MAX_PENDING   32
+
+struct smtpcaps {
+	u_int flags;       /* SMTP_CAP_* */
+	size_t size;       /* SIZE limit, 0 if there isn't one */
+	dvector auth;      /* AUTH mechanisms, NULL if none */
+};
+
 char *smtpGetErr(void);
+bool smtpErrTemporary(void);
+dlist smtpGetDeferred(void);
 int smtpInitAuth(dsocket *sd, const char *auth, const char *user, const char *pass);
 int smtpInit(dsocket *sd, const char *domain);
+struct smtpcaps *smtpGetCaps(dsocket *sd);
+void smtpCapsClear(struct smtpcaps *c);
+void smtpCapsLine(struct smtpcaps *c, const char *line);
+bool smtpHasCap(dsocket *sd, u_int cap);
+bool smtpHasAuth(dsocket *sd, const char *mech);
 int smtpStartTls(dsocket *sd);
+int smtpReset(dsocket *sd);
+bool smtpIsClosed(dsocket *sd);
 int smtpSetMailFrom(dsocket *sd, const char *from);
 int smtpSetRcpt(dsocket *sd, const char *to);
 int smtpStartData(dsocket *sd);
@@ -0,0 +1,65 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#ifndef __SMTPENGINE_H
+#define __SMTPENGINE_H   1
+
+#define SMTP_MAX_RELAYS  32
+
+/* A server the engine can send through */
+struct smtprelay {
+	char *host;
+	int port;
+	u_int weight;		/* It's share of the connections */
+};
+
+/* A message waiting to be sent by the engine */
+struct smtpjob {
+	dstrbuf *msg;		/* The message as it's to be sent */
+	char **rcpts;		/* Who it's going to */
+	size_t nrcpts;
+	size_t rcpts_size;	/* Room in rcpts */
+	int status;		/* SUCCESS or ERROR once it's been tried */
+	dstrbuf *err;		/* What went wrong if status is ERROR */
+	bool temporary;		/* err might go away if it's tried again later */
+	char **deferred;	/* Recipients the server turned away for now (4xx) */
+	size_t ndeferred;
+	u_int tried;		/* Relays it's been tried on, one bit each */
+	void *data;		/* Whatever the caller wants to keep with it */
+};
+
+/* Hands the engine it's next job, or NULL when there are no more */
+typedef struct smtpjob *(*smtpjobfeed)(void *arg);
+
+/* Tells the caller a job is done.  The job belongs to the caller again */
+typedef void (*smtpjobdone)(struct smtpjob *job, void *arg);
+
+struct smtpjob *smtpJobNew(dstrbuf *msg);
+void smtpJobAddRcpt(struct smtpjob *job, const char *email);
+void smtpJobDefer(struct smtpjob *job, const char *email);
+void smtpJobDestroy(struct smtpjob *job);
+
+bool smtpEngineUsable(void);
+int smtpEngineRun(struct smtprelay *relays, u_int nrelays, u_int sessions,
+	smtpjobfeed feed, smtpjobdone done, void *arg);
+
+#endif /* __SMTPENGINE_H */
@@ -34,6 +34,15 @@ typedef enum {
 	IS_OTHER
 } CharSetType;
 
+/* The nanoseconds of a file's times, or 0 where stat() doesn't have them */
+#if HAVE_STRUCT_STAT_ST_MTIM
+# define STAT_MTIME_NSEC(st)  ((long long)(st)->st_mtim.tv_nsec)
+# define STAT_CTIME_NSEC(st)  ((long long)(st)->st_ctim.tv_nsec)
+#else
+# define STAT_MTIME_NSEC(st)  0LL
+# define STAT_CTIME_NSEC(st)  0LL
+#endif
+
 dstrbuf *expandPath(const char *path);
 int copyfile(const char *from, const char *to);
 dstrbuf *randomString(size_t size);
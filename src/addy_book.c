@@ -27,6 +27,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #include "email.h"
 #include "addr_parse.h"
@@ -41,6 +50,7 @@
  * e_gors == "group" for group "single" for single and NULL for neither
  * e_name == Name of entry
  * e_addr == Addresses found with entry 
+ * e_line == Line the entry ends on, to point at it if it's broken
  *
  */
 
@@ -48,17 +58,87 @@ typedef struct {
 	char *e_gors;
 	char *e_name;
 	char *e_addr;
+	int e_line;
 } ENTRY;
 
+/**
+ * The address book is compiled into <book>.idx the first time it's
+ * read, so later runs can map that in instead of parsing the text.
+ * It's a header, a table of entries sorted by lowercased name, and 
+ * the strings the entries point into.  It's rebuilt whenever the 
+ * book's size, inode, or modification or change time (to the
+ * nanosecond, where the system keeps it) don't match the header.
+**/
+#define BOOK_INDEX_MAGIC    "EMAB"
+#define BOOK_INDEX_VERSION  2
+
+struct bookidx_head {
+	char magic[4];
+	u_int version;
+	u_int count;		/* Entries in the table */
+	u_int pool_len;		/* Bytes of strings after the table */
+	long long book_size;	/* The book it was compiled from */
+	long long book_mtime;
+	long long book_mtime_ns;
+	long long book_ctime;
+	long long book_ctime_ns;
+	long long book_ino;
+};
+
+struct bookidx_ent {
+	u_int key;		/* Offsets into the strings */
+	u_int gors;		/* Empty if the entry is broken */
+	u_int name;
+	u_int addr;
+	int line;
+};
+
+/* A group that's been expanded, or is in the middle of it */
+struct groupexp {
+	bool done;		/* false while it's members are being looked up */
+	bool complete;		/* It didn't run into a group above it */
+	u_int depth;		/* How deep it is while it's being looked up */
+	dlist addrs;		/* Who it came out to */
+};
+
+/* The address book, either parsed from the text or mapped from the index */
+struct addrbook {
+	dhash hash;		/* Entries keyed by lowercased name */
+	ENTRY **list;		/* The same entries, to write the index from */
+	u_int nlist;
+	char *map;		/* The whole index file */
+	size_t map_len;
+	bool mapped;		/* map came from mmap() rather than xmalloc() */
+	const struct bookidx_ent *ents;
+	u_int count;
+	const char *pool;
+	u_int pool_len;
+	dhash groups;		/* Expanded groups keyed by lowercased name */
+	u_int depth;		/* Groups being looked up right now */
+	u_int low;		/* Shallowest of them the current one ran into */
+};
+
+static struct addrbook *addr_book = NULL;
+
+/* A list of addresses being put together, and the emails already on it */
+struct namelist {
+	dlist list;
+	dhash seen;		/* Lowercased emails */
+};
+
 /**
  * Frees an ENTRY structure if it needs to be feed 
 **/
 static void
-freeEntry(ENTRY *en)
+freeEntry(void *ptr)
 {
-	xfree(en->e_gors);
-	xfree(en->e_name);
-	xfree(en->e_addr);
+	ENTRY *en = (ENTRY *)ptr;
+	if (en) {
+		xfree(en->e_gors);
+		xfree(en->e_name);
+		xfree(en->e_addr);
+		xfree(en);
+	}
 }
 
 
@@ -79,36 +159,31 @@ addrDestr(void *ptr)
 	}
 }
 
+static void
+groupDestr(void *ptr)
+{
+	struct groupexp *grp = (struct groupexp *)ptr;
+	if (grp) {
+		dlDestroy(grp->addrs);
+		xfree(grp);
+	}
+}
+
 	
 /** 
  * Seperate will take a string of command separated fields
  * and with separate them into a linked list for return 
- * by the function.
+ * by the function.  There's no limit on how many there are
+ * or how long they are.
 **/
 static dlist
 separate(char *string)
 {
 	char *next;
-	int counter;
 	dlist ret = dlInit(separateDestr);
 
-	counter = 0;
 	next = strtok(string, ",");
 	while (next) {
-		/* don't let our counter get over 99 address' */
-		if (counter == 99) {
-			break;
-		}
-
-		/**
-		 * make sure that next isn't too large, if it is, don't store it
-		 * get next element and move on...
-		 */
-		if (strlen(next) > MAXBUF) {
-			next = strtok(NULL, ",");
-			continue;
-		}
-
 		/* Get rid of white spaces */
 		while (*next == ' ' || *next == '\t') {
 			next++;
@@ -116,11 +191,26 @@ separate(char *string)
 
 		dlInsertTop(ret, xstrdup(next));
 		next = strtok(NULL, ",");
-		counter++;
 	}
 	return ret;
 }
 
+/**
+ * About how many names are in a comma separated string, 
+ * to size tables with.
+**/
+static size_t
+nameCount(const char *str)
+{
+	size_t count=1;
+
+	while ((str = strchr(str, ',')) != NULL) {
+		count++;
+		str++;
+	}
+	return count;
+}
+
 /**
  * Makes sure that all values are available for storage in
  * the ENTRY structure.  
@@ -150,51 +240,98 @@ makeEntry(ENTRY *en, const char *gors, const char *name, const char *addr)
 }
 
 /**
- * Parses the address book file in search of the correct
- * entry.  If the entry desired is found, then it is stored
- * in the ENTRY structure that is passed.
+ * Returns a lowercased copy of name to use as a key 
+ * into the address book.
+**/
+static char *
+bookKey(const char *name)
+{
+	char *key = xstrdup(name);
+	char *p;
+
+	for (p = key; *p != '\0'; p++) {
+		*p = tolower((u_char)*p);
+	}
+	return key;
+}
+
+/**
+ * Puts the entry that was just read into the book under it's
+ * name.  If the name is already there, the first one is kept
+ * as it's the one a search from the top would have found.  An
+ * entry that's missing something is kept with it's line so 
+ * that whoever uses it can be told where it's broken.
+**/
+static void
+bookInsert(struct addrbook *book, const char *gors, const char *name,
+	const char *addr, int line)
+{
+	ENTRY *en;
+	char *key;
+
+	if (*name == '\0') {
+		return;
+	}
+	key = bookKey(name);
+	if (!dhGetItem(book->hash, key)) {
+		en = xmalloc(sizeof(ENTRY));
+		en->e_gors = en->e_name = en->e_addr = NULL;
+		en->e_line = line;
+		if (makeEntry(en, gors, name, addr) == ERROR) {
+			en->e_name = xstrdup(name);
+		}
+		dhInsert(book->hash, key, en);
+		book->list = xrealloc(book->list, (book->nlist + 1) * sizeof(ENTRY *));
+		book->list[book->nlist++] = en;
+	}
+	xfree(key);
+}
+
+/**
+ * Parses the whole address book file into book.  
+ * Returns 0 if all is well, or the line number where
+ * the file isn't formatted properly.
 **/
 static int
-getEntry(ENTRY *en, char *ent, FILE *book)
+readBook(struct addrbook *book, FILE *in)
 {
 	int ch, line=1;
 	dstrbuf *ptr, *gors;
 	dstrbuf *name, *addr;
 
-	assert(book != NULL);
-	rewind(book); /* start at top of file */
+	assert(in != NULL);
 
 	gors = DSB_NEW;
 	name = DSB_NEW;
 	addr = DSB_NEW;
 	ptr = gors;
-	en->e_gors = en->e_name = en->e_addr = NULL;
 
-	while ((ch = fgetc(book)) != EOF) {
+	while ((ch = fgetc(in)) != EOF) {
 		switch (ch) {
 		case '#':
-			while ((ch = fgetc(book)) != '\n')
+			while ((ch = fgetc(in)) != '\n' && ch != EOF)
 				;
+			ch = '\n';
 			break;
 		case '\\':
-			ch = fgetc(book);
+			ch = fgetc(in);
 			if (ch == '\r') {
-				ch = fgetc(book);
+				ch = fgetc(in);
 			}
-			if (ch != '\n') {
+			if (ch != '\n' && ch != EOF) {
 				dsbCatChar(ptr, ch);
 			}
 			line++;
 			ch = 0;
 			break;
 		case '\'':
-			if (copyUpTo(ptr, ch, book) == '\n') {
+			if (copyUpTo(ptr, ch, in) == '\n') {
 				ch = line;
 				goto exit;
 			}
 			break;
 		case '"':
-			if (copyUpTo(ptr, ch, book) == '\n') {
+			if (copyUpTo(ptr, ch, in) == '\n') {
 				ch = line;
 				goto exit;
 			}
@@ -231,55 +368,410 @@ getEntry(ENTRY *en, char *ent, FILE *book)
 		}
 
 		if (ch == '\n') {
-			if (strcasecmp(name->str, ent) == 0) {
-				if (makeEntry(en, gors->str, name->str, addr->str) 
-					== ERROR) {
-					ch = line;
-					goto exit;
-				}
-				ch = 0;
-				goto exit;
-			}
-
-			/* Let's keep looking ! */
-			dsbDestroy(gors);
-			dsbDestroy(name);
-			dsbDestroy(addr);
-			gors = DSB_NEW;
-			name = DSB_NEW;
-			addr = DSB_NEW;
+			bookInsert(book, gors->str, name->str, addr->str, line);
+			dsbClear(gors);
+			dsbClear(name);
+			dsbClear(addr);
 			ptr = gors;
 			line++;
 		}
 	}
 
+	/* The last line might not have had a newline */
+	bookInsert(book, gors->str, name->str, addr->str, line);
+	ch = 0;
+
 exit:
 	dsbDestroy(gors);
 	dsbDestroy(name);
 	dsbDestroy(addr);
-
-	/* Possible EOF or Line number */
 	return ch;
 }
 
+/**
+ * Gets a string out of a mapped index.  Offsets past the end
+ * give back an empty string rather than wandering off.
+**/
+static const char *
+bookString(struct addrbook *book, u_int off)
+{
+	if (off >= book->pool_len) {
+		return "";
+	}
+	return book->pool + off;
+}
+
+/**
+ * Finds name in the book and copies the entry into en.  Entries 
+ * from a mapped index point into the map, so nothing in en is
+ * to be changed or freed.  Returns false if it isn't there.
+**/
+static bool
+bookLookup(struct addrbook *book, const char *name, ENTRY *en)
+{
+	int cmp;
+	u_int low=0, high=0, mid=0;
+	bool found=false;
+	ENTRY *item;
+	char *key = bookKey(name);
+
+	if (book->hash) {
+		item = (ENTRY *)dhGetItem(book->hash, key);
+		if (item) {
+			*en = *item;
+			found = true;
+		}
+		goto exit;
+	}
+
+	high = book->count;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		cmp = strcmp(key, bookString(book, book->ents[mid].key));
+		if (cmp == 0) {
+			en->e_gors = (char *)bookString(book, book->ents[mid].gors);
+			en->e_name = (char *)bookString(book, book->ents[mid].name);
+			en->e_addr = (char *)bookString(book, book->ents[mid].addr);
+			en->e_line = book->ents[mid].line;
+			if (*en->e_gors == '\0') {
+				en->e_gors = NULL;
+			}
+			found = true;
+			break;
+		} else if (cmp < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+
+exit:
+	xfree(key);
+	return found;
+}
+
+/**
+ * Maps in the compiled index at path if it was made from the 
+ * book described by st.  Returns NULL if it's missing, stale
+ * or doesn't look right, and the book has to be read instead.
+**/
+static struct addrbook *
+bookMapIndex(const char *path, struct stat *st)
+{
+	int fd;
+	struct stat ist;
+	struct bookidx_head *head;
+	size_t table_len;
+	struct addrbook *book = NULL;
+	char *map = NULL;
+	bool mapped = false;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &ist) == -1 || ist.st_size < (off_t)sizeof(*head)) {
+		goto exit;
+	}
+#if HAVE_SYS_MMAN_H
+	map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		goto exit;
+	}
+	mapped = true;
+#else
+	map = xmalloc(ist.st_size);
+	if (read(fd, map, ist.st_size) != ist.st_size) {
+		goto exit;
+	}
+#endif
+
+	head = (struct bookidx_head *)map;
+	if (memcmp(head->magic, BOOK_INDEX_MAGIC, 4) != 0 ||
+	    head->version != BOOK_INDEX_VERSION ||
+	    head->book_size != (long long)st->st_size ||
+	    head->book_mtime != (long long)st->st_mtime ||
+	    head->book_mtime_ns != STAT_MTIME_NSEC(st) ||
+	    head->book_ctime != (long long)st->st_ctime ||
+	    head->book_ctime_ns != STAT_CTIME_NSEC(st) ||
+	    head->book_ino != (long long)st->st_ino) {
+		goto exit;
+	}
+	table_len = (size_t)head->count * sizeof(struct bookidx_ent);
+	if (head->pool_len == 0 || (size_t)ist.st_size != 
+	    sizeof(*head) + table_len + head->pool_len) {
+		goto exit;
+	}
+	if (map[ist.st_size - 1] != '\0') {
+		goto exit;
+	}
+
+	book = xmalloc(sizeof(struct addrbook));
+	memset(book, 0, sizeof(struct addrbook));
+	book->map = map;
+	book->map_len = ist.st_size;
+	book->mapped = mapped;
+	book->ents = (const struct bookidx_ent *)(map + sizeof(*head));
+	book->count = head->count;
+	book->pool = map + sizeof(*head) + table_len;
+	book->pool_len = head->pool_len;
+
+exit:
+	close(fd);
+	if (!book && map) {
+#if HAVE_SYS_MMAN_H
+		munmap(map, ist.st_size);
+#else
+		xfree(map);
+#endif
+	}
+	return book;
+}
+
+struct bookidx_sort {
+	char *key;
+	ENTRY *en;
+};
+
+static int
+bookSortCmp(const void *a, const void *b)
+{
+	return strcmp(((const struct bookidx_sort *)a)->key,
+		((const struct bookidx_sort *)b)->key);
+}
+
+/**
+ * How much room str takes up in the strings of the index.
+**/
+static size_t
+bookPoolLen(const char *str)
+{
+	if (!str || *str == '\0') {
+		return 0;
+	}
+	return strlen(str) + 1;
+}
+
+/**
+ * Adds str to the strings of the index and returns where it is.
+ * NULL goes in as the empty string at the very start.
+**/
+static u_int
+bookPoolAdd(char *pool, size_t *pool_len, const char *str)
+{
+	size_t len = bookPoolLen(str);
+	u_int off = *pool_len;
+
+	if (len == 0) {
+		return 0;
+	}
+	memcpy(pool + off, str, len);
+	*pool_len += len;
+	return off;
+}
+
+/**
+ * Writes the book that was just parsed out to the index at path,
+ * stamped with what st says about the book.  It's only a cache,
+ * so if it can't be written the next run just parses the book
+ * again.  It's written to a temporary file and renamed over the
+ * old one, so nobody ever maps half of it.
+**/
+static void
+bookWriteIndex(struct addrbook *book, const char *path, struct stat *st)
+{
+	u_int i;
+	FILE *out=NULL;
+	struct bookidx_head head;
+	struct bookidx_ent ent;
+	struct bookidx_sort *sorted=NULL;
+	char *pool=NULL;
+	size_t pool_len=1, pool_size=1;
+	dstrbuf *tmp = DSB_NEW;
+
+	sorted = xmalloc((book->nlist + 1) * sizeof(struct bookidx_sort));
+	for (i=0; i < book->nlist; i++) {
+		sorted[i].key = bookKey(book->list[i]->e_name);
+		sorted[i].en = book->list[i];
+		pool_size += bookPoolLen(sorted[i].key) + 
+			bookPoolLen(sorted[i].en->e_gors) +
+			bookPoolLen(sorted[i].en->e_name) + 
+			bookPoolLen(sorted[i].en->e_addr);
+	}
+	qsort(sorted, book->nlist, sizeof(struct bookidx_sort), bookSortCmp);
+
+	/* Offset 0 is the empty string */
+	pool = xmalloc(pool_size);
+	pool[0] = '\0';
+
+	dsbPrintf(tmp, "%s.%d.tmp", path, (int)getpid());
+	out = fopen(tmp->str, "w");
+	if (!out) {
+		goto exit;
+	}
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, BOOK_INDEX_MAGIC, 4);
+	head.version = BOOK_INDEX_VERSION;
+	head.count = book->nlist;
+	head.book_size = st->st_size;
+	head.book_mtime = st->st_mtime;
+	head.book_mtime_ns = STAT_MTIME_NSEC(st);
+	head.book_ctime = st->st_ctime;
+	head.book_ctime_ns = STAT_CTIME_NSEC(st);
+	head.book_ino = st->st_ino;
+	/* The pool length goes in once it's known */
+	if (fwrite(&head, sizeof(head), 1, out) != 1) {
+		goto exit;
+	}
+	for (i=0; i < book->nlist; i++) {
+		ent.key = bookPoolAdd(pool, &pool_len, sorted[i].key);
+		ent.gors = bookPoolAdd(pool, &pool_len, sorted[i].en->e_gors);
+		ent.name = bookPoolAdd(pool, &pool_len, sorted[i].en->e_name);
+		ent.addr = bookPoolAdd(pool, &pool_len, sorted[i].en->e_addr);
+		ent.line = sorted[i].en->e_line;
+		if (fwrite(&ent, sizeof(ent), 1, out) != 1) {
+			goto exit;
+		}
+	}
+	head.pool_len = pool_len;
+	if (fwrite(pool, 1, pool_len, out) != pool_len ||
+	    fseek(out, 0, SEEK_SET) == -1 ||
+	    fwrite(&head, sizeof(head), 1, out) != 1) {
+		goto exit;
+	}
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto exit;
+	}
+	out = NULL;
+	if (rename(tmp->str, path) == -1) {
+		goto exit;
+	}
+	dsbClear(tmp);
+
+exit:
+	if (out) {
+		fclose(out);
+	}
+	if (tmp->len) {
+		unlink(tmp->str);
+	}
+	for (i=0; i < book->nlist; i++) {
+		xfree(sorted[i].key);
+	}
+	xfree(sorted);
+	xfree(pool);
+	dsbDestroy(tmp);
+}
+
+/**
+ * Reads in the address book named by ADDRESS_BOOK the first 
+ * time it's needed.  If there's an up to date index next to it
+ * that's mapped in, otherwise the book is parsed and the index
+ * is written for next time.  Every lookup after that is just a 
+ * hash lookup or a binary search.
+**/
+static struct addrbook *
+loadAddrBook(const char *path)
+{
+	int line;
+	FILE *in;
+	struct stat st;
+	dstrbuf *ipath=NULL;
+
+	if (addr_book) {
+		return addr_book;
+	}
+
+	ipath = DSB_NEW;
+	in = fopen(path, "r");
+	if (!in || fstat(fileno(in), &st) == -1) {
+		fatal("Can't open address book: '%s'\n", path);
+		goto exit;
+	}
+
+	dsbPrintf(ipath, "%s.idx", path);
+	addr_book = bookMapIndex(ipath->str, &st);
+	if (addr_book) {
+		goto exit;
+	}
+
+	addr_book = xmalloc(sizeof(struct addrbook));
+	memset(addr_book, 0, sizeof(struct addrbook));
+	addr_book->hash = dhInit(1024, freeEntry);
+	line = readBook(addr_book, in);
+	if (line > 0) {
+		fatal("Address book incorrectly formated on line %d\n", line);
+		freeAddrBook();
+		goto exit;
+	}
+	bookWriteIndex(addr_book, ipath->str, &st);
+
+exit:
+	if (in) {
+		fclose(in);
+	}
+	dsbDestroy(ipath);
+	return addr_book;
+}
+
+/**
+ * Frees the address book if it was ever read.
+**/
+void
+freeAddrBook(void)
+{
+	if (!addr_book) {
+		return;
+	}
+	if (addr_book->hash) {
+		dhDestroy(addr_book->hash);
+	}
+	if (addr_book->groups) {
+		dhDestroy(addr_book->groups);
+	}
+	xfree(addr_book->list);
+	if (addr_book->mapped) {
+#if HAVE_SYS_MMAN_H
+		munmap(addr_book->map, addr_book->map_len);
+#endif
+	} else {
+		xfree(addr_book->map);
+	}
+	xfree(addr_book);
+	addr_book = NULL;
+}
 
 /**
  * Add an email to the list.  Make sure it is formated properly.
- * After formated properly, list_insert() it 
+ * After formated properly, list_insert() it.  An email that's
+ * already on the list, in any case, isn't added again.
 **/
 static void
-insertEntry(dlist to, const char *name, const char *addr)
+insertEntry(struct namelist *to, const char *name, const char *addr)
 {
-	struct addr *newaddr = xmalloc(sizeof(struct addr));
+	char *key=NULL;
+	struct addr *newaddr=NULL;
+
 	if (validateEmail(addr) == ERROR) {
 		warning("Email address '%s' is invalid. Skipping...\n", addr);
 		return;
 	}
-	if (*name != '\0' && strcmp(name, "") != 0) { 
+	key = bookKey(addr);
+	if (dhGetItem(to->seen, key)) {
+		xfree(key);
+		return;
+	}
+	dhInsert(to->seen, key, key);
+
+	newaddr = xmalloc(sizeof(struct addr));
+	if (name && *name != '\0') { 
 		newaddr->name = xstrdup(name);
 	}
 	newaddr->email = xstrdup(addr);
-	dlInsertTop(to, newaddr);
+	dlInsertTop(to->list, newaddr);
 }
 
 /**
@@ -287,7 +779,7 @@ insertEntry(dlist to, const char *name, const char *addr)
  * (ie not an address book entry.)
  */
 static void
-insertAddrEntry(dlist to, const char *addr)
+insertAddrEntry(struct namelist *to, const char *addr)
 {
 	dstrbuf *name = DSB_NEW;
 	dstrbuf *email = DSB_NEW;
@@ -306,7 +798,7 @@ insertAddrEntry(dlist to, const char *addr)
  * properly and copies it over to the new list.
 **/
 static void
-checkAndCopy(dlist to, dlist from)
+checkAndCopy(struct namelist *to, dlist from)
 {
 	char *next=NULL;
 	while ((next=(char *)dlGetNext(from)) != NULL) {
@@ -314,35 +806,32 @@ checkAndCopy(dlist to, dlist from)
 	}
 }
 
-static int addEntry(dlist to, ENTRY *en, FILE *book);
+static int addEntry(struct namelist *to, ENTRY *en, struct addrbook *book);
 
 /**
- * Loops through the linked list and calls Get_entry for
- * each name in the linked list.  It will add each entry into
+ * Loops through the linked list and looks up each name 
+ * in the address book.  It will add each entry into
  * the 'to' linked lists when an appropriate match is found
  * from the address book.
 **/
 static int
-checkAddrBook(dlist to, dlist from, FILE *book)
+checkAddrBook(struct namelist *to, dlist from, struct addrbook *book)
 {
 	ENTRY en;
-	int retval;
 	char *next=NULL;
 
 	/* Go through list from, resolving to list curr */
 	while ((next=(char *)dlGetNext(from)) != NULL) {
-		retval = getEntry(&en, next, book);
-		if (retval > 0) {
-			fatal("Address book incorrectly formated on line %d\n", retval);
-			return ERROR;
-		} else if (retval == EOF) {
+		if (!bookLookup(book, next, &en)) {
 			insertAddrEntry(to, next);
+		} else if (!en.e_gors) {
+			fatal("Address book incorrectly formated on line %d\n", en.e_line);
+			return ERROR;
 		} else {
 			if (addEntry(to, &en, book) == ERROR) {
 				return ERROR;
 			}
 		}
-		freeEntry(&en);
 	}
 	return SUCCESS; 
 }
@@ -351,24 +840,80 @@ checkAddrBook(dlist to, dlist from, FILE *book)
  * Add an entry to the linked lists.
  * If entry is a group, we must separate the people inside of 
  * the group and re-call check_addr_book for those entries.
+ * Groups can name other groups.  Each group is only looked up
+ * once, and what it came out to is kept in the book for the 
+ * next time it's used.  A group that's still being looked up 
+ * when it's named again includes itself, and is skipped there.
+ * Any group looked up inside such a loop, other than the one
+ * the loop started from, is then missing what the rest of the
+ * loop has yet to add.  So like Tarjan's lowlink, each group
+ * keeps the shallowest group it ran into that was still being
+ * looked up, and one that ran into a group above it isn't kept.
+ * It's looked up again the next time it's named.
 **/
 static int
-storeGroup(dlist to, ENTRY *en, FILE *book)
+storeGroup(struct namelist *to, ENTRY *en, struct addrbook *book)
 {
-	static int set_group;
+	int retval=SUCCESS;
+	char *key=NULL;
+	char *addrs=NULL;
 	dlist tmp=NULL;
+	struct addr *a=NULL;
+	struct groupexp *grp=NULL;
+	struct namelist members;
+	u_int low;
 
-	if (set_group) {
-		fatal("You can't define groups within groups!\n");
-		return ERROR;
+	if (!book->groups) {
+		book->groups = dhInit(64, groupDestr);
+	}
+	key = bookKey(en->e_name);
+	grp = (struct groupexp *)dhGetItem(book->groups, key);
+	if (grp && !grp->done) {
+		warning("Group '%s' includes itself. Skipping...\n", en->e_name);
+		if (grp->depth < book->low) {
+			book->low = grp->depth;
+		}
+		goto end;
 	}
 
-	tmp = separate(en->e_addr);
-	set_group = 1;
-	checkAddrBook(to, tmp, book);
-	set_group = 0;
-	dlDestroy(tmp);
-	return 0;
+	if (!grp || !grp->complete) {
+		if (!grp) {
+			grp = xmalloc(sizeof(struct groupexp));
+			dhInsert(book->groups, key, grp);
+		} else {
+			/* It came out short last time, start it over */
+			dlDestroy(grp->addrs);
+		}
+		grp->done = false;
+		grp->addrs = dlInit(addrDestr);
+		grp->depth = book->depth++;
+		low = book->low;
+		book->low = grp->depth;
+
+		members.list = grp->addrs;
+		members.seen = dhInit(nameCount(en->e_addr), separateDestr);
+		/* separate() cuts up what it's given, and the entry is kept */
+		addrs = xstrdup(en->e_addr);
+		tmp = separate(addrs);
+		retval = checkAddrBook(&members, tmp, book);
+		dlDestroy(tmp);
+		xfree(addrs);
+		dhDestroy(members.seen);
+		grp->done = true;
+		grp->complete = (book->low >= grp->depth);
+		book->depth--;
+		if (book->low > low) {
+			book->low = low;
+		}
+	}
+
+	while ((a = (struct addr *)dlGetNext(grp->addrs)) != NULL) {
+		insertEntry(to, a->name, a->email);
+	}
+
+end:
+	xfree(key);
+	return retval;
 }
 
 /**
@@ -377,7 +922,7 @@ storeGroup(dlist to, ENTRY *en, FILE *book)
  * one of the above.
 **/
 static int
-addEntry(dlist to, ENTRY *en, FILE *book)
+addEntry(struct namelist *to, ENTRY *en, struct addrbook *book)
 {
 	if (strcmp(en->e_gors, "group") == 0) {
 		if (storeGroup(to, en, book) == ERROR) {
@@ -395,41 +940,128 @@ addEntry(dlist to, ENTRY *en, FILE *book)
  * split up the names passed to email and check
  * them against the address book and it will return 
  * a linked list 'list_t' with the correct separate names.
+ * Nobody is on the list twice.
 **/
 dlist
 getNames(char *string)
 {
-	FILE *book;
-	char *addr_book;
+	struct addrbook *book;
+	char *book_path = Conf.address_book;
 	dlist tmp = NULL;
-	dstrbuf *bpath=NULL;
-	dlist ret = dlInit(addrDestr);
-
-	addr_book = getConfValue("ADDRESS_BOOK");
+	struct namelist ret;
+	size_t count = nameCount(string);
 
 	/* Read in and hash the address book */
 	if (!(tmp = separate(string))) {
 		return NULL;
 	}
 
-	if (!addr_book) {
-		checkAndCopy(ret, tmp);
+	ret.list = dlInit(addrDestr);
+	ret.seen = dhInit(count, separateDestr);
+	if (!book_path) {
+		checkAndCopy(&ret, tmp);
 	} else {
-		bpath = expandPath(addr_book);
-		book = fopen(bpath->str, "r");
+		book = loadAddrBook(book_path);
 		if (!book) {
-			fatal("Can't open address book: '%s'\n", bpath->str);
-			dlDestroy(ret);
-			dlDestroy(tmp);
-			dsbDestroy(bpath);
-			return NULL;
+			dlDestroy(ret.list);
+			ret.list = NULL;
+			goto end;
 		}
-		dsbDestroy(bpath);
-		checkAddrBook(ret, tmp, book);
-		fclose(book);
+		checkAddrBook(&ret, tmp, book);
 	}
 
+end:
+	dhDestroy(ret.seen);
 	dlDestroy(tmp);
+	return ret.list;
+}
+
+/**
+ * Puts together who a message actually goes to, from the To,
+ * Cc and Bcc lists, any of which can be NULL.  Anyone on more
+ * than one of them, in any case, is only on it once so they
+ * only get one RCPT.  Returns a list of emails.
+**/
+dlist
+getRcpts(dlist to, dlist cc, dlist bcc)
+{
+	int i;
+	size_t count=0;
+	char *key=NULL;
+	struct addr *next=NULL;
+	dlist lists[3];
+	dlist ret = dlInit(separateDestr);
+	dhash seen = NULL;
+
+	lists[0] = to;
+	lists[1] = cc;
+	lists[2] = bcc;
+	for (i=0; i < 3; i++) {
+		while (lists[i] && dlGetNext(lists[i]) != NULL) {
+			count++;
+		}
+	}
+
+	seen = dhInit(count + 1, separateDestr);
+	for (i=0; i < 3; i++) {
+		if (!lists[i]) {
+			continue;
+		}
+		while ((next = (struct addr *)dlGetNext(lists[i])) != NULL) {
+			key = bookKey(next->email);
+			if (dhGetItem(seen, key)) {
+				xfree(key);
+				continue;
+			}
+			dhInsert(seen, key, key);
+			dlInsertTop(ret, xstrdup(next->email));
+		}
+	}
+	dhDestroy(seen);
 	return ret;
 }
 
+/**
+ * Reads recipients from file, or from stdin if file is "-", and 
+ * adds them to names, separated by commas, for getNames().  There
+ * can be one or more to a line with commas between them.  Blank 
+ * lines and lines starting with # are skipped.
+**/
+int
+readRcptFile(const char *file, dstrbuf *names)
+{
+	int retval=SUCCESS;
+	char *ptr=NULL;
+	FILE *in=NULL;
+	dstrbuf *line=NULL;
+
+	if (strcmp(file, "-") == 0) {
+		in = stdin;
+	} else if (!(in = fopen(file, "r"))) {
+		return ERROR;
+	}
+
+	line = DSB_NEW;
+	while (!feof(in)) {
+		dsbReadline(line, in);
+		chomp(line->str);
+		for (ptr = line->str; *ptr == ' ' || *ptr == '\t'; ptr++)
+			;
+		if (*ptr == '\0' || *ptr == '#') {
+			continue;
+		}
+		if (names->len != 0) {
+			dsbCat(names, ",");
+		}
+		dsbCat(names, ptr);
+	}
+	if (ferror(in)) {
+		retval = ERROR;
+	}
+
+	dsbDestroy(line);
+	if (in != stdin) {
+		fclose(in);
+	}
+	return retval;
+}
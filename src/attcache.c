@@ -0,0 +1,515 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "email.h"
+#include "mimeutils.h"
+#include "file_io.h"
+#include "utils.h"
+#include "attcache.h"
+#include "error.h"
+
+/**
+ * The attachment cache keeps attachments already base64 encoded
+ * in ATTACH_CACHE_DIR so they don't have to be encoded again.  The
+ * encoded data is kept in <hash>.b64, named after the SHA-256 of what's
+ * in the file, so the same file attached from anywhere is only kept
+ * once.  So we don't have to read a file to find out it's hash,
+ * <dev>-<inode>-<size>-<mtime>.<ns>-<ctime>.<ns>.ref holds the hash for
+ * each file we've seen, with both times down to the nanosecond where
+ * the system keeps them.  A file that's changed has a different size
+ * or times and so isn't found, even if it was changed twice in one
+ * second or had it's mtime set back.  Each time a .b64 file is used
+ * it's mtime is updated, and when the cache is bigger than
+ * ATTACH_CACHE_SIZE the ones used the longest time ago are removed.
+**/
+
+/* A whole number of base64 lines, like the message stream reads */
+#define ATT_CACHE_BLOCK  ((MAX_B64_LINE / 4) * 3 * 1024)
+
+#define ATT_HASH_LEN  64	/* Hex digits in a hash */
+
+/**
+ * The hash that names a .b64 file is SHA-256 of what's in the file,
+ * so two different files never end up sharing one .b64 file, even
+ * if someone makes them on purpose.
+**/
+struct atthash {
+	uint32_t state[8];
+	u_char block[64];
+	size_t used;
+	uint64_t len;
+};
+
+/* A .b64 file found while trimming the cache */
+struct attentry {
+	char *name;
+	off_t size;
+	time_t used;
+};
+
+static const uint32_t att_sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ATT_ROR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+attHashInit(struct atthash *h)
+{
+	h->state[0] = 0x6a09e667;
+	h->state[1] = 0xbb67ae85;
+	h->state[2] = 0x3c6ef372;
+	h->state[3] = 0xa54ff53a;
+	h->state[4] = 0x510e527f;
+	h->state[5] = 0x9b05688c;
+	h->state[6] = 0x1f83d9ab;
+	h->state[7] = 0x5be0cd19;
+	h->used = 0;
+	h->len = 0;
+}
+
+/**
+ * Runs one 64 byte block through the hash.
+**/
+static void
+attHashBlock(struct atthash *h, const u_char *p)
+{
+	int i;
+	uint32_t w[64], s[8], t1, t2;
+
+	for (i=0; i < 16; i++) {
+		w[i] = ((uint32_t)p[i*4] << 24) | ((uint32_t)p[i*4+1] << 16) |
+			((uint32_t)p[i*4+2] << 8) | (uint32_t)p[i*4+3];
+	}
+	for (; i < 64; i++) {
+		t1 = ATT_ROR(w[i-2], 17) ^ ATT_ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+		t2 = ATT_ROR(w[i-15], 7) ^ ATT_ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+		w[i] = w[i-16] + t2 + w[i-7] + t1;
+	}
+	memcpy(s, h->state, sizeof(s));
+	for (i=0; i < 64; i++) {
+		t1 = s[7] + (ATT_ROR(s[4], 6) ^ ATT_ROR(s[4], 11) ^
+			ATT_ROR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+			att_sha_k[i] + w[i];
+		t2 = (ATT_ROR(s[0], 2) ^ ATT_ROR(s[0], 13) ^ ATT_ROR(s[0], 22)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, sizeof(uint32_t) * 7);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i=0; i < 8; i++) {
+		h->state[i] += s[i];
+	}
+}
+
+/**
+ * Adds len bytes of buf to the hash.
+**/
+static void
+attHashUpdate(struct atthash *h, const u_char *buf, size_t len)
+{
+	size_t n;
+
+	h->len += len;
+	if (h->used) {
+		n = 64 - h->used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(h->block + h->used, buf, n);
+		h->used += n;
+		buf += n;
+		len -= n;
+		if (h->used < 64) {
+			return;
+		}
+		attHashBlock(h, h->block);
+		h->used = 0;
+	}
+	for (; len >= 64; buf += 64, len -= 64) {
+		attHashBlock(h, buf);
+	}
+	memcpy(h->block, buf, len);
+	h->used = len;
+}
+
+/**
+ * Finishes the hash and writes it out as hex to buf, which
+ * has room for ATT_HASH_LEN + 1 characters.
+**/
+static void
+attHashFinal(struct atthash *h, char *buf)
+{
+	int i;
+	uint64_t bits = h->len * 8;
+
+	h->block[h->used++] = 0x80;
+	if (h->used > 56) {
+		memset(h->block + h->used, 0, 64 - h->used);
+		attHashBlock(h, h->block);
+		h->used = 0;
+	}
+	memset(h->block + h->used, 0, 56 - h->used);
+	for (i=0; i < 8; i++) {
+		h->block[56 + i] = (u_char)(bits >> (56 - i * 8));
+	}
+	attHashBlock(h, h->block);
+	for (i=0; i < 8; i++) {
+		snprintf(buf + i * 8, 9, "%08lx", (u_long)h->state[i]);
+	}
+}
+
+/**
+ * Reads the hash out of a .ref file.
+**/
+static int
+attReadRef(const char *ref, char *hash)
+{
+	size_t len;
+	FILE *in = fopen(ref, "r");
+
+	if (!in) {
+		return ERROR;
+	}
+	len = fread(hash, sizeof(char), ATT_HASH_LEN, in);
+	fclose(in);
+	hash[len] = '\0';
+	if (len != ATT_HASH_LEN || strspn(hash, "0123456789abcdef") != len) {
+		return ERROR;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Opens the encoded file for hash if it's there and is the right
+ * size for a file of st's size, and marks it as just used.
+**/
+static FILE *
+attUse(const char *dir, const char *hash, const struct stat *st)
+{
+	FILE *in;
+	struct stat est;
+	dstrbuf *path = DSB_NEW;
+
+	dsbPrintf(path, "%s/%s.b64", dir, hash);
+	in = fopen(path->str, "r");
+	if (in && (fstat(fileno(in), &est) == -1 ||
+	    (size_t)est.st_size != mimeB64EncodedSize(st->st_size))) {
+		fclose(in);
+		in = NULL;
+	}
+	if (in) {
+		utime(path->str, NULL);
+	}
+	dsbDestroy(path);
+	return in;
+}
+
+/**
+ * Writes out a small file by way of a temp file, so nobody ever
+ * sees half of it.
+**/
+static int
+attWriteRef(const char *ref, const char *hash)
+{
+	int retval = ERROR;
+	FILE *out;
+	dstrbuf *tmp = DSB_NEW;
+
+	dsbPrintf(tmp, "%s.%d.tmp", ref, (int)getpid());
+	if ((out = fopen(tmp->str, "w")) != NULL) {
+		fputs(hash, out);
+		if (fclose(out) == 0 && rename(tmp->str, ref) == 0) {
+			retval = SUCCESS;
+		}
+	}
+	if (retval == ERROR) {
+		unlink(tmp->str);
+	}
+	dsbDestroy(tmp);
+	return retval;
+}
+
+/**
+ * Encodes file into the cache and works out it's hash as it goes.
+**/
+static int
+attEncode(const char *dir, const char *file, char *hash)
+{
+	int fd, retval = ERROR;
+	size_t len, enclen, off, map_len=0;
+	const u_char *map = NULL;
+	FILE *in=NULL, *out=NULL;
+	u_char *raw = xmalloc(ATT_CACHE_BLOCK);
+	char *enc = xmalloc(mimeB64EncodedSize(ATT_CACHE_BLOCK));
+	dstrbuf *tmp = DSB_NEW, *path = DSB_NEW;
+	struct atthash h;
+
+	dsbPrintf(tmp, "%s/.%d.XXXXXX", dir, (int)getpid());
+	if ((fd = mkstemp(tmp->str)) == -1) {
+		dsbClear(tmp);
+		goto end;
+	}
+	if (!(out = fdopen(fd, "w"))) {
+		close(fd);
+		goto end;
+	}
+	if (!(in = fopen(file, "r"))) {
+		goto end;
+	}
+
+	attHashInit(&h);
+	if ((map = mapFile(in, &map_len)) != NULL) {
+		/* Hash and encode it right out of the mapping */
+		for (off=0; off < map_len; off += len) {
+			len = map_len - off;
+			if (len > ATT_CACHE_BLOCK) {
+				len = ATT_CACHE_BLOCK;
+			}
+			attHashUpdate(&h, map + off, len);
+			enclen = mimeB64EncodeBuf(map + off, len, enc, true);
+			if (fwrite(enc, sizeof(char), enclen, out) != enclen) {
+				goto end;
+			}
+		}
+		if (unmapFile(map, map_len) == ERROR) {
+			/* It got shorter while we read it */
+			map = NULL;
+			goto end;
+		}
+		map = NULL;
+	} else {
+		while ((len = fread(raw, sizeof(u_char), ATT_CACHE_BLOCK, in)) > 0) {
+			attHashUpdate(&h, raw, len);
+			enclen = mimeB64EncodeBuf(raw, len, enc, true);
+			if (fwrite(enc, sizeof(char), enclen, out) != enclen) {
+				goto end;
+			}
+		}
+	}
+	if (ferror(in)) {
+		goto end;
+	}
+	attHashFinal(&h, hash);
+
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto end;
+	}
+	out = NULL;
+	dsbPrintf(path, "%s/%s.b64", dir, hash);
+	if (rename(tmp->str, path->str) == 0) {
+		dsbClear(tmp);
+		retval = SUCCESS;
+	}
+
+end:
+	unmapFile(map, map_len);
+	if (in) {
+		fclose(in);
+	}
+	if (out) {
+		fclose(out);
+	}
+	if (tmp->len) {
+		unlink(tmp->str);
+	}
+	xfree(raw);
+	xfree(enc);
+	dsbDestroy(tmp);
+	dsbDestroy(path);
+	return retval;
+}
+
+static int
+attEntryCmp(const void *a, const void *b)
+{
+	const struct attentry *x = a, *y = b;
+
+	if (x->used != y->used) {
+		return (x->used < y->used) ? -1 : 1;
+	}
+	return strcmp(x->name, y->name);
+}
+
+/**
+ * Removes the .b64 files that were used the longest time ago
+ * until the cache fits in ATTACH_CACHE_SIZE.  The .ref files that
+ * point at something that's gone are removed too.
+**/
+static void
+attTrim(const char *dir)
+{
+	size_t i, len, count=0;
+	off_t total=0;
+	DIR *dp;
+	struct dirent *dent;
+	struct stat st;
+	struct attentry *ents=NULL;
+	char hash[ATT_HASH_LEN + 1];
+	dstrbuf *path = DSB_NEW;
+
+	if (!(dp = opendir(dir))) {
+		goto end;
+	}
+	while ((dent = readdir(dp)) != NULL) {
+		len = strlen(dent->d_name);
+		if (len <= 4 || strcmp(dent->d_name + len - 4, ".b64") != 0) {
+			continue;
+		}
+		dsbClear(path);
+		dsbPrintf(path, "%s/%s", dir, dent->d_name);
+		if (stat(path->str, &st) == -1) {
+			continue;
+		}
+		ents = xrealloc(ents, sizeof(struct attentry) * (count + 1));
+		ents[count].name = xstrdup(dent->d_name);
+		ents[count].size = st.st_size;
+		ents[count].used = st.st_mtime;
+		total += st.st_size;
+		count++;
+	}
+	if ((size_t)total <= Conf.attach_cache_size) {
+		closedir(dp);
+		goto end;
+	}
+
+	qsort(ents, count, sizeof(struct attentry), attEntryCmp);
+	for (i=0; i < count && (size_t)total > Conf.attach_cache_size; i++) {
+		dsbClear(path);
+		dsbPrintf(path, "%s/%s", dir, ents[i].name);
+		if (unlink(path->str) == 0) {
+			total -= ents[i].size;
+		}
+	}
+
+	rewinddir(dp);
+	while ((dent = readdir(dp)) != NULL) {
+		len = strlen(dent->d_name);
+		if (len <= 4 || strcmp(dent->d_name + len - 4, ".ref") != 0) {
+			continue;
+		}
+		dsbClear(path);
+		dsbPrintf(path, "%s/%s", dir, dent->d_name);
+		if (attReadRef(path->str, hash) == SUCCESS) {
+			dsbClear(path);
+			dsbPrintf(path, "%s/%s.b64", dir, hash);
+			if (access(path->str, F_OK) == 0) {
+				continue;
+			}
+			dsbClear(path);
+			dsbPrintf(path, "%s/%s", dir, dent->d_name);
+		}
+		unlink(path->str);
+	}
+	closedir(dp);
+
+end:
+	for (i=0; i < count; i++) {
+		xfree(ents[i].name);
+	}
+	if (ents) {
+		xfree(ents);
+	}
+	dsbDestroy(path);
+}
+
+/**
+ * Opens the base64 encoding of file, which st says about, from
+ * the cache.  If it isn't there yet, it's encoded and put there.
+ *
+ * Return
+ * 	- The encoded file, exactly as mimeB64EncodeFile() would have
+ * 	  encoded it
+ * 	- NULL if there's no cache or it can't be used.  The file
+ * 	  should be encoded like normal.
+**/
+FILE *
+attCacheOpen(const char *file, const struct stat *st)
+{
+	char *dir = Conf.attach_cache_dir;
+	char hash[ATT_HASH_LEN + 1];
+	FILE *ret=NULL;
+	dstrbuf *ref=NULL;
+
+	if (!dir || !S_ISREG(st->st_mode)) {
+		return NULL;
+	}
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		return NULL;
+	}
+
+	ref = DSB_NEW;
+	dsbPrintf(ref, "%s/%lx-%lx-%lx-%lx.%llx-%lx.%llx.ref", dir,
+		(u_long)st->st_dev, (u_long)st->st_ino, (u_long)st->st_size,
+		(u_long)st->st_mtime, STAT_MTIME_NSEC(st),
+		(u_long)st->st_ctime, STAT_CTIME_NSEC(st));
+	if (attReadRef(ref->str, hash) == SUCCESS &&
+	    (ret = attUse(dir, hash, st)) != NULL) {
+		goto end;
+	}
+
+	if (attEncode(dir, file, hash) == ERROR) {
+		if (Mopts.verbose) {
+			warning("Could not put %s in ATTACH_CACHE_DIR\n", file);
+		}
+		goto end;
+	}
+	attWriteRef(ref->str, hash);
+	attTrim(dir);
+	ret = attUse(dir, hash, st);
+
+end:
+	dsbDestroy(ref);
+	return ret;
+}
@@ -39,7 +39,13 @@
 #include "utils.h"
 #include "error.h"
 
-#define MAX_CONF_VARS 20
+#define MAX_CONF_VARS 25
+
+/* What's used for the numbers that aren't set */
+#define DEFAULT_TIMEOUT            10
+#define DEFAULT_SEND_CHUNK_SIZE    65536
+#define DEFAULT_BDAT_CHUNK_SIZE    131072
+#define DEFAULT_ATTACH_CACHE_SIZE  512	/* Megabytes */
 
 /* There are the variables accepted in the configuration file */
 static char conf_vars[MAX_CONF_VARS][MAXBUF] = {
@@ -59,7 +65,15 @@ static char conf_vars[MAX_CONF_VARS][MAXBUF] = {
 	"USE_TLS",
 	"SMTP_AUTH_USER",
 	"SMTP_AUTH_PASS",
-	"VCARD"
+	"VCARD",
+	"BDAT_CHUNK_SIZE",
+	"SMTP_MAX_MESSAGES",
+	"SEND_CHUNK_SIZE",
+	"SMTP_SESSIONS",
+	"SMTP_RELAYS",
+	"SPOOL_DIR",
+	"ATTACH_CACHE_DIR",
+	"ATTACH_CACHE_SIZE"
 };
 
 /**
@@ -332,6 +346,110 @@ checkConfig(void)
 	}
 }
 
+/**
+ * Returns the value of var with ~ and & expanded, or NULL
+ * if it isn't set.
+**/
+static char *
+confPath(const char *var)
+{
+	char *ret=NULL;
+	char *val = getConfValue(var);
+	dstrbuf *path=NULL;
+
+	if (val) {
+		path = expandPath(val);
+		ret = xstrdup(path->str);
+		dsbDestroy(path);
+	}
+	return ret;
+}
+
+/**
+ * Returns the value of var as a number, or def if it isn't set.
+**/
+static long
+confNumber(const char *var, long def)
+{
+	char *val = getConfValue(var);
+
+	if (!val) {
+		return def;
+	}
+	return strtol(val, NULL, 10);
+}
+
+/**
+ * Works out every configuration value once, now that the command line
+ * and configuration file have both been read, so nobody has to look 
+ * them up and convert them again while sending.
+**/
+static void
+loadConfOptions(void)
+{
+	long num=0;
+	char *val=NULL;
+
+	Conf.smtp_server = getConfValue("SMTP_SERVER");
+	Conf.smtp_port = confNumber("SMTP_PORT", 25);
+	Conf.sendmail_bin = getConfValue("SENDMAIL_BIN");
+	Conf.my_name = getConfValue("MY_NAME");
+	Conf.my_email = getConfValue("MY_EMAIL");
+	Conf.reply_to = getConfValue("REPLY_TO");
+	Conf.signature_file = confPath("SIGNATURE_FILE");
+	Conf.address_book = confPath("ADDRESS_BOOK");
+	Conf.save_sent_mail = confPath("SAVE_SENT_MAIL");
+	Conf.temp_dir = confPath("TEMP_DIR");
+	Conf.gpg_bin = confPath("GPG_BIN");
+	Conf.gpg_pass = getConfValue("GPG_PASS");
+	Conf.smtp_auth = getConfValue("SMTP_AUTH");
+	Conf.smtp_auth_user = getConfValue("SMTP_AUTH_USER");
+	Conf.smtp_auth_pass = getConfValue("SMTP_AUTH_PASS");
+	Conf.vcard = confPath("VCARD");
+	Conf.smtp_relays = getConfValue("SMTP_RELAYS");
+	Conf.spool_dir = confPath("SPOOL_DIR");
+	Conf.attach_cache_dir = confPath("ATTACH_CACHE_DIR");
+
+	val = getConfValue("USE_TLS");
+	Conf.use_tls = (val && strcasecmp(val, "true") == 0);
+
+	Conf.timeout = confNumber("TIMEOUT", DEFAULT_TIMEOUT);
+	Conf.smtp_max_messages = confNumber("SMTP_MAX_MESSAGES", 0);
+	Conf.smtp_sessions = confNumber("SMTP_SESSIONS", 0);
+	Conf.send_chunk_size = DEFAULT_SEND_CHUNK_SIZE;
+	Conf.bdat_chunk_size = DEFAULT_BDAT_CHUNK_SIZE;
+	num = confNumber("SEND_CHUNK_SIZE", DEFAULT_SEND_CHUNK_SIZE);
+	if (num > 0) {
+		Conf.send_chunk_size = num;
+	}
+	num = confNumber("BDAT_CHUNK_SIZE", DEFAULT_BDAT_CHUNK_SIZE);
+	if (num >= 0) {
+		Conf.bdat_chunk_size = num;
+	}
+	Conf.attach_cache_size = (size_t)DEFAULT_ATTACH_CACHE_SIZE << 20;
+	num = confNumber("ATTACH_CACHE_SIZE", DEFAULT_ATTACH_CACHE_SIZE);
+	if (num >= 0) {
+		Conf.attach_cache_size = (size_t)num << 20;
+	}
+}
+
+/**
+ * Frees what loadConfOptions() made.  Everything else belongs
+ * to the configuration table.
+**/
+void
+freeConfOptions(void)
+{
+	xfree(Conf.signature_file);
+	xfree(Conf.address_book);
+	xfree(Conf.save_sent_mail);
+	xfree(Conf.temp_dir);
+	xfree(Conf.gpg_bin);
+	xfree(Conf.vcard);
+	xfree(Conf.spool_dir);
+	xfree(Conf.attach_cache_dir);
+}
+
 /**
  * this function will read the configuration file and store all values
  * in a hash table.  If some values were specified on the comand line
@@ -391,5 +509,6 @@ configure(void)
 			setConfValue("MY_EMAIL", getSystemEmail());
 		}
 	}
+	loadConfOptions();
 }
 
@@ -28,6 +28,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "getopt.h"
 
@@ -37,6 +39,7 @@
 #include "addy_book.h"
 #include "file_io.h"
 #include "message.h"
+#include "spool.h"
 #include "error.h"
 #include "mimeutils.h"
 
@@ -79,6 +82,11 @@ static struct option Gopts[] = {
 	{"to-name", 1, 0, 5},
 	{"tls", 0, 0, 6},
 	{"no-encoding", 0, 0, 7},
+	{"batch", 1, 0, 8},
+	{"queue", 0, 0, 9},
+	{"flush", 0, 0, 10},
+	{"rcpt-file", 1, 0, 11},
+	{"merge", 1, 0, 12},
 	{NULL, 0, NULL, 0 }
 };
 
@@ -118,7 +126,12 @@ usage(void)
 	    "    -g, -gpg-pass             Specify your password for GPG\n"
 	    "    -H, -header string        Add header (can be used multiple times)\n"
 	    "        -high-priority        Send the email with high priority\n"
-	    "        -no-encoding          Don't use UTF-8 encoding\n");
+	    "        -no-encoding          Don't use UTF-8 encoding\n"
+	    "        -batch file           Send a message for each line of file\n"
+	    "        -queue                Put the message in SPOOL_DIR and return\n"
+	    "        -flush                Send what's waiting in SPOOL_DIR\n"
+	    "        -rcpt-file file       Read more Bcc recipients from file\n"
+	    "        -merge file           Fill in and send the message for each record of file\n");
 
 	exit(EXIT_SUCCESS);
 }
@@ -208,6 +221,10 @@ main(int argc, char **argv)
 	int opt_index = 0;          /* for getopt */
 	char *cc_string = NULL;
 	char *bcc_string = NULL;
+	char *batch_file = NULL;
+	char *rcpt_file = NULL;
+	char *merge_file = NULL;
+	bool flush = false;
 	const char *opts = "f:n:a:p:oVedvtb?c:s:r:u:i:g:m:H:x:";
 
 	/* Set certian global options to NULL */
@@ -216,6 +233,9 @@ main(int argc, char **argv)
 	memset(&Mopts, 0, sizeof(struct mailer_options));
 	Mopts.encoding = true;
 
+	/* SMTP_RELAYS are picked at random, so each run has to pick differently */
+	srand((u_int)time(NULL) ^ ((u_int)getpid() << 16));
+
 	/* Check if they need help */
 	if ((argc > 1) && (!strcmp(argv[1], "-h") ||
 		!strcmp(argv[1], "-help") || !strcmp(argv[1], "--help"))) {
@@ -330,6 +350,21 @@ main(int argc, char **argv)
 		case 7:
 			Mopts.encoding = false;
 			break;
+		case 8:
+			batch_file = optarg;
+			break;
+		case 9:
+			Mopts.queue = true;
+			break;
+		case 10:
+			flush = true;
+			break;
+		case 11:
+			rcpt_file = optarg;
+			break;
+		case 12:
+			merge_file = optarg;
+			break;
 		default:
 			/* Print an error message here  */
 			usage();
@@ -338,24 +373,25 @@ main(int argc, char **argv)
 	}
 
 	/* first let's check to make sure they specified some recipients */
-	if (optind == argc) {
+	if (optind == argc && !batch_file && !flush) {
 		usage();
 	}
 
 	configure();
 
 	/* Check to see if we need to attach a vcard. */
-	if (getConfValue("VCARD")) {
-		dstrbuf *vcard = expandPath(getConfValue("VCARD"));
+	if (Conf.vcard) {
 		if (!Mopts.attach) {
 			Mopts.attach = dlInit(defaultDestr);
 		}
-		dlInsertTop(Mopts.attach, xstrdup(vcard->str));
-		dsbDestroy(vcard);
+		dlInsertTop(Mopts.attach, xstrdup(Conf.vcard));
 	}
 
-	/* set to addresses if argc is > 1 */
-	if (!(Mopts.to = getNames(argv[optind]))) {
+	/**
+	 * set to addresses if argc is > 1, batches and the spool bring their own
+	 * and a merge fills them in for each message.
+	 */
+	if (!batch_file && !flush && !merge_file && !(Mopts.to = getNames(argv[optind]))) {
 		fatal("You must specify at least one recipient!\n");
 		properExit(ERROR);
 	}
@@ -364,8 +400,25 @@ main(int argc, char **argv)
 	if (cc_string) {
 		Mopts.cc = getNames(cc_string);
 	}
-	if (bcc_string) {
-		Mopts.bcc = getNames(bcc_string);
+	/* The message itself comes from STDIN when it isn't a terminal */
+	if (rcpt_file && strcmp(rcpt_file, "-") == 0 && !batch_file && !flush &&
+	    !Mopts.blank && isatty(STDIN_FILENO) == 0) {
+		fatal("Recipients can't be read from STDIN when the message is "
+			"too.  Use --blank-mail or put them in a file.\n");
+		properExit(ERROR);
+	}
+	if (bcc_string || rcpt_file) {
+		dstrbuf *bcc = DSB_NEW;
+		if (bcc_string) {
+			dsbCopy(bcc, bcc_string);
+		}
+		if (rcpt_file && readRcptFile(rcpt_file, bcc) == ERROR) {
+			fatal("Could not read recipients from %s", rcpt_file);
+			dsbDestroy(bcc);
+			properExit(ERROR);
+		}
+		Mopts.bcc = getNames(bcc->str);
+		dsbDestroy(bcc);
 	}
 
 	signal(SIGTERM, properExit);
@@ -374,7 +427,15 @@ main(int argc, char **argv)
 	signal(SIGHUP, properExit);
 	signal(SIGQUIT, properExit);
 
-	createMail();
+	if (flush) {
+		properExit(spoolFlush() == ERROR ? ERROR : 0);
+	} else if (batch_file) {
+		createBatchMail(batch_file);
+	} else if (merge_file) {
+		createMergeMail(merge_file, argv[optind]);
+	} else {
+		createMail();
+	}
 	properExit(0);
 
 	/* We never get here, but gcc will whine if i don't return something */
@@ -0,0 +1,396 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "email.h"
+#include "mimeutils.h"
+#include "encpool.h"
+
+/**
+ * The encoding pool base64 encodes an attachment on a few threads
+ * at once.  The file is cut into chunks of a whole number of base64
+ * lines, so each one encodes the same as it would as part of the
+ * whole file.  Workers take the chunks in order, read them with
+ * pread(), or straight out of the file's mapping when there is one,
+ * and encode them into a ring of slots.  encPoolNext() hands
+ * the slots back out in the same order.  Workers only run as far
+ * ahead as there are slots, and the slots are sized to fit in
+ * ENC_POOL_MEMORY, so a big file is never all in memory at once.
+**/
+
+#ifdef HAVE_PTHREAD_H
+
+#define ENC_POOL_MAX_THREADS  8
+#define ENC_POOL_MEMORY       (16 * 1024 * 1024)
+
+#define SLOT_FREE   0
+#define SLOT_BUSY   1		/* A worker is encoding into it */
+#define SLOT_READY  2		/* Encoded and waiting to be handed out */
+
+struct encslot {
+	u_char *raw;
+	char *enc;
+	size_t len;		/* Bytes in enc */
+	bool err;		/* The chunk couldn't be read */
+	int state;
+};
+
+struct encpool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* There's a chunk to encode or we're quitting */
+	pthread_cond_t done;	/* A chunk is ready or a worker went idle */
+	pthread_t *threads;
+	u_int nthreads;
+	struct encslot *slots;
+	size_t nslots;
+	size_t chunk;
+	int fd;			/* -1 when there's no file */
+	const u_char *map;	/* The file in memory, if it's mapped */
+	off_t size;
+	size_t nchunks;
+	size_t next_task;	/* Next chunk for a worker */
+	size_t next_out;	/* Next chunk for encPoolNext() */
+	bool handed;		/* encPoolNext() handed out next_out */
+	u_int busy;		/* Workers in the middle of a chunk */
+	bool quit;
+};
+
+/**
+ * How many workers to run: one for each CPU, but only if there's
+ * more than one, since the main thread is busy sending.
+**/
+static u_int
+encPoolThreads(void)
+{
+	long cpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus < 2) {
+		return 0;
+	}
+	if (cpus > ENC_POOL_MAX_THREADS) {
+		cpus = ENC_POOL_MAX_THREADS;
+	}
+	return (u_int)cpus;
+}
+
+/**
+ * Reads and encodes chunks until the pool is freed.
+**/
+static void *
+encPoolWorker(void *arg)
+{
+	int fd;
+	off_t off;
+	ssize_t bytes;
+	size_t idx, want, got, len;
+	bool err;
+	const u_char *src;
+	struct encslot *slot;
+	struct encpool *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (!p->quit) {
+		if (p->fd == -1 || p->next_task == p->nchunks ||
+		    p->next_task - p->next_out >= p->nslots) {
+			pthread_cond_wait(&p->work, &p->lock);
+			continue;
+		}
+		idx = p->next_task++;
+		slot = &p->slots[idx % p->nslots];
+		slot->state = SLOT_BUSY;
+		p->busy++;
+		fd = p->fd;
+		src = p->map;
+		off = (off_t)idx * p->chunk;
+		want = p->chunk;
+		if (p->size - off < (off_t)want) {
+			want = p->size - off;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		got = 0;
+		err = false;
+		if (src) {
+			/* Encode it right out of the mapping */
+			src += off;
+			got = want;
+		} else {
+			src = slot->raw;
+		}
+		while (got < want) {
+			bytes = pread(fd, slot->raw + got, want - got, off + got);
+			if (bytes == -1 && errno == EINTR) {
+				continue;
+			}
+			if (bytes == -1) {
+				err = true;
+			}
+			if (bytes <= 0) {
+				/* An error, or the file got shorter */
+				break;
+			}
+			got += bytes;
+		}
+		len = err ? 0 : mimeB64EncodeBuf(src, got, slot->enc, true);
+
+		pthread_mutex_lock(&p->lock);
+		slot->len = len;
+		slot->err = err;
+		slot->state = SLOT_READY;
+		p->busy--;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/**
+ * Makes a pool that encodes chunk bytes at a time, which must be
+ * a whole number of base64 lines.
+ *
+ * Return
+ * 	- The pool
+ * 	- NULL if there's only one CPU or the threads can't be made.
+ * 	  Encode the file the normal way.
+**/
+struct encpool *
+encPoolNew(size_t chunk)
+{
+	u_int i, nthreads = encPoolThreads();
+	size_t enclen = mimeB64EncodedSize(chunk);
+	struct encpool *p;
+
+	if (nthreads == 0) {
+		return NULL;
+	}
+
+	p = xmalloc(sizeof(struct encpool));
+	memset(p, 0, sizeof(struct encpool));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->chunk = chunk;
+	p->fd = -1;
+
+	p->nslots = ENC_POOL_MEMORY / (chunk + enclen);
+	if (p->nslots < nthreads * 2) {
+		p->nslots = nthreads * 2;
+	}
+	p->slots = xmalloc(sizeof(struct encslot) * p->nslots);
+	memset(p->slots, 0, sizeof(struct encslot) * p->nslots);
+	for (i=0; i < p->nslots; i++) {
+		p->slots[i].raw = xmalloc(chunk);
+		p->slots[i].enc = xmalloc(enclen);
+	}
+
+	p->threads = xmalloc(sizeof(pthread_t) * nthreads);
+	for (i=0; i < nthreads; i++) {
+		if (pthread_create(&p->threads[i], NULL, encPoolWorker, p) != 0) {
+			break;
+		}
+		p->nthreads++;
+	}
+	if (p->nthreads == 0) {
+		encPoolFree(p);
+		return NULL;
+	}
+	return p;
+}
+
+/**
+ * Starts encoding size bytes from fd.  If the file is mapped into
+ * memory, map points at it and the workers encode straight from
+ * there instead of reading it.  fd and map have to stay around
+ * until encPoolStop() is called.
+**/
+void
+encPoolStart(struct encpool *p, int fd, const u_char *map, off_t size)
+{
+	pthread_mutex_lock(&p->lock);
+	p->fd = fd;
+	p->map = map;
+	p->size = size;
+	p->nchunks = (size + p->chunk - 1) / p->chunk;
+	p->next_task = 0;
+	p->next_out = 0;
+	p->handed = false;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Points data at the next encoded chunk of the file, in order, and
+ * sets len to how long it is.  The chunk is good until the next
+ * call.  At the end of the file len is 0.
+ *
+ * Return
+ * 	- SUCCESS
+ * 	- ERROR if the file couldn't be read
+**/
+int
+encPoolNext(struct encpool *p, const char **data, size_t *len)
+{
+	int retval = SUCCESS;
+	struct encslot *slot;
+
+	*data = NULL;
+	*len = 0;
+	pthread_mutex_lock(&p->lock);
+	while (true) {
+		if (p->handed) {
+			p->slots[p->next_out % p->nslots].state = SLOT_FREE;
+			p->next_out++;
+			p->handed = false;
+			pthread_cond_broadcast(&p->work);
+		}
+		if (p->next_out >= p->nchunks) {
+			break;
+		}
+
+		slot = &p->slots[p->next_out % p->nslots];
+		while (slot->state != SLOT_READY) {
+			pthread_cond_wait(&p->done, &p->lock);
+		}
+		p->handed = true;
+		if (slot->err) {
+			retval = ERROR;
+			break;
+		}
+		if (slot->len > 0) {
+			*data = slot->enc;
+			*len = slot->len;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return retval;
+}
+
+/**
+ * Stops work on the file, waiting for any chunk that's being
+ * encoded, so the pool can be started on another one.
+**/
+void
+encPoolStop(struct encpool *p)
+{
+	size_t i;
+
+	pthread_mutex_lock(&p->lock);
+	p->fd = -1;
+	p->map = NULL;
+	p->nchunks = 0;
+	while (p->busy > 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	for (i=0; i < p->nslots; i++) {
+		p->slots[i].state = SLOT_FREE;
+	}
+	p->next_task = 0;
+	p->next_out = 0;
+	p->handed = false;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+encPoolFree(struct encpool *p)
+{
+	size_t i;
+
+	if (!p) {
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	for (i=0; i < p->nthreads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+
+	for (i=0; i < p->nslots; i++) {
+		xfree(p->slots[i].raw);
+		xfree(p->slots[i].enc);
+	}
+	xfree(p->slots);
+	xfree(p->threads);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->done);
+	xfree(p);
+}
+
+#else
+
+struct encpool *
+encPoolNew(size_t chunk)
+{
+	chunk = chunk;
+	return NULL;
+}
+
+void
+encPoolStart(struct encpool *p, int fd, const u_char *map, off_t size)
+{
+	p = p;
+	fd = fd;
+	map = map;
+	size = size;
+}
+
+int
+encPoolNext(struct encpool *p, const char **data, size_t *len)
+{
+	p = p;
+	*data = NULL;
+	*len = 0;
+	return ERROR;
+}
+
+void
+encPoolStop(struct encpool *p)
+{
+	p = p;
+}
+
+void
+encPoolFree(struct encpool *p)
+{
+	p = p;
+}
+
+#endif /* HAVE_PTHREAD_H */
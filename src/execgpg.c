@@ -84,17 +84,13 @@ callGpg(dstrbuf *input, GpgCallType call_type)
 {
 	int retval;
 	FILE *fdfile, *fdtmp;
-	char *gpg_bin, *gpg_pass;
 	char filename[TMPFILE_TEMPLATE_SIZE]=TMPFILE_TEMPLATE;
 	char tmpfile[TMPFILE_TEMPLATE_SIZE]=TMPFILE_TEMPLATE;
 	dstrbuf *encto=NULL;
-	dstrbuf *gpg=NULL;
 	dstrbuf *cmd=NULL;
 	dstrbuf *buf=NULL;
 
-	gpg_bin = getConfValue("GPG_BIN");
-	gpg_pass = getConfValue("GPG_PASS");
-	if (!gpg_bin) {
+	if (!Conf.gpg_bin) {
 		fatal("You must specify the path to GPG in email.conf\n");
 		return NULL;
 	}
@@ -105,10 +101,9 @@ callGpg(dstrbuf *input, GpgCallType call_type)
 	fdtmp = fdopen(mkstemp(tmpfile), "w");
 	fwrite(input->str, 1, input->len, fdtmp);
 
-	gpg = expandPath(gpg_bin);
 	cmd = DSB_NEW;
 	dsbPrintf(cmd, "%s -a -o '%s' --no-secmem-warning --passphrase-fd 0 "
-		" --no-tty", gpg->str, filename);
+		" --no-tty", Conf.gpg_bin, filename);
 	if ((call_type & GPG_SIG) && (call_type & GPG_ENC)) {
 		dsbPrintf(cmd, " -r '%s' -s -e", encto->str);
 	} else if (call_type & GPG_ENC) {
@@ -117,18 +112,17 @@ callGpg(dstrbuf *input, GpgCallType call_type)
 		dsbPrintf(cmd, " --digest-algo=SHA1 --sign --detach -u '%s'", encto->str);
 	}
 	dsbPrintf(cmd, " '%s'", tmpfile);
-	retval = execgpg(cmd->str, gpg_pass);
+	retval = execgpg(cmd->str, Conf.gpg_pass);
 	dsbDestroy(encto);
 	fclose(fdtmp);
 	unlink(tmpfile);
 
 	if (retval == -1) {
-		fatal("Error executing: %s", gpg->str);
-		dsbDestroy(gpg);
+		fatal("Error executing: %s", Conf.gpg_bin);
+		dsbDestroy(cmd);
 		return NULL;
 	}
 
-	dsbDestroy(gpg);
 	dsbDestroy(cmd);
 
 	buf = DSB_NEW;
@@ -29,9 +29,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <sys/wait.h>
 #include <sys/stat.h>
+#if HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #include "email.h"
 #include "utils.h"
@@ -39,31 +43,76 @@
 #include "sig_file.h"
 #include "error.h"
 
+/**
+ * Reads the next block of the message from in, up to len bytes,
+ * into raw and puts it in out with every line ending made into
+ * CRLF.  out needs room for (len * 2) + 1 bytes.  A CR at the end
+ * of a block is held back in cr until we know if a LF follows it,
+ * and one that's left at the very end is dropped, the same as 
+ * chomp() would do to the last line.
+ *
+ * Return
+ * 	- How much was put in out.  This can be 0 before the end, so
+ * 	  check feof() and ferror().
+**/
+size_t
+readInputBlock(FILE *in, char *raw, size_t len, char *out, bool *cr)
+{
+	char *p, *end, *nl, *start=out;
+
+	len = fread(raw, sizeof(char), len, in);
+	p = raw;
+	end = raw + len;
+	if (*cr && p < end) {
+		*out++ = '\r';
+		if (*p == '\n') {
+			*out++ = *p++;
+		}
+		*cr = false;
+	}
+	if (p < end && end[-1] == '\r') {
+		*cr = true;
+		end--;
+	}
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		memcpy(out, p, nl - p);
+		out += nl - p;
+		if (nl == raw || nl[-1] != '\r') {
+			*out++ = '\r';
+		}
+		*out++ = '\n';
+		p = nl + 1;
+	}
+	memcpy(out, p, end - p);
+	out += end - p;
+	return out - start;
+}
+
 /**
  * ReadInput: This function just reads in a file from STDIN which 
  * allows someone to redirect a file into email from the command line.
+ * Every line ends up ending in CRLF, and one more CRLF ends it all.
 **/
 dstrbuf *
 readInput(void)
 {
-	dstrbuf *fpath=NULL;
-	dstrbuf *tmp=DSB_NEW, *buf=DSB_NEW;
-	char *sig_file = NULL;
+	size_t len;
+	bool cr = false;
+	char *raw = xmalloc(INPUT_BLOCK);
+	char *out = xmalloc((INPUT_BLOCK * 2) + 1);
+	dstrbuf *buf=DSB_NEW;
 
-	while (!feof(stdin)) {
-		dsbReadline(tmp, stdin);
-		chomp(tmp->str);
-		dsbCat(buf, tmp->str);
-		dsbCat(buf, "\r\n");
+	while (!feof(stdin) && !ferror(stdin)) {
+		len = readInputBlock(stdin, raw, INPUT_BLOCK, out, &cr);
+		dsbnCat(buf, out, len);
 	}
-	dsbDestroy(tmp);
+	dsbCat(buf, "\r\n");
+	xfree(raw);
+	xfree(out);
 
 	/* If they specified a signature file, let's append it */
-	sig_file = getConfValue("SIGNATURE_FILE");
-	if (sig_file) {
-		fpath = expandPath(sig_file);
-		appendSig(buf, fpath->str);
-		dsbDestroy(fpath);
+	if (Conf.signature_file) {
+		appendSig(buf, Conf.signature_file);
 	}
 
 	return buf;
@@ -153,6 +202,31 @@ getFileContents(const char *filename)
 }
 
 
+/**
+ * ReadFileInput: Reads the message in from a file instead of
+ * STDIN.  The signature file is appended just like readInput().
+**/
+dstrbuf *
+readFileInput(const char *filename)
+{
+	dstrbuf *fpath=NULL;
+	dstrbuf *buf=NULL;
+
+	fpath = expandPath(filename);
+	buf = getFileContents(fpath->str);
+	dsbDestroy(fpath);
+	if (!buf) {
+		return NULL;
+	}
+
+	/* If they specified a signature file, let's append it */
+	if (Conf.signature_file) {
+		appendSig(buf, Conf.signature_file);
+	}
+
+	return buf;
+}
+
 /**
  * EditFile: this function basicly opens the editor of choice 
  * with a temp file and lets you create your message and send it.  
@@ -162,8 +236,6 @@ editEmail(void)
 {
 	int fd=0;
 	char *editor;
-	char *sig_file = NULL;
-	dstrbuf *fpath=NULL;
 	dstrbuf *buf=NULL;
 	size_t fsize=0;
 	char filename[TMPFILE_TEMPLATE_SIZE] = TMPFILE_TEMPLATE;
@@ -201,13 +273,172 @@ editEmail(void)
 	unlink(filename);
 
 	/* If they specified a signature file, let's append it */
-	sig_file = getConfValue("SIGNATURE_FILE");
-	if (sig_file) {
-		fpath = expandPath(sig_file);
-		appendSig(buf, fpath->str);
-		dsbDestroy(fpath);
+	if (Conf.signature_file) {
+		appendSig(buf, Conf.signature_file);
 	}
 
 	return buf;
 }
 
+#if HAVE_SYS_MMAN_H
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS  MAP_ANON
+#endif
+
+/**
+ * If a file gets shorter while it's mapped, reading past the new end
+ * raises SIGBUS instead of giving an error.  So while there are files
+ * mapped, a SIGBUS in one of them puts zeros over the rest of it so
+ * the read can go on, and marks it broken so unmapFile() can tell
+ * the caller it didn't get the whole file.  Mappings are only made
+ * and given back by the main thread, but the encoding pool reads
+ * them too, so the handler only ever reads the table.
+**/
+#define MAP_MAX  16
+
+static struct {
+	const u_char *volatile addr;
+	size_t len;
+	volatile sig_atomic_t broken;
+} Maps[MAP_MAX];
+
+static struct sigaction OldBus;
+static size_t MapPage;
+
+static void
+mapSigbus(int sig, siginfo_t *info, void *ctx)
+{
+	u_int i;
+	size_t off;
+	const u_char *addr = info->si_addr;
+
+	sig = sig;
+	ctx = ctx;
+	for (i=0; i < MAP_MAX; i++) {
+		if (!Maps[i].addr || addr < Maps[i].addr ||
+		    addr >= Maps[i].addr + Maps[i].len) {
+			continue;
+		}
+		off = (size_t)(addr - Maps[i].addr) & ~(MapPage - 1);
+		if (mmap((void *)(Maps[i].addr + off), Maps[i].len - off, PROT_READ,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+			Maps[i].broken = 1;
+			return;
+		}
+		break;
+	}
+	/* Not ours, so put back whatever would have handled it */
+	sigaction(SIGBUS, &OldBus, NULL);
+}
+
+/**
+ * Puts map in the table, setting up the SIGBUS handler the first time.
+ *
+ * Return
+ * 	- SUCCESS
+ * 	- ERROR if the table is full
+**/
+static int
+mapWatch(const u_char *map, size_t len)
+{
+	u_int i;
+	struct sigaction sa;
+
+	if (MapPage == 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = mapSigbus;
+		sa.sa_flags = SA_SIGINFO;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGBUS, &sa, &OldBus) == -1) {
+			return ERROR;
+		}
+		MapPage = sysconf(_SC_PAGESIZE);
+	}
+	for (i=0; i < MAP_MAX; i++) {
+		if (!Maps[i].addr) {
+			Maps[i].len = len;
+			Maps[i].broken = 0;
+			Maps[i].addr = map;
+			return SUCCESS;
+		}
+	}
+	return ERROR;
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
+/**
+ * Maps the regular file open as file into memory for reading
+ * straight through, and sets len to it's size.
+ *
+ * Return
+ * 	- The mapping, to be given back with unmapFile()
+ * 	- NULL if the file can't be mapped.  Read it the normal way.
+**/
+const u_char *
+mapFile(FILE *file, size_t *len)
+{
+	const u_char *map = NULL;
+#if HAVE_SYS_MMAN_H
+	struct stat st;
+
+	*len = 0;
+	if (fstat(fileno(file), &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0) {
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	if (mapWatch(map, st.st_size) == ERROR) {
+		/* Without the handler a truncated file would kill us */
+		munmap((void *)map, st.st_size);
+		return NULL;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+#endif
+	*len = st.st_size;
+#else
+	file = file;
+	*len = 0;
+#endif
+	return map;
+}
+
+/**
+ * Gives back a mapping from mapFile().  Nothing may still be reading it.
+ *
+ * Return
+ * 	- SUCCESS
+ * 	- ERROR if the file got shorter while it was mapped, so some 
+ * 	  of what was read from it was zeros
+**/
+int
+unmapFile(const u_char *map, size_t len)
+{
+	int retval = SUCCESS;
+#if HAVE_SYS_MMAN_H
+	u_int i;
+
+	if (!map) {
+		return SUCCESS;
+	}
+	for (i=0; i < MAP_MAX; i++) {
+		if (Maps[i].addr == map) {
+			if (Maps[i].broken) {
+				retval = ERROR;
+			}
+			Maps[i].addr = NULL;
+			break;
+		}
+	}
+	munmap((void *)map, len);
+#else
+	map = map;
+	len = len;
+#endif
+	return retval;
+}
@@ -0,0 +1,543 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "email.h"
+#include "utils.h"
+#include "merge.h"
+#include "error.h"
+
+/**
+ * A merge file is either CSV, with the field names on the first
+ * line, or JSONL, with one flat JSON object on each line.  It's
+ * JSONL if the first thing in the file is a '{'.  Templates name
+ * a field as {{name}} and get the current record's value for it.
+**/
+
+/**
+ * Adds a value to the current record.
+**/
+static void
+mergeAddValue(struct mergedata *m, const char *val)
+{
+	m->values = xrealloc(m->values, sizeof(char *) * (m->nvalues + 1));
+	m->values[m->nvalues++] = xstrdup(val);
+}
+
+/**
+ * Adds a field name to the current record.
+**/
+static void
+mergeAddName(struct mergedata *m, const char *name)
+{
+	m->names = xrealloc(m->names, sizeof(char *) * (m->nnames + 1));
+	m->names[m->nnames++] = xstrdup(name);
+}
+
+static void
+mergeFreeList(char **list, size_t *count)
+{
+	while (*count > 0) {
+		xfree(list[--(*count)]);
+	}
+}
+
+/**
+ * Reads the next CSV record into the values of m.  Quoted fields
+ * can hold commas, newlines and "" for a quote.  Blank lines are
+ * skipped.
+ *
+ * Return
+ * 	- 1 if there was a record
+ * 	- 0 at the end of the file
+ * 	- ERROR if the file ends in the middle of a quote
+**/
+static int
+csvRecord(struct mergedata *m)
+{
+	int ch, next;
+	bool quoted=false, started=false;
+
+	mergeFreeList(m->values, &m->nvalues);
+	dsbClear(m->buf);
+	m->rec_line = m->line + 1;
+	while ((ch = getc(m->file)) != EOF) {
+		if (quoted) {
+			if (ch == '"') {
+				next = getc(m->file);
+				if (next == '"') {
+					dsbCatChar(m->buf, '"');
+					continue;
+				}
+				if (next != EOF) {
+					ungetc(next, m->file);
+				}
+				quoted = false;
+				continue;
+			}
+			if (ch == '\n') {
+				m->line++;
+			}
+			dsbCatChar(m->buf, ch);
+			continue;
+		}
+
+		switch (ch) {
+		case '"':
+			if (m->buf->len == 0) {
+				quoted = started = true;
+			} else {
+				dsbCatChar(m->buf, ch);
+			}
+			break;
+		case ',':
+			mergeAddValue(m, m->buf->str);
+			dsbClear(m->buf);
+			started = true;
+			break;
+		case '\r':
+			break;
+		case '\n':
+			m->line++;
+			if (!started) {
+				m->rec_line = m->line + 1;
+				break;
+			}
+			mergeAddValue(m, m->buf->str);
+			return 1;
+		default:
+			dsbCatChar(m->buf, ch);
+			started = true;
+			break;
+		}
+	}
+
+	if (quoted) {
+		return ERROR;
+	}
+	if (!started) {
+		return 0;
+	}
+	mergeAddValue(m, m->buf->str);
+	return 1;
+}
+
+/**
+ * Adds the UTF-8 bytes for the unicode character c to out.
+**/
+static void
+jsonCatUtf8(dstrbuf *out, u_int c)
+{
+	if (c < 0x80) {
+		dsbCatChar(out, c);
+	} else if (c < 0x800) {
+		dsbCatChar(out, 0xc0 | (c >> 6));
+		dsbCatChar(out, 0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		dsbCatChar(out, 0xe0 | (c >> 12));
+		dsbCatChar(out, 0x80 | ((c >> 6) & 0x3f));
+		dsbCatChar(out, 0x80 | (c & 0x3f));
+	} else {
+		dsbCatChar(out, 0xf0 | (c >> 18));
+		dsbCatChar(out, 0x80 | ((c >> 12) & 0x3f));
+		dsbCatChar(out, 0x80 | ((c >> 6) & 0x3f));
+		dsbCatChar(out, 0x80 | (c & 0x3f));
+	}
+}
+
+/**
+ * Reads the four hex digits of a \u escape.
+**/
+static int
+jsonHex(const char **ptr, u_int *c)
+{
+	int i;
+	const char *p = *ptr;
+
+	*c = 0;
+	for (i=0; i < 4; i++, p++) {
+		if (!isxdigit((u_char)*p)) {
+			return ERROR;
+		}
+		*c = (*c << 4) | (isdigit((u_char)*p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+	}
+	*ptr = p;
+	return SUCCESS;
+}
+
+/**
+ * Reads the JSON string at *ptr into out, without the quotes and
+ * with the escapes turned back into what they stand for.
+**/
+static int
+jsonString(const char **ptr, dstrbuf *out)
+{
+	u_int c, low;
+	const char *p = *ptr + 1;
+
+	dsbClear(out);
+	while (*p != '"') {
+		if (*p == '\0') {
+			return ERROR;
+		}
+		if (*p != '\\') {
+			dsbCatChar(out, *p++);
+			continue;
+		}
+		p++;
+		switch (*p++) {
+		case '"':  dsbCatChar(out, '"'); break;
+		case '\\': dsbCatChar(out, '\\'); break;
+		case '/':  dsbCatChar(out, '/'); break;
+		case 'b':  dsbCatChar(out, '\b'); break;
+		case 'f':  dsbCatChar(out, '\f'); break;
+		case 'n':  dsbCatChar(out, '\n'); break;
+		case 'r':  dsbCatChar(out, '\r'); break;
+		case 't':  dsbCatChar(out, '\t'); break;
+		case 'u':
+			if (jsonHex(&p, &c) == ERROR) {
+				return ERROR;
+			}
+			/* Characters past 0xffff come as a surrogate pair */
+			if (c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+				p += 2;
+				if (jsonHex(&p, &low) == ERROR || low < 0xdc00 || low > 0xdfff) {
+					return ERROR;
+				}
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+			}
+			jsonCatUtf8(out, c);
+			break;
+		default:
+			return ERROR;
+		}
+	}
+	*ptr = p + 1;
+	return SUCCESS;
+}
+
+static void
+jsonSkip(const char **ptr)
+{
+	while (isspace((u_char)**ptr)) {
+		(*ptr)++;
+	}
+}
+
+/**
+ * Reads a JSON value into out.  Numbers, true and false are kept
+ * as they're written and null is empty.  Objects and arrays can't
+ * be put in a message, so they're an error.
+**/
+static int
+jsonValue(const char **ptr, dstrbuf *out)
+{
+	const char *p = *ptr;
+
+	if (*p == '"') {
+		return jsonString(ptr, out);
+	}
+	while (isalnum((u_char)*p) || *p == '-' || *p == '+' || *p == '.') {
+		p++;
+	}
+	if (p == *ptr) {
+		return ERROR;
+	}
+	dsbClear(out);
+	if (p - *ptr != 4 || strncmp(*ptr, "null", 4) != 0) {
+		dsbnCat(out, *ptr, p - *ptr);
+	}
+	*ptr = p;
+	return SUCCESS;
+}
+
+/**
+ * Reads the next JSONL record into the names and values of m.
+ * Blank lines are skipped.
+ *
+ * Return
+ * 	- 1 if there was a record
+ * 	- 0 at the end of the file
+ * 	- ERROR if the line isn't a flat JSON object
+**/
+static int
+jsonRecord(struct mergedata *m)
+{
+	const char *p;
+	dstrbuf *val=NULL;
+	int retval=ERROR;
+
+	mergeFreeList(m->names, &m->nnames);
+	mergeFreeList(m->values, &m->nvalues);
+	do {
+		if (feof(m->file)) {
+			return 0;
+		}
+		dsbReadline(m->buf, m->file);
+		m->line++;
+		p = m->buf->str;
+		jsonSkip(&p);
+	} while (*p == '\0');
+
+	m->rec_line = m->line;
+	val = DSB_NEW;
+	if (*p++ != '{') {
+		goto end;
+	}
+	jsonSkip(&p);
+	if (*p == '}') {
+		p++;
+		retval = 1;
+		goto end;
+	}
+	while (true) {
+		if (*p != '"' || jsonString(&p, val) == ERROR) {
+			goto end;
+		}
+		mergeAddName(m, val->str);
+		jsonSkip(&p);
+		if (*p++ != ':') {
+			goto end;
+		}
+		jsonSkip(&p);
+		if (jsonValue(&p, val) == ERROR) {
+			goto end;
+		}
+		mergeAddValue(m, val->str);
+		jsonSkip(&p);
+		if (*p == '}') {
+			p++;
+			break;
+		}
+		if (*p++ != ',') {
+			goto end;
+		}
+		jsonSkip(&p);
+	}
+	jsonSkip(&p);
+	if (*p == '\0') {
+		retval = 1;
+	}
+
+end:
+	dsbDestroy(val);
+	return retval;
+}
+
+/**
+ * Opens a merge file and works out what kind it is.  For CSV the
+ * field names are read in from the first line.
+**/
+struct mergedata *
+mergeOpen(const char *file)
+{
+	int ch;
+	dstrbuf *path = expandPath(file);
+	struct mergedata *m = xmalloc(sizeof(struct mergedata));
+
+	memset(m, 0, sizeof(struct mergedata));
+	m->buf = DSB_NEW;
+	if (!(m->file = fopen(path->str, "r"))) {
+		fatal("Could not open merge file: %s", path->str);
+		goto error;
+	}
+
+	/* Skip the byte order mark spreadsheets like to put in */
+	if ((ch = getc(m->file)) == 0xef) {
+		if (getc(m->file) != 0xbb || getc(m->file) != 0xbf) {
+			rewind(m->file);
+		}
+	} else if (ch != EOF) {
+		ungetc(ch, m->file);
+	}
+
+	while ((ch = getc(m->file)) != EOF && isspace(ch)) {
+		if (ch == '\n') {
+			m->line++;
+		}
+	}
+	if (ch != EOF) {
+		ungetc(ch, m->file);
+	}
+	m->jsonl = (ch == '{');
+
+	if (!m->jsonl) {
+		if (csvRecord(m) != 1) {
+			fatal("Merge file %s has no field names\n", path->str);
+			goto error;
+		}
+		m->names = m->values;
+		m->nnames = m->nvalues;
+		m->values = NULL;
+		m->nvalues = 0;
+	}
+	dsbDestroy(path);
+	return m;
+
+error:
+	dsbDestroy(path);
+	mergeClose(m);
+	return NULL;
+}
+
+/**
+ * Reads in the next record of the merge file.
+ *
+ * Return
+ * 	- 1 if there was a record
+ * 	- 0 at the end of the file
+ * 	- ERROR if the record couldn't be used.  It's warned about
+ * 	  and the next call goes on to the record after it.
+**/
+int
+mergeNext(struct mergedata *m)
+{
+	int retval;
+
+	if (m->jsonl) {
+		retval = jsonRecord(m);
+		if (retval == ERROR) {
+			warning("Merge file line %d is not a flat JSON object. "
+				"Skipping...\n", m->rec_line);
+		}
+	} else {
+		retval = csvRecord(m);
+		if (retval == ERROR) {
+			warning("Merge file line %d starts a quote that never ends. "
+				"Skipping...\n", m->rec_line);
+		} else if (retval == 1 && m->nvalues != m->nnames) {
+			warning("Merge file line %d has %d field(s) instead of %d. "
+				"Skipping...\n", m->rec_line, (int)m->nvalues, (int)m->nnames);
+			retval = ERROR;
+		}
+	}
+	return retval;
+}
+
+/**
+ * Returns the current record's value for the field name that's
+ * len bytes long, or NULL if it doesn't have one.
+**/
+static const char *
+mergeField(struct mergedata *m, const char *name, size_t len)
+{
+	size_t i;
+
+	for (i=0; i < m->nvalues && i < m->nnames; i++) {
+		if (strlen(m->names[i]) == len && strncmp(m->names[i], name, len) == 0) {
+			return m->values[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Adds a value to a filled in template.  Line breaks in the value
+ * become spaces if it's going in a header, otherwise they're made
+ * into CRLF like the rest of the message.
+**/
+static void
+mergeCatValue(dstrbuf *out, const char *val, bool header)
+{
+	for (; *val != '\0'; val++) {
+		if (*val == '\r' && val[1] == '\n') {
+			/* The \n makes the line break */
+			continue;
+		}
+		if (*val == '\r' || *val == '\n') {
+			if (header) {
+				dsbCatChar(out, ' ');
+			} else {
+				dsbCat(out, "\r\n");
+			}
+		} else {
+			dsbCatChar(out, *val);
+		}
+	}
+}
+
+/**
+ * Fills in each {{name}} in tmpl with the current record's value
+ * for it.  Spaces around the name are ignored.  Set header if the 
+ * template is going in a header.
+ *
+ * Return
+ * 	- The filled in template
+ * 	- NULL if the record doesn't have one of the fields.
+**/
+dstrbuf *
+mergeFill(struct mergedata *m, const char *tmpl, bool header)
+{
+	const char *open, *close, *name, *end;
+	const char *val;
+	dstrbuf *out = dsbNew(strlen(tmpl) + 1);
+
+	while ((open = strstr(tmpl, "{{")) != NULL) {
+		if (!(close = strstr(open + 2, "}}"))) {
+			break;
+		}
+		dsbnCat(out, tmpl, open - tmpl);
+		for (name = open + 2; name < close && isspace((u_char)*name); name++)
+			;
+		for (end = close; end > name && isspace((u_char)end[-1]); end--)
+			;
+		if (!(val = mergeField(m, name, end - name))) {
+			warning("Merge file line %d has no field '%.*s'. Skipping...\n",
+				m->rec_line, (int)(end - name), name);
+			dsbDestroy(out);
+			return NULL;
+		}
+		mergeCatValue(out, val, header);
+		tmpl = close + 2;
+	}
+	dsbCat(out, tmpl);
+	return out;
+}
+
+void
+mergeClose(struct mergedata *m)
+{
+	if (!m) {
+		return;
+	}
+	if (m->file) {
+		fclose(m->file);
+	}
+	mergeFreeList(m->names, &m->nnames);
+	mergeFreeList(m->values, &m->nvalues);
+	if (m->names) {
+		xfree(m->names);
+	}
+	if (m->values) {
+		xfree(m->values);
+	}
+	dsbDestroy(m->buf);
+	xfree(m);
+}
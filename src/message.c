@@ -50,11 +50,18 @@
 #include "execgpg.h"
 #include "utils.h"
 #include "file_io.h"
+#include "sig_file.h"
 #include "addy_book.h"
 #include "remotesmtp.h"
+#include "smtpcommands.h"
+#include "spool.h"
 #include "addr_parse.h"
 #include "message.h"
+#include "msgstream.h"
 #include "mimeutils.h"
+#include "merge.h"
+#include "attcache.h"
+#include "encpool.h"
 #include "error.h"
 
 /**
@@ -214,11 +221,12 @@ static void
 printHeaders(const char *border, dstrbuf *msg, CharSetType msg_cs)
 {
 	char *subject=Mopts.subject;
-	char *user_name = getConfValue("MY_NAME");
-	char *email_addr = getConfValue("MY_EMAIL");
-	char *sm_bin = getConfValue("SENDMAIL_BIN");
-	char *smtp_serv = getConfValue("SMTP_SERVER");
-	char *reply_to = getConfValue("REPLY_TO");
+	char *user_name = Conf.my_name;
+	char *email_addr = Conf.my_email;
+	char *sm_bin = Conf.sendmail_bin;
+	char *smtp_serv = Conf.smtp_server;
+	char *smtp_relays = Conf.smtp_relays;
+	char *reply_to = Conf.reply_to;
 	dstrbuf *dsb=NULL;
 
 	if (subject) {
@@ -247,7 +255,7 @@ printHeaders(const char *border, dstrbuf *msg, CharSetType msg_cs)
 	 * the BCC addresses...  Keep in mind that sending to an smtp servers takes
 	 * presidence over sending to sendmail incase both are mentioned.
 	 */
-	if (sm_bin && !smtp_serv) {
+	if (sm_bin && !smtp_serv && !smtp_relays) {
 		printBccHeaders(Mopts.bcc, msg);
 	}
 
@@ -265,6 +273,9 @@ printHeaders(const char *border, dstrbuf *msg, CharSetType msg_cs)
 	dsbPrintf(msg, "\r\n");
 }
 
+/* How much of a file each thread encodes at a time.  It has to be
+   a whole number of base64 lines. */
+#define ATTACH_POOL_CHUNK  ((MAX_B64_LINE / 4) * 3 * 1024)
 
 /**
  * set up the appropriate MIME and Base64 headers for 
@@ -273,48 +284,79 @@ printHeaders(const char *border, dstrbuf *msg, CharSetType msg_cs)
 static int
 attachFiles(const char *boundary, dstrbuf *out)
 {
-	dstrbuf *file_name = NULL;
-	dstrbuf *file_type = NULL;
 	char *next_file = NULL;
+	const char *data;
+	const u_char *map;
+	size_t len, map_len;
+	int retval = SUCCESS;
+	struct stat st;
+	struct encpool *pool = NULL;
 
-	/*
-	* What we will do here is parse Mopts.attach for comma delimited file
-	* names.  If there was only one file specified with no comma, then strtok()
-	* will just return that file and the next call to strtok() will be NULL
-	* which will allow use to break out of our loop of attaching base64 stuff.
-	*/
 	while ((next_file = (char *)dlGetNext(Mopts.attach)) != NULL) {
-		FILE *current = fopen(next_file, "r");
-		if (!current) {
+		FILE *current;
+
+		if (retval == ERROR) {
+			continue;
+		}
+		if (stat(next_file, &st) == 0 && 
+		    (current = attCacheOpen(next_file, &st)) != NULL) {
+			/* It's already encoded */
+			msgStreamAttachHeaders(boundary, next_file, out);
+			if ((map = mapFile(current, &map_len)) != NULL) {
+				dsbnCat(out, (const char *)map, map_len);
+				if (unmapFile(map, map_len) == ERROR) {
+					fatal("Attachment changed while it was being read: %s\n", 
+					    next_file);
+					retval = ERROR;
+				}
+			} else {
+				dsbFread(out, mimeB64EncodedSize(st.st_size), current);
+			}
+			fclose(current);
+			continue;
+		}
+		if (!(current = fopen(next_file, "r"))) {
 			fatal("Could not open attachment: %s", next_file);
-			return (ERROR);
+			retval = ERROR;
+			continue;
 		}
 
-		/* If the user specified an absolute path, just get the file name */
-		file_type = mimeFiletype(next_file);
-		file_name = mimeFilename(next_file);
-
-		/* Set our MIME headers */
-		dsbPrintf(out, "\r\n--%s\r\n", boundary);
-		dsbPrintf(out, "Content-Transfer-Encoding: base64\r\n");
-		dsbPrintf(out, "Content-Type: %s; name=\"%s\"\r\n", 
-			file_type->str, file_name->str);
-		dsbPrintf(out, "Content-Disposition: attachment; filename=\"%s\"\r\n", 
-			file_name->str);
-		dsbPrintf(out, "\r\n");
-
-		/* Encode to 'out' */
-		mimeB64EncodeFile(current, out);
-		dsbDestroy(file_type);
-		dsbDestroy(file_name);
+		/* Set our MIME headers and encode to 'out' */
+		msgStreamAttachHeaders(boundary, next_file, out);
+		if (fstat(fileno(current), &st) == 0 && S_ISREG(st.st_mode) &&
+		    (pool || (pool = encPoolNew(ATTACH_POOL_CHUNK)))) {
+			/* Encode it on a few threads at once */
+			map = mapFile(current, &map_len);
+			encPoolStart(pool, fileno(current), map,
+			    map ? (off_t)map_len : st.st_size);
+			while ((retval = encPoolNext(pool, &data, &len)) != ERROR &&
+			    len > 0) {
+				dsbnCat(out, data, len);
+			}
+			encPoolStop(pool);
+			if (retval == ERROR) {
+				fatal("Could not read attachment: %s", next_file);
+			}
+			if (unmapFile(map, map_len) == ERROR && retval != ERROR) {
+				fatal("Attachment changed while it was being read: %s\n", 
+				    next_file);
+				retval = ERROR;
+			}
+		} else if (mimeB64EncodeFile(current, out) != 0) {
+			fatal("Could not read attachment: %s", next_file);
+			retval = ERROR;
+		}
+		fclose(current);
 	}
-	return SUCCESS;
+	encPoolFree(pool);
+	return retval;
 }
 
 /** 
  * Makes a standard plain text message while taking into
  * account the MIME message types and boundary's needed
- * if and when a file is attached.
+ * if and when a file is attached.  The files themselves are
+ * left for the message stream to attach as it's sent.
 **/
 static int
 makeMessage(dstrbuf *in, dstrbuf *out, const char *border, CharSetType charset)
@@ -352,12 +394,6 @@ makeMessage(dstrbuf *in, dstrbuf *out, const char *border, CharSetType charset)
 		}
 	}
 	dsbPrintf(out, "%s\r\n", enc->str);
-	if (Mopts.attach) {
-		if (attachFiles(border, out) == ERROR) {
-			return ERROR;
-		}
-		dsbPrintf(out, "\r\n\r\n--%s--\r\n", border);
-	}
 	dsbDestroy(enc);
 	return 0;
 }
@@ -394,7 +430,9 @@ makeGpgMessage(dstrbuf *in, dstrbuf *out, const char *border)
 	dsbnCat(out, qp->str, qp->len);
 	dsbDestroy(qp);
 	if (Mopts.attach) {
-		attachFiles(border, out);
+		if (attachFiles(border, out) == ERROR) {
+			return ERROR;
+		}
 		dsbPrintf(out, "\r\n--%s--\r\n", border);
 	}
 	return 0;
@@ -463,15 +501,15 @@ end:
 /**
  * Creates a plain text (or html) email and 
  * specifies the necessary MIME types if needed
- * due to attaching base64 files.
- * when this function is done, it will rewind
- * the file position and return an open file
+ * due to attaching base64 files.  The attachments
+ * are read and encoded as the stream is sent.
 **/
-static dstrbuf *
-createPlainEmail(dstrbuf *msg) 
+static struct msgstream *
+createPlainStream(dstrbuf *msg) 
 {
 	dstrbuf *border=NULL;
 	dstrbuf *buf=DSB_NEW;
+	struct msgstream *stream=NULL;
 	CharSetType cs;
 
 	if (Mopts.attach) {
@@ -488,22 +526,85 @@ createPlainEmail(dstrbuf *msg)
 	printHeaders(border->str, buf, cs);
 	if (makeMessage(msg, buf, border->str, cs) < 0) {
 		dsbDestroy(buf);
-		buf=NULL;
+	} else {
+		stream = msgStreamNew(buf, border->str, Mopts.attach);
+	}
+	dsbDestroy(border);
+	return stream;
+}
+
+/**
+ * Same as createPlainStream(), but the text is read from STDIN
+ * as the message is sent instead of all up front.  That only works
+ * when nothing has to be known about the text beforehand, so
+ * there's no charset to find and no gpg.
+**/
+static struct msgstream *
+createInputStream(void)
+{
+	dstrbuf *border=NULL;
+	dstrbuf *buf=DSB_NEW, *after=DSB_NEW;
+	struct msgstream *stream=NULL;
+
+	if (Mopts.attach) {
+		border = mimeMakeBoundary();
+	} else {
+		border = DSB_NEW;
+	}
+	printHeaders(border->str, buf, IS_ASCII);
+	if (Mopts.attach) {
+		dsbPrintf(buf, "--%s\r\n", border->str);
+		if (Mopts.html) {
+			dsbPrintf(buf, "Content-Type: text/html\r\n\r\n");
+		} else {
+			dsbPrintf(buf, "Content-Type: text/plain\r\n\r\n");
+		}
+	}
+
+	/* What readInput() and makeMessage() put after the text */
+	dsbCat(after, "\r\n");
+	if (Conf.signature_file) {
+		appendSig(after, Conf.signature_file);
+	}
+	dsbCat(after, "\r\n");
+
+	stream = msgStreamNew(buf, border->str, Mopts.attach);
+	if (!stream) {
+		dsbDestroy(after);
+	} else if (msgStreamSetInput(stream, stdin, after) == ERROR) {
+		msgStreamFree(stream);
+		stream = NULL;
 	}
 	dsbDestroy(border);
+	return stream;
+}
+
+/**
+ * Same as createPlainStream(), but puts the whole message
+ * together in one buffer.
+**/
+static dstrbuf *
+createPlainEmail(dstrbuf *msg) 
+{
+	dstrbuf *buf=NULL;
+	struct msgstream *stream = createPlainStream(msg);
+
+	if (stream) {
+		buf = msgStreamCopy(stream);
+		msgStreamFree(stream);
+	}
 	return buf;
 }
 
 /**
- * this is the function that takes over from main().  
- * It will call all functions nessicary to finish off the 
- * rest of the program and then return properly. 
+ * Gets the text of the message from STDIN, the editor, or makes
+ * a blank one.  It will ask for a subject if there isn't one.
 **/
-void
-createMail(void)
+static dstrbuf *
+readMessage(void)
 {
 	dstrbuf *msg=NULL;
-	char subject[MAXBUF]={0};
+	static char subject[MAXBUF]={0};
 
 	/**
 	 * first let's check if someone has tried to send stuff in from STDIN 
@@ -536,12 +637,35 @@ createMail(void)
 			msg = DSB_NEW;
 		}
 	}
+	return msg;
+}
+
+/**
+ * this is the function that takes over from main().  
+ * It will call all functions nessicary to finish off the 
+ * rest of the program and then return properly. 
+**/
+void
+createMail(void)
+{
+	int retval;
+	dstrbuf *msg=NULL;
+	dstrbuf *mail=NULL;
 
 	/* Create a message according to the type */
-	if (Mopts.gpg_opts) {
-		global_msg = createGpgEmail(msg, Mopts.gpg_opts);
+	if (isatty(STDIN_FILENO) == 0 && !Mopts.encoding && !Mopts.gpg_opts) {
+		/* Send the text as it comes in rather than waiting for it all */
+		global_msg = createInputStream();
 	} else {
-		global_msg = createPlainEmail(msg);
+		msg = readMessage();
+		if (Mopts.gpg_opts) {
+			mail = createGpgEmail(msg, Mopts.gpg_opts);
+			if (mail) {
+				global_msg = msgStreamFromBuf(mail, false);
+			}
+		} else {
+			global_msg = createPlainStream(msg);
+		}
 	}
 
 	if (!global_msg) {
@@ -550,6 +674,349 @@ createMail(void)
 	}
 
 	dsbDestroy(msg);
-	sendmail(global_msg);
+	if (Mopts.queue) {
+		retval = spoolMessage(global_msg, NULL);
+	} else {
+		retval = sendmail(global_msg);
+
+		/* Keep it for another try if that's what the spool is for */
+		if (retval == ERROR && Conf.spool_dir && sendmailTemporary()) {
+			retval = spoolMessage(global_msg, smtpGetErr());
+			if (retval != ERROR) {
+				warning("The message was spooled and will be tried again\n");
+			}
+		}
+		sendmailClose();
+	}
+	if (retval == ERROR) {
+		properExit(ERROR);
+	}
 }
 
+/* Where we are in the batch or merge file */
+struct batch {
+	FILE *file;
+	dstrbuf *buf;
+	int line;
+	int sent;
+	int failed;
+	struct mergedata *data;	/* The rest is only used for a merge */
+	const char *to;		/* Templates the data is filled in to */
+	char *subject;
+	dlist headers;
+	dstrbuf *body;
+	dstrbuf *border;
+	dstrbuf *parts;		/* The attachments, encoded once for everyone */
+};
+
+/**
+ * Adds everyone in the To, Cc and Bcc lists to the job's 
+ * recipients, once each.
+**/
+static void
+addJobRcpts(struct smtpjob *job)
+{
+	char *next=NULL;
+	dlist rcpts = getRcpts(Mopts.to, Mopts.cc, Mopts.bcc);
+
+	while ((next = (char *)dlGetNext(rcpts)) != NULL) {
+		smtpJobAddRcpt(job, next);
+	}
+	dlDestroy(rcpts);
+}
+
+/**
+ * Makes a message out of the next usable line in the batch file.
+ * Lines that can't be used are counted as failed and skipped.
+**/
+static struct smtpjob *
+batchFeed(void *arg)
+{
+	char *file=NULL;
+	dstrbuf *msg=NULL, *mail=NULL;
+	struct smtpjob *job;
+	struct batch *b = arg;
+
+	while (!feof(b->file)) {
+		dsbReadline(b->buf, b->file);
+		chomp(b->buf->str);
+		b->line++;
+		if (b->buf->str[0] == '#' || b->buf->str[0] == '\0') {
+			continue;
+		}
+
+		file = strchr(b->buf->str, '\t');
+		if (!file) {
+			warning("Batch file line %d has no message file. Skipping...\n", b->line);
+			b->failed++;
+			continue;
+		}
+		*file++ = '\0';
+
+		if (Mopts.to) {
+			dlDestroy(Mopts.to);
+		}
+		Mopts.to = getNames(b->buf->str);
+		if (!Mopts.to || !dlGetTop(Mopts.to)) {
+			warning("Batch file line %d has no valid recipients. Skipping...\n", b->line);
+			b->failed++;
+			continue;
+		}
+
+		msg = readFileInput(file);
+		if (!msg) {
+			warning("Could not read message file %s. Skipping...\n", file);
+			b->failed++;
+			continue;
+		}
+
+		if (Mopts.gpg_opts) {
+			mail = createGpgEmail(msg, Mopts.gpg_opts);
+		} else {
+			mail = createPlainEmail(msg);
+		}
+		dsbDestroy(msg);
+		if (!mail) {
+			b->failed++;
+			continue;
+		}
+
+		job = smtpJobNew(mail);
+		addJobRcpts(job);
+		return job;
+	}
+	return NULL;
+}
+
+/**
+ * Counts up how a message from the batch file did.
+**/
+static void
+batchDone(struct smtpjob *job, void *arg)
+{
+	struct batch *b = arg;
+
+	if (job->status == ERROR) {
+		b->failed++;
+	} else {
+		b->sent++;
+	}
+	smtpJobDestroy(job);
+}
+
+/**
+ * Says how the batch went and exits with an error if anything 
+ * couldn't be sent.
+**/
+static void
+batchReport(struct batch *b)
+{
+	if (Mopts.verbose) {
+		printf("%s %d message(s), %d failed\n", 
+			Mopts.queue ? "Queued" : "Sent", b->sent, b->failed);
+	}
+	if (b->failed) {
+		properExit(ERROR);
+	}
+}
+
+/**
+ * Sends one message for each line in the batch file.  Each line
+ * holds a comma separated list of recipients and, after a tab, the 
+ * file to use as the body of that message.  Everything else comes 
+ * from the command line and is the same for every message.  The
+ * messages go out over the same SMTP session, or over SMTP_SESSIONS
+ * sessions at once if that's set.  With -queue they're put in the
+ * spool instead.
+**/
+void
+createBatchMail(const char *batch_file)
+{
+	struct batch b;
+	dstrbuf *path = expandPath(batch_file);
+
+	memset(&b, 0, sizeof(b));
+	if (!(b.file = fopen(path->str, "r"))) {
+		fatal("Could not open batch file: %s", path->str);
+		dsbDestroy(path);
+		properExit(ERROR);
+	}
+	dsbDestroy(path);
+
+	b.buf = DSB_NEW;
+	if (Mopts.queue) {
+		spoolJobs(batchFeed, batchDone, &b);
+	} else {
+		sendmailBatch(batchFeed, batchDone, &b);
+	}
+	fclose(b.file);
+	dsbDestroy(b.buf);
+	batchReport(&b);
+}
+
+static void
+headerDestr(void *ptr)
+{
+	xfree(ptr);
+}
+
+/**
+ * Fills in the templates with the merge record that was just
+ * read and makes a message out of them.  
+ *
+ * Return
+ * 	- The message ready to be sent
+ * 	- NULL if the record can't be used.  It's been warned about.
+**/
+static struct smtpjob *
+mergeJob(struct batch *b)
+{
+	bool failed=false;
+	char *hdr=NULL;
+	dstrbuf *to=NULL, *subject=NULL, *body=NULL, *filled=NULL;
+	dstrbuf *mail=NULL;
+	struct smtpjob *job=NULL;
+	CharSetType cs;
+
+	if (!(to = mergeFill(b->data, b->to, true)) || 
+	    !(body = mergeFill(b->data, b->body->str, false))) {
+		goto end;
+	}
+	if (b->subject && !(subject = mergeFill(b->data, b->subject, true))) {
+		goto end;
+	}
+	if (Mopts.headers) {
+		dlDestroy(Mopts.headers);
+		Mopts.headers = NULL;
+	}
+	if (b->headers) {
+		Mopts.headers = dlInit(headerDestr);
+		while ((hdr = (char *)dlGetNext(b->headers)) != NULL) {
+			if (failed || !(filled = mergeFill(b->data, hdr, true))) {
+				failed = true;
+				continue;
+			}
+			dlInsertTop(Mopts.headers, xstrdup(filled->str));
+			dsbDestroy(filled);
+		}
+		if (failed) {
+			goto end;
+		}
+	}
+
+	if (Mopts.to) {
+		dlDestroy(Mopts.to);
+	}
+	Mopts.to = getNames(to->str);
+	if (!Mopts.to || !dlGetTop(Mopts.to)) {
+		warning("Merge file line %d has no valid recipients. Skipping...\n", 
+			b->data->rec_line);
+		goto end;
+	}
+	Mopts.subject = subject ? subject->str : NULL;
+
+	if (Mopts.gpg_opts) {
+		mail = createGpgEmail(body, Mopts.gpg_opts);
+	} else {
+		if (Mopts.encoding) {
+			cs = getCharSet((u_char *)body->str);
+		} else {
+			cs = IS_ASCII;
+		}
+		mail = dsbNew(body->len + (b->parts ? b->parts->len : 0) + MAXBUF);
+		printHeaders(b->border->str, mail, cs);
+		makeMessage(body, mail, b->border->str, cs);
+		if (b->parts) {
+			dsbnCat(mail, b->parts->str, b->parts->len);
+		}
+	}
+	if (mail) {
+		job = smtpJobNew(mail);
+		addJobRcpts(job);
+	}
+
+end:
+	Mopts.subject = b->subject;
+	dsbDestroy(to);
+	dsbDestroy(subject);
+	dsbDestroy(body);
+	return job;
+}
+
+/**
+ * Makes a message out of the next usable record in the merge file.
+ * Records that can't be used are counted as failed and skipped.
+**/
+static struct smtpjob *
+mergeFeed(void *arg)
+{
+	int ret;
+	struct smtpjob *job=NULL;
+	struct batch *b = arg;
+
+	while (!job && (ret = mergeNext(b->data)) != 0) {
+		if (ret == ERROR || !(job = mergeJob(b))) {
+			b->failed++;
+		}
+	}
+	return job;
+}
+
+/**
+ * Sends one message for each record in the merge file.  The text of 
+ * the message, the recipients in to, the subject and any headers are
+ * templates that have each {{field}} filled in from the record.  The
+ * rest comes from the command line and is the same for every message,
+ * so attachments are only read and encoded once.  The messages are
+ * sent like a batch.
+**/
+void
+createMergeMail(const char *merge_file, const char *to)
+{
+	struct batch b;
+	struct msgstream *stream=NULL;
+
+	memset(&b, 0, sizeof(b));
+	if (!(b.data = mergeOpen(merge_file))) {
+		properExit(ERROR);
+	}
+	b.body = readMessage();
+	b.to = to;
+	b.subject = Mopts.subject;
+	b.headers = Mopts.headers;
+	Mopts.headers = NULL;
+
+	if (Mopts.attach) {
+		b.border = mimeMakeBoundary();
+	} else {
+		b.border = DSB_NEW;
+	}
+	if (Mopts.attach && !Mopts.gpg_opts) {
+		stream = msgStreamNew(DSB_NEW, b.border->str, Mopts.attach);
+		if (stream) {
+			b.parts = msgStreamCopy(stream);
+			msgStreamFree(stream);
+		}
+		if (!b.parts) {
+			b.failed++;
+			goto end;
+		}
+	}
+
+	if (Mopts.queue) {
+		spoolJobs(mergeFeed, batchDone, &b);
+	} else {
+		sendmailBatch(mergeFeed, batchDone, &b);
+	}
+
+end:
+	if (Mopts.headers) {
+		dlDestroy(Mopts.headers);
+	}
+	Mopts.headers = b.headers;
+	mergeClose(b.data);
+	dsbDestroy(b.body);
+	dsbDestroy(b.border);
+	dsbDestroy(b.parts);
+	batchReport(&b);
+}
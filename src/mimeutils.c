@@ -30,11 +30,19 @@
 
 #include <sys/types.h>
 
+/* The vector encoders need GCC's target attributes and x86 */
+#if HAVE_IMMINTRIN_H && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define B64_SIMD 1
+#endif
+
 #include "email.h"
 #include "utils.h"
 #include "dstrbuf.h"
 #include "dutil.h"
 #include "mimeutils.h"
+#include "file_io.h"
 
 static dstrbuf *
 getMimeType(const char *str)
@@ -65,40 +73,36 @@ mimeFilename(const char *in_name)
 	return ret;
 }
 
-/**
- * executes the 'file' command with the -bi options.
- * it redirects stderr to /dev/null.  If the command
- * didn't execute properly, or the type returned is
- * something that does not look like a mime type, then
- * application/unknown is returned.
-**/
 #define MAGIC_FILE EMAIL_DIR "/mime.types"
 
-dstrbuf *
-mimeFiletype(const char *filename)
+/* Extension to mime type, filled from MAGIC_FILE the first time it's needed */
+static dhash mime_types = NULL;
+
+static void
+mimeTypeDestr(void *ptr)
+{
+	xfree(ptr);
+}
+
+/**
+ * Reads MAGIC_FILE into mime_types.  Each line is a type followed
+ * by the extensions that go with it.  If an extension turns up on
+ * more than one line, the first one wins.  A missing file just 
+ * leaves the table empty so it isn't looked for again.
+**/
+static void
+mimeLoadTypes(void)
 {
-	bool found=false;
 	int i=0, veclen=0;
 	dstrbuf *type=NULL;
 	dstrbuf *buf=DSB_NEW;
 	dvector vec=NULL;
-	const char *ext=NULL;
-	dstrbuf *filen=NULL;
 	FILE *file = fopen(MAGIC_FILE, "r");
 
+	mime_types = dhInit(512, mimeTypeDestr);
 	if (!file) {
 		goto exit;
 	}
-	filen = mimeFilename(filename);
-	ext = strrchr(filen->str, '.');
-
-	/* If we don't know  the extension, we don't know what type
-	 * of file it's going to be. Therefore, skip all of this.  */
-	if (!ext) {
-		goto exit;
-	}
-	/* Get past . in extension name. */
-	ext++;
 
 	while (!feof(file)) {
 		dsbReadline(buf, file);
@@ -107,12 +111,9 @@ mimeFiletype(const char *filename)
 		}
 		chomp(buf->str);
 
-		/* If we still have an allocated type, free it */
-		if (type) {
-			dsbDestroy(type);
-		}
 		type = getMimeType(buf->str);
 		if (type->len == 0) {
+			dsbDestroy(type);
 			continue;
 		}
 		vec = explode(buf->str, " \t");
@@ -120,31 +121,67 @@ mimeFiletype(const char *filename)
 		/* Start i at 1 since the first element in the
 		 * vector is the mime type. The exts are after that. */
 		for (i=1; i < veclen; i++) {
-			if (strcmp((char *)vec[i], ext) == 0) {
-				found = true;
-				break;
+			if (!dhGetItem(mime_types, (char *)vec[i])) {
+				dhInsert(mime_types, (char *)vec[i], xstrdup(type->str));
 			}
 		}
 		dvDestroy(vec);
-		if (found) {
-			/* Found it! */
-			break;
-		}
+		dsbDestroy(type);
 	}
 
 exit:
-	dsbDestroy(filen);
 	dsbDestroy(buf);
 	if (file) {
 		fclose(file);
 	}
-	if (!type || type->len == 0) {
-		type = DSB_NEW;
+}
+
+/**
+ * Looks up the mime type of a file by it's extension in 
+ * MAGIC_FILE.  The file is only read once, however many 
+ * attachments there are.  If the extension isn't known, 
+ * application/unknown is returned.
+**/
+dstrbuf *
+mimeFiletype(const char *filename)
+{
+	const char *ext=NULL, *found=NULL;
+	dstrbuf *type=DSB_NEW;
+	dstrbuf *filen=mimeFilename(filename);
+
+	if (!mime_types) {
+		mimeLoadTypes();
+	}
+
+	/* If we don't know  the extension, we don't know what type
+	 * of file it's going to be. Therefore, skip all of this.  */
+	ext = strrchr(filen->str, '.');
+	if (ext) {
+		/* Get past . in extension name. */
+		found = dhGetItem(mime_types, ext + 1);
+	}
+
+	if (found) {
+		dsbCopy(type, found);
+	} else {
 		dsbCopy(type, "application/unknown");
 	}
+	dsbDestroy(filen);
 	return type;
 }
 
+/**
+ * Frees the table of mime types, if it was ever read.
+**/
+void
+mimeFreeTypes(void)
+{
+	if (mime_types) {
+		dhDestroy(mime_types);
+		mime_types = NULL;
+	}
+}
+
 /**
  * Makes a boundary for Mime emails 
 **/
@@ -166,8 +203,6 @@ mimeMakeBoundary(void)
  * http://base64.sourceforge.net
 **/
 
-#define MAX_B64_LINE 72
-
 /* Our base64 table of chars */
 static const char cb64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" 
 			   "abcdefghijklmnopqrstuvwxyz" 
@@ -188,42 +223,226 @@ mimeB64EncodeBlock(const u_char in[3], u_char out[4], int len)
 }
 
 
+/* Input bytes that make up one line of base64 */
+#define B64_LINE_BYTES ((MAX_B64_LINE / 4) * 3)
+
+/* How much of a file mimeB64EncodeFile() reads at a time */
+#define B64_FILE_BLOCK (B64_LINE_BYTES * 1024)
+
+/**
+ * How long len bytes are once they've been base64 encoded the way
+ * mimeB64EncodeFile() does it, line breaks and all.
+**/
+size_t
+mimeB64EncodedSize(size_t len)
+{
+	size_t enc = ((len + 2) / 3) * 4;
+
+	return enc + ((enc + MAX_B64_LINE - 1) / MAX_B64_LINE) * 2;
+}
+
+/* Encodes len bytes of in, a multiple of 3, with no padding or CRLF */
+typedef void (*b64run)(const u_char *in, size_t len, char *out);
+
+/**
+ * The plain encoder.  Each group of 3 is done straight from the
+ * table, the same as mimeB64EncodeBlock() without the padding.
+**/
+static void
+b64RunScalar(const u_char *in, size_t len, char *out)
+{
+	const u_char *end = in + len;
+	u_int v;
+
+	for (; in < end; in += 3) {
+		v = (in[0] << 16) | (in[1] << 8) | in[2];
+		*out++ = cb64[v >> 18];
+		*out++ = cb64[(v >> 12) & 0x3f];
+		*out++ = cb64[(v >> 6) & 0x3f];
+		*out++ = cb64[v & 0x3f];
+	}
+}
+
+#ifdef B64_SIMD
+/**
+ * The vector encoders take 12 bytes for every 16 they load.  
+ * They're shuffled so each 32 bit lane holds 3 bytes, the four
+ * 6 bit values are moved into their own bytes with a pair of 
+ * multiplies, and each value is turned into it's character by 
+ * adding an offset picked with pshufb from which of the five
+ * ranges (A-Z, a-z, 0-9, + and /) it falls in.  They stop while
+ * a full load still fits in len and leave the rest to the plain 
+ * encoder, so nothing past in + len is ever read.
+**/
+__attribute__((target("ssse3"))) static void
+b64RunSsse3(const u_char *in, size_t len, char *out)
+{
+	const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 
+		4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i offsets = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+		-4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i v, lo, hi, idx;
+
+	while (len >= 16) {
+		v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), shuf);
+		lo = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+			_mm_set1_epi32(0x04000040));
+		hi = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+			_mm_set1_epi32(0x01000010));
+		v = _mm_or_si128(lo, hi);
+
+		idx = _mm_subs_epu8(v, _mm_set1_epi8(51));
+		idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(v, _mm_set1_epi8(25)));
+		v = _mm_add_epi8(v, _mm_shuffle_epi8(offsets, idx));
+		_mm_storeu_si128((__m128i *)out, v);
+
+		in += 12;
+		len -= 12;
+		out += 16;
+	}
+	b64RunScalar(in, len, out);
+}
+
+/**
+ * The same as b64RunSsse3() with two 16 byte loads, 12 bytes apart,
+ * in each half of a 256 bit register.  24 bytes a time.
+**/
+__attribute__((target("avx2"))) static void
+b64RunAvx2(const u_char *in, size_t len, char *out)
+{
+	const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 
+		4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6, 7, 
+		4, 5, 3, 4, 1, 2, 0, 1);
+	const __m256i offsets = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+		-4, -4, -4, -4, -19, -16, 0, 0, 65, 71, -4, -4, -4, -4, -4, -4,
+		-4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i v, lo, hi, idx;
+
+	while (len >= 28) {
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *)in)),
+			_mm_loadu_si128((const __m128i *)(in + 12)), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		lo = _mm256_mulhi_epu16(_mm256_and_si256(v, 
+			_mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		hi = _mm256_mullo_epi16(_mm256_and_si256(v, 
+			_mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		v = _mm256_or_si256(lo, hi);
+
+		idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+		idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+		v = _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, idx));
+		_mm256_storeu_si256((__m256i *)out, v);
+
+		in += 24;
+		len -= 24;
+		out += 32;
+	}
+	b64RunSsse3(in, len, out);
+}
+#endif /* B64_SIMD */
+
+/**
+ * Picks the fastest encoder this CPU can run.  
+ * __builtin_cpu_supports() only reads what the CPU was found to 
+ * have at startup, so it's cheap enough to ask every time.
+**/
+static b64run
+b64PickRun(void)
+{
+#ifdef B64_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		return b64RunAvx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return b64RunSsse3;
+	}
+#endif
+	return b64RunScalar;
+}
+
+/**
+ * Encodes len bytes of in to base64 at out.  With maxline, a CRLF 
+ * goes after every MAX_B64_LINE characters and after the last line,
+ * so out needs room for mimeB64EncodedSize(len) bytes.  Without it
+ * out needs 4 bytes for every 3 (or part of 3) of in.  Whole groups
+ * of 3 go through the fastest encoder the CPU has; only the very 
+ * end goes through mimeB64EncodeBlock() for it's padding.
+ *
+ * Returns how many bytes were written to out.
+**/
+size_t
+mimeB64EncodeBuf(const u_char *in, size_t len, char *out, bool maxline)
+{
+	size_t n, whole, line = maxline ? B64_LINE_BYTES : len;
+	u_char last[3];
+	char *start = out;
+	b64run run = b64PickRun();
+
+	while (len > 0) {
+		n = (len < line) ? len : line;
+		len -= n;
+		whole = n - n % 3;
+		run(in, whole, out);
+		in += whole;
+		out += (whole / 3) * 4;
+		if (n % 3) {
+			memset(last, 0, sizeof(last));
+			memcpy(last, in, n % 3);
+			mimeB64EncodeBlock(last, (u_char *)out, n % 3);
+			in += n % 3;
+			out += 4;
+		}
+		if (maxline) {
+			*out++ = '\r';
+			*out++ = '\n';
+		}
+	}
+	return out - start;
+}
+
 /**
  * Encode_file will encode file infile placing it 
- * in file outfile including padding and EOL of \r\n properly
+ * in file outfile including padding and EOL of \r\n properly.
+ * The file is read a block at a time and each block is encoded
+ * a line at a time, so it comes out the same as one big string.
+ * If the file can be mapped, the blocks are encoded right out of
+ * the mapping instead of being read.
 **/
 int
 mimeB64EncodeFile(FILE *infile, dstrbuf *outbuf)
 {
-	u_char in[3], out[4];
-	int i, len, blocksout = 0;
-
-	while (!feof(infile)) {
-		len = 0;
-		for (i = 0; i < 3; i++) {
-			in[i] = (u_char) getc(infile);
-			if (!feof(infile)) {
-				len++;
-			} else {
-				in[i] = 0;
-			}
-		}
-		if (len) {
-			mimeB64EncodeBlock(in, out, len);
-			dsbnCat(outbuf, (char *)out, 4);
-			blocksout++;
-		}
-		if (blocksout >= (MAX_B64_LINE / 4) || feof(infile)) {
-			if (blocksout) {
-				dsbCat(outbuf, "\r\n");
+	size_t len, off, map_len;
+	int retval = 0;
+	u_char *in = NULL;
+	char *out = xmalloc(mimeB64EncodedSize(B64_FILE_BLOCK));
+	const u_char *map = mapFile(infile, &map_len);
+
+	if (map) {
+		for (off=0; off < map_len; off += len) {
+			len = map_len - off;
+			if (len > B64_FILE_BLOCK) {
+				len = B64_FILE_BLOCK;
 			}
-			blocksout = 0;
+			dsbnCat(outbuf, out, mimeB64EncodeBuf(map + off, len, out, true));
 		}
-		if (ferror(infile)) {
-			return -1;
+		if (unmapFile(map, map_len) == ERROR) {
+			retval = -1;
 		}
+		xfree(out);
+		return retval;
 	}
-	return 0;
+
+	in = xmalloc(B64_FILE_BLOCK);
+	while ((len = fread(in, sizeof(u_char), B64_FILE_BLOCK, infile)) > 0) {
+		dsbnCat(outbuf, out, mimeB64EncodeBuf(in, len, out, true));
+	}
+	if (ferror(infile)) {
+		retval = -1;
+	}
+	xfree(in);
+	xfree(out);
+	return retval;
 }
 
 /**
@@ -232,29 +451,17 @@ mimeB64EncodeFile(FILE *infile, dstrbuf *outbuf)
 dstrbuf *
 mimeB64EncodeString(const u_char *inbuf, size_t len, bool maxline)
 {
-	u_int i=0, j=0, blk_size=0, blocksout=0;
-	dstrbuf *retbuf = dsbNew(100);
-	u_char block[3], encblock[4];
-
-	/* Loop through the entire string encoding 3 8-bit chunks. */
-	while (i < len) {
-		blk_size = 0;
-		for (j=0; j < 3; j++) {
-			if (i < len) {
-				block[j] = inbuf[i++];
-				blk_size++;
-			} else {
-				block[j] = 0;
-			}
-		}
-		mimeB64EncodeBlock(block, encblock, blk_size);
-		dsbnCat(retbuf, (char *)encblock, 4);
-		blocksout++;
-		if (maxline && (blocksout >= (MAX_B64_LINE / 4) || i == len)) {
-			dsbPrintf(retbuf, "\r\n");
-			blocksout = 0;
-		}
+	size_t size;
+	dstrbuf *retbuf;
+
+	if (maxline) {
+		size = mimeB64EncodedSize(len);
+	} else {
+		size = ((len + 2) / 3) * 4;
 	}
+	retbuf = dsbNew(size + 1);
+	retbuf->len = mimeB64EncodeBuf(inbuf, len, retbuf->str, maxline);
+	retbuf->str[retbuf->len] = '\0';
 	return retbuf;
 }
 
@@ -270,81 +477,120 @@ mimeB64EncodeString(const u_char *inbuf, size_t len, bool maxline)
  * chars 33 - 60
  * chars 62 - 126
  * can be represented as-is.  All others 
- * should be encoded.
+ * should be encoded.  The table below sorts every byte into
+ * one of these, with tabs and spaces and line endings set apart
+ * since what happens to them depends on what comes next.
 **/
+enum {
+	QL,	/* Goes as-is */
+	QE,	/* Gets encoded (NUL too, so a run stops there) */
+	QW,	/* Space or tab, encoded only before a line ending */
+	QR,	/* CR */
+	QN	/* LF */
+};
+
+static const u_char qp_class[256] = {
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QW, QN, QL, QL, QR, QL, QL,	/* 00 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL,	/* 10 */
+	QW, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL,	/* 20 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QE, QL, QL,	/* 30 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL,	/* 40 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL,	/* 50 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL,	/* 60 */
+	QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QL, QE,	/* 70 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* 80 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* 90 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* A0 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* B0 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* C0 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* D0 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE,	/* E0 */
+	QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE, QE	/* F0 */
+};
+
+static const char qp_hex[] = "0123456789ABCDEF";
 
-static int
-qpIsEncodable(int c)
-{
-	if (((c >= 9) && (c <= 60)) || ((c >= 62) && (c <= 126))) {
-		return 0;
-	}
-	return 1;
-}
-
-static void
-qpStdout(int ch, int *curr_len, dstrbuf *out, bool wrap)
-{
-	if ((*curr_len == (QP_MAX_LINE_LEN - 1)) && wrap) {
-		dsbPrintf(out, "=\r\n");
-		*curr_len = 0;
-	}
-
-	dsbPrintf(out, "%c", ch);
-	(*curr_len)++;
-}
-
-static void
-qpEncout(int ch, int *curr_len, dstrbuf *out, bool wrap)
+/**
+ * The most a string of len bytes can grow to.  At worst every 
+ * byte is encoded to 3, and a soft line break is put in after 
+ * every 73 or more of those.
+**/
+static size_t
+qpEncodedMax(size_t len)
 {
-	if (((*curr_len + 3) >= QP_MAX_LINE_LEN) && wrap) {
-		dsbPrintf(out, "=\r\n");
-		*curr_len = 0;
-	}
-
-	dsbPrintf(out, "=%02X", ch);
-	*curr_len += 3;
+	return (len * 3) + (((len * 3) / (QP_MAX_LINE_LEN - 3)) + 1) * 3;
 }
 
 /**
- * Encode a quoted printable string.
+ * Encode a quoted printable string.  Runs of bytes that go as-is 
+ * are found with the table and copied in one go, up to where the 
+ * line has to be broken.  Everything is written straight into a 
+ * buffer big enough for the worst case.
 **/
 dstrbuf *
 mimeQpEncodeString(const u_char *str, bool wrap)
 {
-	int line_len=0;
-	dstrbuf *out = DSB_NEW;
-
-	for (; *str != '\0'; str++) {
+	size_t len = strlen((const char *)str);
+	size_t run, line_len=0;
+	const u_char *p;
+	u_char cls;
+	dstrbuf *out = dsbNew(qpEncodedMax(len) + 1);
+	char *o = out->str;
+
+	while (*str != '\0') {
 		if (line_len == (QP_MAX_LINE_LEN - 1) && wrap) {
-			dsbPrintf(out, "=\r\n");
+			memcpy(o, "=\r\n", 3);
+			o += 3;
 			line_len = 0;
 		}
 
-		switch (*str) {
-		case ' ':
-		case '\t':
-			if ((str[1] == '\r') || (str[1] == '\n')) {
-				qpEncout(*str, &line_len, out, wrap);
-			} else {
-				qpStdout(*str, &line_len, out, wrap);
+		cls = qp_class[*str];
+		if (cls == QW && (qp_class[str[1]] == QR || qp_class[str[1]] == QN)) {
+			cls = QE;
+		}
+
+		switch (cls) {
+		case QW:
+		case QL:
+			for (p = str + 1; qp_class[*p] == QL || (qp_class[*p] == QW && 
+			    qp_class[p[1]] != QR && qp_class[p[1]] != QN); p++)
+				;
+			run = p - str;
+			if (wrap && run > (QP_MAX_LINE_LEN - 1) - line_len) {
+				run = (QP_MAX_LINE_LEN - 1) - line_len;
 			}
+			memcpy(o, str, run);
+			o += run;
+			str += run;
+			line_len += run;
 			break;
-		case '\r':
-			str++;          /* Get to newline */
-		case '\n':
-			dsbPrintf(out, "\r\n");
+		case QR:
+			if (str[1] == '\n') {
+				str++;
+			}
+			/* FALLTHROUGH */
+		case QN:
+			memcpy(o, "\r\n", 2);
+			o += 2;
+			str++;
 			line_len = 0;
 			break;
 		default:
-			if (qpIsEncodable(*str)) {
-				qpEncout(*str, &line_len, out, wrap);
-			} else {
-				qpStdout(*str, &line_len, out, wrap);
+			if (((line_len + 3) >= QP_MAX_LINE_LEN) && wrap) {
+				memcpy(o, "=\r\n", 3);
+				o += 3;
+				line_len = 0;
 			}
+			*o++ = '=';
+			*o++ = qp_hex[*str >> 4];
+			*o++ = qp_hex[*str & 0x0f];
+			str++;
+			line_len += 3;
 			break;
 		}
 	}
+	out->len = o - out->str;
+	*o = '\0';
 	return out;
 }
 
@@ -0,0 +1,497 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "email.h"
+#include "mimeutils.h"
+#include "msgstream.h"
+#include "attcache.h"
+#include "encpool.h"
+#include "file_io.h"
+#include "error.h"
+
+/* How much of an attachment to read at a time.  It's a whole
+   number of base64 lines, so the chunks encode the same as the
+   whole file would. */
+#define MSG_READ_SIZE  ((MAX_B64_LINE / 4) * 3 * 1024)
+
+/* Attachments bigger than this are encoded on the thread pool */
+#define MSG_POOL_SIZE  (MSG_READ_SIZE * 2)
+
+/**
+ * Prints the MIME headers that go in front of an attached file.
+**/
+void
+msgStreamAttachHeaders(const char *border, const char *file, dstrbuf *out)
+{
+	dstrbuf *file_type = mimeFiletype(file);
+	dstrbuf *file_name = mimeFilename(file);
+
+	dsbPrintf(out, "\r\n--%s\r\n", border);
+	dsbPrintf(out, "Content-Transfer-Encoding: base64\r\n");
+	dsbPrintf(out, "Content-Type: %s; name=\"%s\"\r\n", 
+		file_type->str, file_name->str);
+	dsbPrintf(out, "Content-Disposition: attachment; filename=\"%s\"\r\n", 
+		file_name->str);
+	dsbPrintf(out, "\r\n");
+	dsbDestroy(file_type);
+	dsbDestroy(file_name);
+}
+
+/**
+ * Makes a stream out of head, which holds the headers and text of
+ * the message, and the files in attach (if any) separated by border.
+ * The stream takes head over.  The files are checked here so we
+ * know about anything we can't attach before we start sending, 
+ * and so we know how long the message will be.
+**/
+struct msgstream *
+msgStreamNew(dstrbuf *head, const char *border, dlist attach)
+{
+	char *file=NULL;
+	struct stat st;
+	struct msgstream *s = xmalloc(sizeof(struct msgstream));
+
+	memset(s, 0, sizeof(struct msgstream));
+	s->head = head;
+	s->size = head->len;
+	s->buf = DSB_NEW;
+	if (!attach) {
+		return s;
+	}
+
+	s->border = DSB_NEW;
+	dsbCopy(s->border, border);
+	while ((file = (char *)dlGetNext(attach)) != NULL) {
+		s->files = xrealloc(s->files, sizeof(char *) * (s->nfiles + 1));
+		s->files[s->nfiles++] = xstrdup(file);
+	}
+	for (s->cur=0; s->cur < s->nfiles; s->cur++) {
+		file = s->files[s->cur];
+		if (stat(file, &st) == -1 || !(s->file = fopen(file, "r"))) {
+			fatal("Could not open attachment: %s", file);
+			msgStreamFree(s);
+			return NULL;
+		}
+		fclose(s->file);
+		s->file = NULL;
+
+		dsbClear(s->buf);
+		msgStreamAttachHeaders(border, file, s->buf);
+		s->size += s->buf->len + mimeB64EncodedSize(st.st_size);
+	}
+	dsbClear(s->buf);
+	dsbPrintf(s->buf, "\r\n\r\n--%s--\r\n", border);
+	s->size += s->buf->len;
+	s->cur = 0;
+	s->raw = xmalloc(MSG_READ_SIZE);
+	s->enc = xmalloc(mimeB64EncodedSize(MSG_READ_SIZE));
+	return s;
+}
+
+/**
+ * Makes a stream out of a message that's already been put together.
+ * If borrowed is set, msg still belongs to the caller.
+**/
+struct msgstream *
+msgStreamFromBuf(dstrbuf *msg, bool borrowed)
+{
+	struct msgstream *s = xmalloc(sizeof(struct msgstream));
+
+	memset(s, 0, sizeof(struct msgstream));
+	s->head = msg;
+	s->borrowed = borrowed;
+	s->size = msg->len;
+	s->buf = DSB_NEW;
+	return s;
+}
+
+/**
+ * Has the text of the message read from in as it's sent, rather
+ * than being in head.  The stream takes after over, which is what
+ * goes between the text and the attachments.  Only a block of the
+ * text is held in memory, but it's all copied to a temp file as
+ * it's read, since anything could need it again: another try,
+ * a saved copy, the spool, or dead.letter if the send fails.
+**/
+int
+msgStreamSetInput(struct msgstream *s, FILE *in, dstrbuf *after)
+{
+	int fd;
+	char *dir;
+	dstrbuf *path;
+
+	s->input = in;
+	s->after = after;
+	s->size += after->len;
+	s->text_raw = xmalloc(INPUT_BLOCK);
+	s->text = xmalloc((INPUT_BLOCK * 2) + 1);
+
+	if (!(dir = Conf.temp_dir) && !(dir = getenv("TMPDIR"))) {
+		dir = "/tmp";
+	}
+	path = DSB_NEW;
+	dsbPrintf(path, "%s/.email.text.XXXXXX", dir);
+	if ((fd = mkstemp(path->str)) == -1 || !(s->spill = fdopen(fd, "w+"))) {
+		fatal("Could not make a temp file in %s", dir);
+		if (fd != -1) {
+			close(fd);
+			unlink(path->str);
+		}
+		dsbDestroy(path);
+		return ERROR;
+	}
+	unlink(path->str);
+	dsbDestroy(path);
+	return SUCCESS;
+}
+
+/**
+ * Hands out the next block of text being read from STDIN.  If the
+ * stream has been rewound, what's been read already comes back out
+ * of the temp file first.
+ *
+ * Return
+ * 	- SUCCESS and len is 0 once all the text is out
+ * 	- ERROR
+**/
+static int
+msgStreamText(struct msgstream *s, const char **data, size_t *len)
+{
+	ssize_t bytes;
+	size_t n;
+
+	if (s->text_off < s->text_len) {
+		n = s->text_len - s->text_off;
+		if (n > INPUT_BLOCK * 2) {
+			n = INPUT_BLOCK * 2;
+		}
+		bytes = pread(fileno(s->spill), s->text, n, s->text_off);
+		if (bytes <= 0) {
+			fatal("Could not read the message back from the temp file");
+			return ERROR;
+		}
+		s->text_off += bytes;
+		*data = s->text;
+		*len = bytes;
+		return SUCCESS;
+	}
+
+	while (!feof(s->input)) {
+		n = readInputBlock(s->input, s->text_raw, INPUT_BLOCK, 
+			s->text, &s->input_cr);
+		if (ferror(s->input)) {
+			fatal("Problem reading from STDIN redirect");
+			return ERROR;
+		}
+		if (n == 0) {
+			continue;
+		}
+		if (fwrite(s->text, sizeof(char), n, s->spill) != n ||
+		    fflush(s->spill) != 0) {
+			fatal("Could not write the message to the temp file");
+			return ERROR;
+		}
+		s->text_len += n;
+		s->text_off += n;
+		s->size += n;
+		*data = s->text;
+		*len = n;
+		return SUCCESS;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Lets go of the attachment that's being read.
+ *
+ * Return
+ * 	- SUCCESS
+ * 	- ERROR if it got shorter while it was mapped
+**/
+static int
+msgStreamClose(struct msgstream *s)
+{
+	int retval;
+
+	if (s->pooled) {
+		/* The workers could still be using the file */
+		encPoolStop(s->pool);
+		s->pooled = false;
+	}
+	retval = unmapFile(s->map, s->map_len);
+	s->map = NULL;
+	if (s->file) {
+		fclose(s->file);
+		s->file = NULL;
+	}
+	return retval;
+}
+
+/**
+ * Points data at the next piece of the message and sets len to 
+ * how long it is.  The piece is good until the next call.  At the
+ * end of the message len is 0.
+ *
+ * Return
+ * 	- SUCCESS
+ * 	- ERROR if an attachment couldn't be read
+**/
+int
+msgStreamNext(struct msgstream *s, const char **data, size_t *len)
+{
+	size_t bytes;
+	struct stat st;
+
+	*data = NULL;
+	*len = 0;
+	while (true) {
+		switch (s->part) {
+		case MSG_HEAD:
+			s->part = (s->nfiles > 0) ? MSG_ATTACH_HEAD : MSG_END;
+			if (s->input) {
+				s->part = MSG_TEXT;
+				s->text_off = 0;
+			}
+			if (s->head->len == 0) {
+				/* A length of 0 would look like the end */
+				continue;
+			}
+			*data = s->head->str;
+			*len = s->head->len;
+			return SUCCESS;
+
+		case MSG_TEXT:
+			if (msgStreamText(s, data, len) == ERROR) {
+				return ERROR;
+			}
+			if (*len > 0) {
+				return SUCCESS;
+			}
+			s->part = (s->nfiles > 0) ? MSG_ATTACH_HEAD : MSG_END;
+			if (s->after->len == 0) {
+				continue;
+			}
+			*data = s->after->str;
+			*len = s->after->len;
+			return SUCCESS;
+
+		case MSG_ATTACH_HEAD:
+			if (s->cur == s->nfiles) {
+				s->part = MSG_TAIL;
+				continue;
+			}
+			s->cached = false;
+			s->pooled = false;
+			if (stat(s->files[s->cur], &st) == 0 &&
+			    (s->file = attCacheOpen(s->files[s->cur], &st)) != NULL) {
+				s->cached = true;
+			} else if (!(s->file = fopen(s->files[s->cur], "r"))) {
+				fatal("Could not open attachment: %s", s->files[s->cur]);
+				return ERROR;
+			}
+			s->map = mapFile(s->file, &s->map_len);
+			s->map_off = 0;
+			if (!s->cached && fstat(fileno(s->file), &st) == 0 &&
+			    S_ISREG(st.st_mode) && st.st_size > MSG_POOL_SIZE) {
+				/* Big enough to be worth encoding on the pool */
+				if (!s->pool) {
+					s->pool = encPoolNew(MSG_READ_SIZE);
+				}
+				if (s->pool) {
+					encPoolStart(s->pool, fileno(s->file), s->map,
+					    s->map ? (off_t)s->map_len : st.st_size);
+					s->pooled = true;
+				}
+			}
+			dsbClear(s->buf);
+			msgStreamAttachHeaders(s->border->str, s->files[s->cur], s->buf);
+			s->part = MSG_ATTACH_DATA;
+			*data = s->buf->str;
+			*len = s->buf->len;
+			return SUCCESS;
+
+		case MSG_ATTACH_DATA:
+			if (s->pooled) {
+				if (encPoolNext(s->pool, data, len) == ERROR) {
+					fatal("Could not read attachment: %s", s->files[s->cur]);
+					return ERROR;
+				}
+				bytes = *len;
+			} else if (s->map) {
+				bytes = s->map_len - s->map_off;
+				if (s->cached) {
+					/* It's already encoded, so it goes out 
+					   straight from the mapping */
+					*data = (const char *)s->map + s->map_off;
+					*len = bytes;
+				} else if (bytes > 0) {
+					if (bytes > MSG_READ_SIZE) {
+						bytes = MSG_READ_SIZE;
+					}
+					*data = s->enc;
+					*len = mimeB64EncodeBuf(s->map + s->map_off, bytes,
+						s->enc, true);
+				}
+				s->map_off += bytes;
+			} else {
+				if (s->cached) {
+					/* It's already encoded, so it goes out as is */
+					bytes = fread(s->enc, sizeof(char), MSG_READ_SIZE, s->file);
+				} else {
+					bytes = fread(s->raw, sizeof(char), MSG_READ_SIZE, s->file);
+				}
+				if (bytes == 0 && ferror(s->file)) {
+					fatal("Could not read attachment: %s", s->files[s->cur]);
+					return ERROR;
+				}
+				*data = s->enc;
+				if (s->cached) {
+					*len = bytes;
+				} else if (bytes > 0) {
+					*len = mimeB64EncodeBuf(s->raw, bytes, s->enc, true);
+				}
+			}
+			if (bytes > 0) {
+				return SUCCESS;
+			}
+			if (msgStreamClose(s) == ERROR) {
+				fatal("Attachment changed while it was being sent: %s\n",
+				    s->files[s->cur]);
+				return ERROR;
+			}
+			s->cur++;
+			s->part = MSG_ATTACH_HEAD;
+			*data = NULL;
+			continue;
+
+		case MSG_TAIL:
+			dsbClear(s->buf);
+			dsbPrintf(s->buf, "\r\n\r\n--%s--\r\n", s->border->str);
+			s->part = MSG_END;
+			*data = s->buf->str;
+			*len = s->buf->len;
+			return SUCCESS;
+
+		case MSG_END:
+			return SUCCESS;
+		}
+	}
+}
+
+/**
+ * Starts the stream over from the top.
+**/
+void
+msgStreamRewind(struct msgstream *s)
+{
+	msgStreamClose(s);
+	s->part = MSG_HEAD;
+	s->cur = 0;
+}
+
+/**
+ * Writes the whole message to out.
+**/
+int
+msgStreamWrite(struct msgstream *s, FILE *out)
+{
+	const char *data;
+	size_t len;
+
+	msgStreamRewind(s);
+	while (msgStreamNext(s, &data, &len) != ERROR) {
+		if (len == 0) {
+			return SUCCESS;
+		}
+		if (fwrite(data, sizeof(char), len, out) != len) {
+			return ERROR;
+		}
+	}
+	return ERROR;
+}
+
+/**
+ * Puts the whole message together in one buffer.
+**/
+dstrbuf *
+msgStreamCopy(struct msgstream *s)
+{
+	const char *data;
+	size_t len;
+	dstrbuf *msg = dsbNew(s->size + 1);
+
+	msgStreamRewind(s);
+	while (msgStreamNext(s, &data, &len) != ERROR) {
+		if (len == 0) {
+			return msg;
+		}
+		dsbnCat(msg, data, len);
+	}
+	dsbDestroy(msg);
+	return NULL;
+}
+
+void
+msgStreamFree(struct msgstream *s)
+{
+	if (!s) {
+		return;
+	}
+	msgStreamClose(s);
+	encPoolFree(s->pool);
+	while (s->nfiles > 0) {
+		xfree(s->files[--s->nfiles]);
+	}
+	if (s->files) {
+		xfree(s->files);
+	}
+	if (s->raw) {
+		xfree(s->raw);
+		xfree(s->enc);
+	}
+	if (s->input) {
+		if (s->spill) {
+			fclose(s->spill);
+		}
+		xfree(s->text_raw);
+		xfree(s->text);
+		dsbDestroy(s->after);
+	}
+	if (!s->borrowed) {
+		dsbDestroy(s->head);
+	}
+	dsbDestroy(s->border);
+	dsbDestroy(s->buf);
+	xfree(s);
+}
@@ -25,6 +25,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -36,50 +37,65 @@
 #include "smtpcommands.h"
 #include "processmail.h"
 #include "progress_bar.h"
+#include "addy_book.h"
 #include "error.h"
 
-#define CHUNK_BYTES 1500
-
 /**
  * will invoke the path specified to sendmail with any 
  * options specified and it will send the mail via sendmail...
 **/
 int
-processInternal(const char *sm_bin, dstrbuf *msgcon)
+processInternal(const char *sm_bin, struct msgstream *msgcon)
 {
-	int written_bytes=0, bytes = 0;
+	int retval=SUCCESS;
+	size_t written_bytes=0, bytes=0, left=0;
+	size_t chunk = Conf.send_chunk_size;
 	struct prbar *bar;
 	FILE *open_sendmail;
-	char *ptr = msgcon->str;
+	const char *ptr=NULL;
 	dstrbuf *smpath;
 
-	bar = prbarInit(msgcon->len);
 	smpath = expandPath(sm_bin);
-
 	open_sendmail = popen(smpath->str, "w");
-	dsbDestroy(smpath);
 	if (!open_sendmail) {
 		fatal("Could not open internal sendmail path: %s", smpath->str);
+		dsbDestroy(smpath);
 		return ERROR;
 	}
+	dsbDestroy(smpath);
 
 	/* Loop through getting what's out of message and sending it to sendmail */
-	while (*ptr != '\0') {
-		bytes = strlen(ptr);
-		if (bytes > CHUNK_BYTES) {
-			bytes = CHUNK_BYTES;
+	/* There's no telling how big it is while it's read from STDIN */
+	bar = msgcon->input ? NULL : prbarInit(msgcon->size);
+	msgStreamRewind(msgcon);
+	while (true) {
+		if (left == 0) {
+			if (msgStreamNext(msgcon, &ptr, &left) == ERROR) {
+				retval = ERROR;
+				break;
+			}
+			if (left == 0) {
+				break;
+			}
 		}
+		bytes = (left > chunk) ? chunk : left;
 		written_bytes = fwrite(ptr, sizeof(char), bytes, open_sendmail);
 		if (Mopts.verbose && bar != NULL) {
 			prbarPrint(written_bytes, bar);
 		}
+		if (written_bytes != bytes) {
+			fatal("Could not write message to sendmail");
+			retval = ERROR;
+			break;
+		}
 		ptr += written_bytes;
+		left -= written_bytes;
 	}
 
 	fflush(open_sendmail);
-	fclose(open_sendmail);
+	pclose(open_sendmail);
 	prbarDestroy(bar);
-	return SUCCESS; 
+	return retval; 
 }
 
 /**
@@ -100,7 +116,7 @@ printSmtpError()
 static char *
 getSmtpPass(void)
 {
-	char *retval = getConfValue("SMTP_AUTH_PASS");
+	char *retval = Conf.smtp_auth_pass;
 	if (!retval) {
 		retval = getpass("Enter your SMTP Password: ");
 	}
@@ -108,44 +124,54 @@ getSmtpPass(void)
 }
 
 /**
- * This function will take the FILE and process it via a
- * Remote SMTP server...
+ * The SMTP session that is kept open between messages so that 
+ * a batch of messages only pays for connecting, TLS and AUTH once.
+ */
+static dsocket *session_sd;
+static dstrbuf *session_host;
+static int session_port;
+static int session_msgs;
+
+/* Whether the last time processRemote() failed is worth trying again */
+static bool remote_temp;
+
+/**
+ * Connects to the SMTP server and gets it ready for sending mail.
+ * This takes care of the greeting, TLS and SMTP AUTH.
 **/
-int
-processRemote(const char *smtp_serv, int smtp_port, dstrbuf *msg)
+static dsocket *
+smtpConnect(const char *smtp_serv, int smtp_port)
 {
 	dsocket *sd;
-	int retval=0, bytes;
-	char *smtp_auth=NULL;
-	char *email_addr=NULL;
-	char *use_tls=NULL;
+	bool use_tls=Conf.use_tls;
 	char *user=NULL, *pass=NULL;
-	struct prbar *bar=NULL;
 	char nodename[MAXBUF] = { 0 };
-	char *ptr = msg->str;
-	struct addr *next=NULL;
 
-	email_addr = getConfValue("MY_EMAIL");
 	if (gethostname(nodename, sizeof(nodename) - 1) < 0) {
 		snprintf(nodename, sizeof(nodename) - 1, "geek");
 	}
 
 	/* Get other possible configuration values */
-	smtp_auth = getConfValue("SMTP_AUTH");
-	if (smtp_auth) {
-		user = getConfValue("SMTP_AUTH_USER");
+	if (Conf.smtp_auth) {
+		user = Conf.smtp_auth_user;
 		if (!user) {
 			fatal("You must set SMTP_AUTH_USER in order to user SMTP_AUTH\n");
-			return ERROR;
+			remote_temp = false;
+			return NULL;
 		}
 		pass = getSmtpPass();
 		if (!pass) {
 			fatal("Failed to get SMTP Password.\n");
-			return ERROR;
+			remote_temp = false;
+			return NULL;
+		}
+		/* So we don't have to ask again if we need to reconnect */
+		if (!Conf.smtp_auth_pass) {
+			Conf.smtp_auth_pass = xstrdup(pass);
+			setConfValue("SMTP_AUTH_PASS", Conf.smtp_auth_pass);
 		}
 	}
 
-	bar = prbarInit(msg->len);
 	if (Mopts.verbose) {
 		printf("Connecting to server %s on port %d\n", smtp_serv, smtp_port);
 	}
@@ -153,84 +179,136 @@ processRemote(const char *smtp_serv, int smtp_port, dstrbuf *msg)
 	if (sd == NULL) {
 		fatal("Could not connect to server: %s on port: %d", 
 			smtp_serv, smtp_port);
-		return ERROR;
+		remote_temp = true;
+		return NULL;
 	}
 
 	/* Start SMTP Communications */
 	if (smtpInit(sd, nodename) == ERROR) {
 		printSmtpError();
-		goto end;
+		goto error;
 	}
 
 	/* Use TLS? */
-	use_tls = getConfValue("USE_TLS");
 #ifndef HAVE_LIBSSL
 	if (use_tls) {
 		warning("No SSL support compiled in. Disabling TLS.\n");
-		use_tls = NULL;
+		use_tls = false;
 	}
 #endif
-	if (use_tls && strcasecmp(use_tls, "true") == 0) {
+	if (use_tls) {
 		if (smtpStartTls(sd) != ERROR) {
 			dnetUseTls(sd);
 			dnetVerifyCert(sd);
 			if (smtpInit(sd, nodename) == ERROR) {
 				printSmtpError();
-				goto end;
+				goto error;
 			}
 		} else {
 			printSmtpError();
-			goto end;
+			goto error;
 		}
 	}
 
 	/* See if we're using SMTP_AUTH. */
-	if (smtp_auth) {
-		retval = smtpInitAuth(sd, smtp_auth, user, pass);
-		if (retval == ERROR) {
+	if (Conf.smtp_auth) {
+		if (smtpInitAuth(sd, Conf.smtp_auth, user, pass) == ERROR) {
 			printSmtpError();
-			goto end;
+			goto error;
 		}
 	}
+	return sd;
+
+error:
+	remote_temp = smtpErrTemporary();
+	dnetClose(sd);
+	return NULL;
+}
+
+/**
+ * Drops the session without being polite about it.  Used when
+ * the server has already gone away on us, or when a message 
+ * can't be finished once it's been started.
+**/
+static void
+closeSession(void)
+{
+	if (session_sd) {
+		dnetClose(session_sd);
+		session_sd = NULL;
+	}
+	dsbDestroy(session_host);
+	session_host = NULL;
+	session_msgs = 0;
+}
+
+/**
+ * Sends one message over an SMTP session that is ready for it.
+ * Errors are left for the caller to report.
+**/
+static int
+smtpTransaction(dsocket *sd, struct msgstream *msg)
+{
+	int retval=0;
+	size_t bytes, left=0, sent=0;
+	size_t chunk = Conf.send_chunk_size;
+	char *email_addr=NULL;
+	struct smtpcaps *caps = smtpGetCaps(sd);
+	struct prbar *bar=NULL;
+	const char *ptr=NULL;
+	char *next=NULL;
+	dlist rcpts;
 
+	email_addr = Conf.my_email;
 	retval = smtpSetMailFrom(sd, email_addr);
 	if (retval == ERROR) {
-		printSmtpError();
-		goto end;
+		return ERROR;
 	}
 
-	while ((next = (struct addr *)dlGetNext(Mopts.to)) != NULL) {
-		retval = smtpSetRcpt(sd, next->email);
-		if (retval == ERROR) {
-			printSmtpError();
-			goto end;
-		}
-	}
-	while ((next = (struct addr *)dlGetNext(Mopts.cc)) != NULL) {
-		retval = smtpSetRcpt(sd, next->email);
-		if (retval == ERROR) {
-			printSmtpError();
-			goto end;
+	/* Anyone on more than one list only gets one RCPT */
+	rcpts = getRcpts(Mopts.to, Mopts.cc, Mopts.bcc);
+	while ((next = (char *)dlGetNext(rcpts)) != NULL) {
+		if (retval != ERROR) {
+			retval = smtpSetRcpt(sd, next);
 		}
 	}
-	while ((next = (struct addr *)dlGetNext(Mopts.bcc)) != NULL) {
-		retval = smtpSetRcpt(sd, next->email);
-		if (retval == ERROR) {
-			printSmtpError();
-			goto end;
-		}
+	dlDestroy(rcpts);
+	if (retval == ERROR) {
+		return ERROR;
 	}
 
 	retval = smtpStartData(sd);
 	if (retval == ERROR) {
-		printSmtpError();
-		goto end;
+		return ERROR;
 	}
-	while (*ptr != '\0') {
-		bytes = strlen(ptr);
-		if (bytes > CHUNK_BYTES) {
-			bytes = CHUNK_BYTES;
+
+	bar = msg->input ? NULL : prbarInit(msg->size);
+	msgStreamRewind(msg);
+	while (true) {
+		if (left == 0) {
+			if (msgStreamNext(msg, &ptr, &left) == ERROR) {
+				/* There's no taking back what's been sent, so hang up */
+				closeSession();
+				retval = ERROR;
+				goto end;
+			}
+			if (left == 0) {
+				break;
+			}
+
+			/* Text from STDIN isn't counted until it's read, so the
+			   limit can only be found out part way through.  Hang up
+			   so the server throws away what it has. */
+			sent += left;
+			if (caps && caps->size > 0 && sent > caps->size) {
+				fatal("Message is over the %lu bytes the SMTP server "
+					"accepts\n", (u_long)caps->size);
+				closeSession();
+				retval = ERROR;
+				goto end;
+			}
 		}
+		bytes = (left > chunk) ? chunk : left;
 		retval = smtpSendData(sd, ptr, bytes);
 		if (retval == ERROR) {
 			goto end;
@@ -239,15 +317,116 @@ processRemote(const char *smtp_serv, int smtp_port, dstrbuf *msg)
 			prbarPrint(bytes, bar);
 		}
 		ptr += bytes;
+		left -= bytes;
 	}
 	retval = smtpEndData(sd);
-	if (retval != ERROR) {
-		retval = smtpQuit(sd);
-	}
 
 end:
 	prbarDestroy(bar);
-	dnetClose(sd);
 	return retval;
 }
 
+/**
+ * Says goodbye to the SMTP server if we've got a session open.
+**/
+void
+processRemoteQuit(void)
+{
+	if (session_sd) {
+		smtpQuit(session_sd);
+		dnetClose(session_sd);
+		session_sd = NULL;
+	}
+	dsbDestroy(session_host);
+	session_host = NULL;
+	session_msgs = 0;
+}
+
+/**
+ * This function will take the message and send it via a Remote 
+ * SMTP server.  The session is left open so that the next message
+ * can be sent over it.  It will reconnect when the server has closed
+ * the session on us or after SMTP_MAX_MESSAGES messages.  
+ * processRemoteQuit() closes the session for good.
+**/
+int
+processRemote(const char *smtp_serv, int smtp_port, struct msgstream *msg)
+{
+	int retval=ERROR;
+	int max_msgs=Conf.smtp_max_messages;
+	bool reused;
+	struct smtpcaps *caps=NULL;
+
+	/* A different server, or we've sent all we should over this one */
+	if (session_sd && (smtp_port != session_port || 
+	    strcasecmp(smtp_serv, session_host->str) != 0 ||
+	    (max_msgs > 0 && session_msgs >= max_msgs))) {
+		processRemoteQuit();
+	}
+
+	while (true) {
+		reused = (session_sd != NULL);
+		if (!session_sd) {
+			session_sd = smtpConnect(smtp_serv, smtp_port);
+			if (!session_sd) {
+				return ERROR;
+			}
+			session_host = DSB_NEW;
+			dsbCopy(session_host, smtp_serv);
+			session_port = smtp_port;
+		} else if (smtpReset(session_sd) == ERROR && 
+		    smtpIsClosed(session_sd)) {
+			closeSession();
+			continue;
+		}
+
+		/* Don't send what the server already told us it won't take */
+		caps = smtpGetCaps(session_sd);
+		if (caps && caps->size > 0 && msg->size > caps->size) {
+			fatal("Message is %lu bytes, but the SMTP server only accepts "
+				"%lu bytes\n", (u_long)msg->size, (u_long)caps->size);
+			remote_temp = false;
+			return ERROR;
+		}
+
+		retval = smtpTransaction(session_sd, msg);
+		if (retval != ERROR) {
+			session_msgs++;
+			break;
+		}
+
+		/* The message couldn't be read or was too big, and that's 
+		   been said already */
+		if (!session_sd) {
+			remote_temp = false;
+			break;
+		}
+
+		/* After a timeout or a lost connection the session is out of
+		   step with the server, so it's dropped.  If it's one we've
+		   used before, the server may have just given up on it, so
+		   try again on a new one. */
+		if (smtpIsClosed(session_sd)) {
+			closeSession();
+			if (reused && smtpErrTemporary()) {
+				continue;
+			}
+		}
+		remote_temp = smtpErrTemporary();
+		printSmtpError();
+		break;
+	}
+	return retval;
+}
+
+/**
+ * Tells whether the last message processRemote() failed to send 
+ * might go through if it's tried again later, on this server or 
+ * another one.  A 4xx reply or a connection that went bad might;
+ * a 5xx reply, or a message that's too big or can't be read won't.
+**/
+bool
+processRemoteTemporary(void)
+{
+	return remote_temp;
+}
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 
 #include "email.h"
@@ -34,6 +35,8 @@
 #include "file_io.h"
 #include "remotesmtp.h"
 #include "processmail.h"
+#include "smtpengine.h"
+#include "smtpcommands.h"
 #include "error.h"
 
 /**
@@ -42,32 +45,166 @@
  * file called 'email.sent'
 **/
 static int
-saveSentEmail(dstrbuf *msg)
+saveSentEmail(struct msgstream *msg)
 {
 	FILE *save;
-	char *save_file = NULL;
 	dstrbuf *path;
 
-	save_file = getConfValue("SAVE_SENT_MAIL");
-	if (!save_file) {
-		return ERROR;
+	if (!Conf.save_sent_mail) {
+		/* Nothing to do */
+		return SUCCESS;
 	}
 
-	path = expandPath(save_file);
-	dsbCat(path, "/email.sent");
+	path = DSB_NEW;
+	dsbPrintf(path, "%s/email.sent", Conf.save_sent_mail);
 
 	if (!(save = fopen(path->str, "a"))) {
 		warning("Could not open file: %s", path->str);
 		dsbDestroy(path);
 		return ERROR;
 	}
-	fputs(msg->str, save);
+	if (msgStreamWrite(msg, save) == ERROR) {
+		warning("Could not write to file: %s", path->str);
+	}
 
 	fflush(save);
 	fclose(save);
+	dsbDestroy(path);
 	return SUCCESS;
 }
 
+/**
+ * Reads the relays out of SMTP_RELAYS, a comma separated list of 
+ * host[:port][=weight].  The port defaults to SMTP_PORT and the
+ * weight to 1.  Returns how many relays there are, 0 if SMTP_RELAYS
+ * isn't set.
+**/
+static u_int
+getRelays(struct smtprelay **relays)
+{
+	u_int i, count=0;
+	size_t veclen;
+	char *list, *host, *ptr;
+	dvector vec;
+
+	*relays = NULL;
+	list = Conf.smtp_relays;
+	if (!list) {
+		return 0;
+	}
+
+	vec = explode(list, ",");
+	veclen = dvLength(vec);
+	*relays = xmalloc(sizeof(struct smtprelay) * SMTP_MAX_RELAYS);
+	for (i=0; i < veclen; i++) {
+		host = (char *)vec[i];
+		while (*host == ' ' || *host == '\t') {
+			host++;
+		}
+		if (*host == '\0') {
+			continue;
+		}
+		if (count == SMTP_MAX_RELAYS) {
+			warning("Only the first %d SMTP_RELAYS are used\n", SMTP_MAX_RELAYS);
+			break;
+		}
+
+		host = xstrdup(host);
+		ptr = host + strlen(host);
+		while (ptr > host && (ptr[-1] == ' ' || ptr[-1] == '\t')) {
+			*--ptr = '\0';
+		}
+		(*relays)[count].weight = 1;
+		if ((ptr = strchr(host, '=')) != NULL) {
+			*ptr++ = '\0';
+			(*relays)[count].weight = atoi(ptr);
+		}
+		(*relays)[count].port = Conf.smtp_port;
+		if ((ptr = strrchr(host, ':')) != NULL) {
+			*ptr++ = '\0';
+			(*relays)[count].port = atoi(ptr);
+		}
+		if ((*relays)[count].weight == 0) {
+			/* A weight of 0 takes the relay out of the rotation */
+			xfree(host);
+			continue;
+		}
+		(*relays)[count++].host = host;
+	}
+	dvDestroy(vec);
+	return count;
+}
+
+static void
+freeRelays(struct smtprelay *relays, u_int count)
+{
+	u_int i;
+
+	for (i=0; i < count; i++) {
+		xfree(relays[i].host);
+	}
+	xfree(relays);
+}
+
+/* The relay sendmail() has been using, so it can stick with it */
+static int cur_relay = -1;
+
+/**
+ * Sends the message through one of the SMTP_RELAYS.  The relay that 
+ * worked last is used again, otherwise one is picked at random by 
+ * weight.  Unless the relay turned the message down for good (a 5xx
+ * reply), the next one is tried when a relay fails.  tried has a bit
+ * for each relay it's been tried on, so there are at most 
+ * SMTP_MAX_RELAYS of them.
+**/
+static int
+processRelays(struct smtprelay *relays, u_int count, struct msgstream *mail)
+{
+	u_int i, tried=0, ntried=0, total;
+	int pick;
+
+	while (true) {
+		if (cur_relay < 0 || (tried & (1u << cur_relay))) {
+			total = 0;
+			for (i=0; i < count; i++) {
+				if (!(tried & (1u << i))) {
+					total += relays[i].weight;
+				}
+			}
+			if (total == 0) {
+				return ERROR;
+			}
+			pick = rand() % total;
+			for (i=0; i < count; i++) {
+				if (tried & (1u << i)) {
+					continue;
+				}
+				pick -= relays[i].weight;
+				if (pick < 0) {
+					break;
+				}
+			}
+			cur_relay = i;
+		}
+
+		tried |= (1u << cur_relay);
+		ntried++;
+		if (processRemote(relays[cur_relay].host, relays[cur_relay].port, mail) != ERROR) {
+			return SUCCESS;
+		}
+		if (!processRemoteTemporary()) {
+			return ERROR;
+		}
+		if (ntried < count) {
+			warning("Relay %s:%d failed. Trying another one...\n", 
+				relays[cur_relay].host, relays[cur_relay].port);
+		}
+	}
+}
+
+/* Whether the last time sendmail() failed is worth trying again */
+static bool send_temp;
+
 /**
  * This function does all the required SMTP connection 
  * and commands. It will send the e-mail we specified 
@@ -75,17 +212,29 @@ saveSentEmail(dstrbuf *msg)
  * it will get it out of the config variable 
 **/
 int
-sendmail(dstrbuf *mail)
+sendmail(struct msgstream *mail)
 {
-	int smtp_port;
+	int smtp_port, retval;
+	u_int nrelays;
 	char *smtp_serv, *sm_bin;
+	struct smtprelay *relays;
 
-	smtp_serv = getConfValue("SMTP_SERVER");
-	sm_bin = getConfValue("SENDMAIL_BIN");
+	smtp_serv = Conf.smtp_server;
+	sm_bin = Conf.sendmail_bin;
+	nrelays = getRelays(&relays);
+	send_temp = false;
 
-	if (smtp_serv) {
-		smtp_port = atoi(getConfValue("SMTP_PORT"));
+	if (nrelays > 0) {
+		retval = processRelays(relays, nrelays, mail);
+		freeRelays(relays, nrelays);
+		if (retval == ERROR) {
+			send_temp = processRemoteTemporary();
+			return ERROR;
+		}
+	} else if (smtp_serv) {
+		smtp_port = Conf.smtp_port;
 		if (processRemote(smtp_serv, smtp_port, mail) == ERROR) {
+			send_temp = processRemoteTemporary();
 			return ERROR;
 		}
 	} else if (sm_bin) {
@@ -103,3 +252,143 @@ sendmail(dstrbuf *mail)
 	return TRUE;
 }
 
+/**
+ * Tells whether the last message sendmail() failed on might go
+ * through if it's tried again later.  Only failures talking to an
+ * SMTP server can be; see processRemoteTemporary().
+**/
+bool
+sendmailTemporary(void)
+{
+	return send_temp;
+}
+
+/**
+ * Adds the recipients the server turned away for now to the job,
+ * when sendmail() got the message to the rest of them.
+**/
+static void
+deferRcpts(struct smtpjob *job)
+{
+	char *next=NULL;
+	dlist deferred = smtpGetDeferred();
+
+	while (deferred && (next = (char *)dlGetNext(deferred)) != NULL) {
+		smtpJobDefer(job, next);
+	}
+}
+
+/**
+ * Closes down anything sendmail() left open so that more messages
+ * could be sent over it.  Call this once all messages are sent.
+**/
+void
+sendmailClose(void)
+{
+	processRemoteQuit();
+}
+
+
+/* What the caller of sendmailBatch() handed us */
+struct batchctx {
+	smtpjobfeed feed;
+	smtpjobdone done;
+	void *arg;
+};
+
+/**
+ * Passes the engine's request for a job on to the caller.
+**/
+static struct smtpjob *
+batchFeed(void *arg)
+{
+	struct batchctx *ctx = arg;
+	return ctx->feed(ctx->arg);
+}
+
+/**
+ * Finishes up a job sent by the engine the same way sendmail()
+ * finishes up a message before handing it back to the caller.
+**/
+static void
+batchDone(struct smtpjob *job, void *arg)
+{
+	struct batchctx *ctx = arg;
+	struct msgstream *msg;
+
+	if (job->status == ERROR) {
+		fatal("Smtp error: %s\n", job->err ? job->err->str : "Unknown error");
+	} else {
+		msg = msgStreamFromBuf(job->msg, true);
+		if (saveSentEmail(msg) == ERROR) {
+			job->status = ERROR;
+		}
+		msgStreamFree(msg);
+	}
+	ctx->done(job, ctx->arg);
+}
+
+/**
+ * Sends every message feed() hands out.  With SMTP_RELAYS, or when 
+ * SMTP_SESSIONS is more than 1, the messages are sent over that many 
+ * SMTP sessions at the same time (one per relay by default).  
+ * Otherwise they're sent one after the other with sendmail().  done() 
+ * gets each job back once it's been sent or has failed.
+**/
+int
+sendmailBatch(smtpjobfeed feed, smtpjobdone done, void *arg)
+{
+	int retval, sessions=0;
+	u_int nrelays;
+	char *smtp_serv;
+	struct smtpjob *job;
+	struct smtprelay *relays, single;
+	struct batchctx ctx;
+	struct msgstream *msg;
+
+	smtp_serv = Conf.smtp_server;
+	nrelays = getRelays(&relays);
+	if (Conf.smtp_sessions) {
+		sessions = Conf.smtp_sessions;
+	} else if (nrelays > 0) {
+		sessions = nrelays;
+	}
+
+	if ((nrelays > 0 || (smtp_serv && sessions > 1)) && smtpEngineUsable()) {
+		ctx.feed = feed;
+		ctx.done = done;
+		ctx.arg = arg;
+		if (sessions < 1) {
+			sessions = 1;
+		}
+		if (nrelays > 0) {
+			retval = smtpEngineRun(relays, nrelays, sessions, batchFeed, batchDone, &ctx);
+			freeRelays(relays, nrelays);
+		} else {
+			single.host = smtp_serv;
+			single.port = Conf.smtp_port;
+			single.weight = 1;
+			retval = smtpEngineRun(&single, 1, sessions, batchFeed, batchDone, &ctx);
+		}
+		return retval;
+	}
+	if (nrelays > 0) {
+		freeRelays(relays, nrelays);
+	}
+
+	while ((job = feed(arg)) != NULL) {
+		msg = msgStreamFromBuf(job->msg, true);
+		job->status = (sendmail(msg) == ERROR) ? ERROR : SUCCESS;
+		msgStreamFree(msg);
+		if (job->status == ERROR) {
+			job->err = DSB_NEW;
+			dsbCopy(job->err, smtpGetErr());
+			job->temporary = sendmailTemporary();
+		} else if (Conf.smtp_server || Conf.smtp_relays) {
+			deferRcpts(job);
+		}
+		done(job, arg);
+	}
+	sendmailClose();
+	return SUCCESS;
+}
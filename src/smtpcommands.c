@@ -9,17 +9,111 @@
 #include <string.h>
 #include <assert.h>
 #include <termios.h>
+#include <errno.h>
+#include <signal.h>
 
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "dnet.h"
 #include "dstrbuf.h"
 #include "email.h"
 #include "mimeutils.h"
+#include "smtpcommands.h"
+#include "utils.h"
+#include "error.h"
 
 static dstrbuf *errorstr;
 
+/* Reply code of the last response read from the server */
+static int last_code;
+
+/* A reply never came or a write failed, so we're out of step with the server */
+static bool lost;
+
+/* The last error might go away if the message is tried again later */
+static bool errtemp;
+
+/* Recipients the server turned away for now (4xx) in this envelope */
+static dlist deferred;
+
+/**
+ * What the server told us it supports in it's EHLO response and 
+ * the connection the information belongs to.  Only one connection
+ * is talked to at a time, so there's no need to keep more around.
+ */
+static struct smtpcaps caps;
+static dsocket *caps_sd;
+
+/**
+ * Commands queued while pipelining.  They are written to the server 
+ * when the DATA command is issued and the responses are then matched 
+ * up with the commands in the order they were sent.  A big envelope
+ * goes out in groups of PIPE_GROUP_CMDS commands or PIPE_GROUP_BYTES,
+ * with only the next group written before the last one's responses
+ * are read.  Otherwise a server that stops reading until we take its
+ * responses would leave both of us stuck writing (RFC 2920 3.5).
+ */
+#define PIPE_MAIL 1
+#define PIPE_RCPT 2
+#define PIPE_RSET 3
+#define PIPE_DATA 4
+
+#define PIPE_GROUP_CMDS   32
+#define PIPE_GROUP_BYTES  4096
+
+struct pipecmd {
+	int type;
+	char *arg;
+	size_t end;		/* Where it ends in pipebuf */
+};
+
+static dstrbuf *pipebuf;
+static struct pipecmd *pipecmds;
+static size_t pipelen, pipesize;
+
+/**
+ * State of a BDAT (RFC 3030 CHUNKING) transfer.  Data is collected
+ * into chunks of bdat_size bytes and each one is sent as it fills up.
+ * When pipelining, the responses aren't waited on until the last chunk 
+ * is out (or BDAT_MAX_PENDING of them are outstanding).
+ */
+static bool use_bdat;
+static dstrbuf *bdat_chunk;
+static size_t bdat_size;
+static int bdat_pending;
+
+/**
+ * Whether the next byte sent during DATA starts a new line.  This
+ * is carried over between calls to smtpSendData() so dot-stuffing
+ * works no matter where the message is split up.
+ */
+static bool data_bol;
+
+/**
+ * Everything written to the server is gathered up here first and then 
+ * sent with one sendmsg() per batch.  Commands we format ourselves are 
+ * kept in outtext and pointed at by offset since outtext may move when 
+ * it grows.  Message data is pointed at where the caller has it, so it 
+ * has to be flushed before control goes back to the caller.
+ * Once TLS is started, the writes go through dnetWrite() instead.
+ */
+#define OUT_MAX_IOV 64
+
+struct outseg {
+	const char *base;	/* NULL if the bytes live in outtext */
+	size_t off;
+	size_t len;
+};
+
+static struct outseg outsegs[OUT_MAX_IOV];
+static int outcnt;
+static char *outtext;
+static size_t outtext_len, outtext_size;
+static dsocket *tls_sd;
+
 
 /** 
  * Figures out the screen width and prints the message to fit the screen.
@@ -61,11 +155,26 @@ void printProgress(const char *msg)
 char *
 smtpGetErr(void)
 {
+	if (!errorstr) {
+		return "Unknown error";
+	}
 	return errorstr->str;
 }
 
 /**
- * Simple interface to copy over buffer into error string
+ * Tells whether the last error is one that might go away if the 
+ * message is tried again later: a 4xx reply, or a problem with the 
+ * connection.  Anything else, like a 5xx reply, won't.
+ */
+bool
+smtpErrTemporary(void)
+{
+	return errtemp;
+}
+
+/**
+ * Simple interface to copy over buffer into error string.  buf is
+ * usually the server's reply, which says if it's worth trying again.
  */
 static void
 smtpSetErr(const char *buf)
@@ -75,113 +184,367 @@ smtpSetErr(const char *buf)
 	}
 	dsbClear(errorstr);
 	dsbCopy(errorstr, buf);
+	errtemp = (atoi(buf) / 100 == 4);
+}
+
+static void
+deferredDestr(void *ptr)
+{
+	xfree(ptr);
+}
+
+/**
+ * Returns the recipients the server turned away for now (a 4xx 
+ * reply) while the message went to the rest, or NULL if there 
+ * weren't any.  Only recipients sent while pipelining are kept 
+ * here; otherwise a rejected recipient fails the whole message.
+ * The list is good until the next message is started.
+ */
+dlist
+smtpGetDeferred(void)
+{
+	return deferred;
+}
+
+/**
+ * Sets the error for a write that failed or a reply we didn't get.
+ * There's no telling what the server made of what it did get, so
+ * the session can't be used after this.
+ */
+static void
+smtpSetNetErr(const char *buf)
+{
+	smtpSetErr(buf);
+	lost = true;
+	errtemp = true;
 }
 
 /**
- * Reads a line from the smtp server using sgets().
- * It will continue to read the response until the 4th character
- * in the line is found to be a space.    Per the RFC 821 this means
- * that this will be the last line of response from the SMTP server
- * and the appropirate return value response.
+ * Waits on the socket until it is ready for reading or writing
+ * or until TIMEOUT seconds have passed.
  */
 static int
-readResponse(dsocket *sd, dstrbuf *buf)
+waitSocket(dsocket *sd, bool for_write)
 {
-	int retval=ERROR;
-	dstrbuf *tmpbuf = DSB_NEW;
+	int sval;
 	struct timeval tv;
-	fd_set rfds;
-	char *timeout = getConfValue("TIMEOUT");
+	fd_set fds;
 
-	FD_ZERO(&rfds);
-	FD_SET(dnetGetSock(sd), &rfds);
-	if (timeout) {
-		tv.tv_sec = atoi(timeout);
-	} else {
-		tv.tv_sec = 10;
-	}
+	FD_ZERO(&fds);
+	FD_SET(dnetGetSock(sd), &fds);
+	tv.tv_sec = Conf.timeout;
 	tv.tv_usec = 0;
-	(void) select(dnetGetSock(sd)+1, &rfds, NULL, NULL, &tv);
-	if (FD_ISSET(dnetGetSock(sd), &rfds)) {
-		do {
-			dsbClear(tmpbuf);
-			dnetReadline(sd, tmpbuf);
-			if (dnetErr(sd)) {
-				smtpSetErr("Lost connection with SMTP server");
-				retval = ERROR;
-				break;
-			}
-			dsbCat(buf, tmpbuf->str);
-			retval = SUCCESS;
-		/* The last line of a response has a space in the 4th column */
-		} while (tmpbuf->str[3] != ' ');
+	if (for_write) {
+		sval = select(dnetGetSock(sd)+1, NULL, &fds, NULL, &tv);
 	} else {
-		smtpSetErr("Timeout(10) while trying to read from SMTP server");
-		retval = ERROR;
+		sval = select(dnetGetSock(sd)+1, &fds, NULL, NULL, &tv);
+	}
+	if (sval == -1) {
+		smtpSetNetErr("select error while waiting on SMTP server");
+		return ERROR;
+	} else if (sval == 0 || !FD_ISSET(dnetGetSock(sd), &fds)) {
+		smtpSetNetErr("Timeout(10) while waiting on SMTP server");
+		return ERROR;
 	}
+	return SUCCESS;
+}
+
+/**
+ * Reads a response from the smtp server without waiting on the 
+ * socket first.  It will continue to read the response until the 
+ * 4th character in the line is found to be a space.  Per the RFC 821 
+ * this means that this will be the last line of response from the 
+ * SMTP server and the appropirate return value response.  Each read
+ * still gives up after TIMEOUT seconds; see smtpInit().
+ */
+static int
+readReply(dsocket *sd, dstrbuf *buf)
+{
+	int retval=ERROR;
+	dstrbuf *tmpbuf = DSB_NEW;
+
+	do {
+		dsbClear(tmpbuf);
+		errno = 0;
+		dnetReadline(sd, tmpbuf);
+		if (dnetErr(sd)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				smtpSetNetErr("Timeout while waiting on SMTP server");
+			} else {
+				smtpSetNetErr("Lost connection with SMTP server");
+			}
+			retval = ERROR;
+			break;
+		}
+		dsbCat(buf, tmpbuf->str);
+		retval = SUCCESS;
+	/* The last line of a response has a space in the 4th column */
+	} while (tmpbuf->str[3] != ' ');
 
 	if (retval != ERROR) {
 		retval = atoi(tmpbuf->str);
 	}
+	last_code = retval;
 
 	dsbDestroy(tmpbuf);
 	return retval;
 }
 
+/**
+ * Waits for the smtp server to respond and reads the response.
+ */
 static int
-writeResponse(dsocket *sd, char *line, ...)
+readResponse(dsocket *sd, dstrbuf *buf)
 {
-	va_list vp;
-	int sval, size=MAXBUF, bytes=0;
-	struct timeval tv;
-	fd_set wfds;
-	char *buf = xmalloc(size+1);
-	char *timeout = getConfValue("TIMEOUT");
+	if (waitSocket(sd, false) == ERROR) {
+		return ERROR;
+	}
+	return readReply(sd, buf);
+}
 
+/**
+ * Writes out everything that's been gathered up so far.  If more is 
+ * set, the kernel is told that more data is on the way so it doesn't 
+ * push out a small packet for it.
+ */
+static int
+outFlush(dsocket *sd, bool more)
+{
+	int i, idx=0, flags=0, retval=SUCCESS;
+	ssize_t n;
+	struct iovec iov[OUT_MAX_IOV];
+	struct msghdr msg;
+
+	if (outcnt == 0) {
+		return SUCCESS;
+	}
+	for (i=0; i < outcnt; i++) {
+		if (outsegs[i].base) {
+			iov[i].iov_base = (char *)outsegs[i].base + outsegs[i].off;
+		} else {
+			iov[i].iov_base = outtext + outsegs[i].off;
+		}
+		iov[i].iov_len = outsegs[i].len;
+	}
+
+	if (waitSocket(sd, true) == ERROR) {
+		retval = ERROR;
+		goto end;
+	}
+
+	/* TLS data has to be encrypted by dnet, so write it all in one go.
+	   A server that hangs up part way would raise SIGPIPE in there, 
+	   so it's ignored until the write comes back with the error. */
+	if (sd == tls_sd) {
+		void (*oldpipe)(int);
+		dstrbuf *buf = DSB_NEW;
+		for (i=0; i < outcnt; i++) {
+			dsbnCat(buf, iov[i].iov_base, iov[i].iov_len);
+		}
+		oldpipe = signal(SIGPIPE, SIG_IGN);
+		dnetWrite(sd, buf->str, buf->len);
+		signal(SIGPIPE, oldpipe);
+		dsbDestroy(buf);
+		if (dnetErr(sd)) {
+			smtpSetNetErr(dnetGetErr(sd));
+			retval = ERROR;
+		}
+		goto end;
+	}
+
+#ifdef MSG_NOSIGNAL
+	/* A server that hangs up is a lost session, not a reason to exit */
+	flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_MORE
+	if (more) {
+		flags |= MSG_MORE;
+	}
+#else
+	more = more;
+#endif
+	while (idx < outcnt) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov + idx;
+		msg.msg_iovlen = outcnt - idx;
+		n = sendmsg(dnetGetSock(sd), &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN && waitSocket(sd, true) != ERROR) {
+				continue;
+			}
+			smtpSetNetErr(strerror(errno));
+			retval = ERROR;
+			goto end;
+		}
+		/* Skip past whatever made it out and try again with the rest */
+		while (idx < outcnt && (size_t)n >= iov[idx].iov_len) {
+			n -= iov[idx].iov_len;
+			idx++;
+		}
+		if (idx < outcnt) {
+			iov[idx].iov_base = (char *)iov[idx].iov_base + n;
+			iov[idx].iov_len -= n;
+		}
+	}
+
+end:
+	outcnt = 0;
+	outtext_len = 0;
+	return retval;
+}
+
+/**
+ * Adds len bytes of buf to the output.  buf is not copied, so it
+ * has to stay around until the next outFlush().
+ */
+static int
+outData(dsocket *sd, const char *buf, size_t len)
+{
+	if (len == 0) {
+		return SUCCESS;
+	}
+	if (outcnt == OUT_MAX_IOV && outFlush(sd, true) == ERROR) {
+		return ERROR;
+	}
+	outsegs[outcnt].base = buf;
+	outsegs[outcnt].off = 0;
+	outsegs[outcnt].len = len;
+	outcnt++;
+	return SUCCESS;
+}
+
+/**
+ * Formats a command and adds it to the output.  Returns the 
+ * length of the command.
+ */
+static int
+outPrintf(dsocket *sd, const char *fmt, va_list vp)
+{
+	int bytes;
+	va_list cp;
+
+	if (outcnt == OUT_MAX_IOV && outFlush(sd, true) == ERROR) {
+		return ERROR;
+	}
+	if (!outtext) {
+		outtext_size = MAXBUF;
+		outtext = xmalloc(outtext_size);
+	}
 	while (true) {
-		va_start(vp, line);
-		bytes = vsnprintf(buf, size, line, vp);
-		va_end(vp);
-		if (bytes > -1 && bytes < size) {
+		va_copy(cp, vp);
+		bytes = vsnprintf(outtext + outtext_len, outtext_size - outtext_len, fmt, cp);
+		va_end(cp);
+		if (bytes > -1 && (size_t)bytes < outtext_size - outtext_len) {
 			/* String written properly */
 			break;
 		}
-		
+
 		if (bytes > -1) {
-			size += 1;
-		} else { 
-			size *= 2;
+			outtext_size = outtext_len + bytes + 1;
+		} else {
+			outtext_size *= 2;
 		}
-		buf = xrealloc(buf, size+1);
+		outtext = xrealloc(outtext, outtext_size);
 	}
 
+	outsegs[outcnt].base = NULL;
+	outsegs[outcnt].off = outtext_len;
+	outsegs[outcnt].len = bytes;
+	outcnt++;
+	outtext_len += bytes;
+	return bytes;
+}
 
-	FD_ZERO(&wfds);
-	FD_SET(dnetGetSock(sd), &wfds);
-	if (timeout) {
-		tv.tv_sec = atoi(timeout);
-	} else {
-		tv.tv_sec = 10;
+/**
+ * Writes len bytes of buf to the smtp server along with 
+ * anything else that's been gathered up.
+ */
+static int
+writeData(dsocket *sd, const char *buf, size_t len)
+{
+	if (outData(sd, buf, len) == ERROR || outFlush(sd, false) == ERROR) {
+		return ERROR;
 	}
-	tv.tv_usec = 0;
-	sval = select(dnetGetSock(sd)+1, NULL, &wfds, NULL, &tv);
-	if (sval == -1) {
-		smtpSetErr("writeResponse: select error");
+	return len;
+}
+
+/**
+ * Gathers up a command to send to the smtp server.  If more is
+ * set, it's held onto until the next flush, otherwise it's sent 
+ * right away.
+ */
+static int
+queueResponse(dsocket *sd, bool more, const char *line, ...)
+{
+	va_list vp;
+	int bytes;
+
+	va_start(vp, line);
+	bytes = outPrintf(sd, line, vp);
+	va_end(vp);
+	if (bytes != ERROR && !more && outFlush(sd, false) == ERROR) {
 		bytes = ERROR;
-	} else if (sval) {
-		dnetWrite(sd, buf, bytes);
-		if (dnetErr(sd)) {
-			smtpSetErr(dnetGetErr(sd));
-			bytes = ERROR;
-		}
-	} else {
-		smtpSetErr("Timeout(10) trying to write to SMTP server.");
+	}
+	return bytes;
+}
+
+static int
+writeResponse(dsocket *sd, char *line, ...)
+{
+	va_list vp;
+	int bytes;
+
+	va_start(vp, line);
+	bytes = outPrintf(sd, line, vp);
+	va_end(vp);
+	if (bytes != ERROR && outFlush(sd, false) == ERROR) {
 		bytes = ERROR;
 	}
-	xfree(buf);
 	return bytes;
 }
 
+/**
+ * Throw away whatever capabilities we knew about.
+ */
+static void
+capsClear(void)
+{
+	smtpCapsClear(&caps);
+	caps_sd = NULL;
+}
+
+/**
+ * Parses a multi-line EHLO response into the capability set.
+ * Each line looks like "250-KEYWORD params\r\n" and the last
+ * one has a space instead of the dash.  The first line is the 
+ * greeting and doesn't name an extension.
+ */
+static void
+capsParse(dsocket *sd, const char *resp)
+{
+	const char *next;
+	dstrbuf *line = DSB_NEW;
+
+	capsClear();
+	caps_sd = sd;
+	resp = strchr(resp, '\n');
+	while (resp && *++resp != '\0') {
+		dsbClear(line);
+		next = strchr(resp, '\n');
+		if (next) {
+			dsbnCat(line, resp, next - resp);
+		} else {
+			dsbCat(line, resp);
+		}
+		resp = next;
+		chomp(line->str);
+		smtpCapsLine(&caps, line->str);
+	}
+	dsbDestroy(line);
+}
+
 static int
 helo(dsocket *sd, const char *domain)
 {
@@ -193,8 +556,9 @@ helo(dsocket *sd, const char *domain)
 	 * been called.  Since ehlo() already grabs the header, go
 	 * straight into sending the HELO
 	 */
+	capsClear();
 	if (writeResponse(sd, "HELO %s\r\n", domain) < 0) {
-		smtpSetErr("Lost connection to SMTP server");
+		smtpSetNetErr("Lost connection to SMTP server");
 		retval = ERROR;
 		goto end;
 	}
@@ -229,6 +593,8 @@ ehlo(dsocket *sd, const char *domain)
 	int retval;
 	dstrbuf *rbuf = DSB_NEW;
 
+	capsClear();
+
 	/* This initiates the connection, so let's read the header first */
 	retval = readResponse(sd, rbuf);
 	if (retval != 220) {
@@ -244,7 +610,7 @@ ehlo(dsocket *sd, const char *domain)
 #endif
 
 	if (writeResponse(sd, "EHLO %s\r\n", domain) < 0) {
-		smtpSetErr("Lost connection to SMTP server");
+		smtpSetNetErr("Lost connection to SMTP server");
 		retval = ERROR;
 		goto end;
 	}
@@ -254,6 +620,7 @@ ehlo(dsocket *sd, const char *domain)
 	fflush(stdout);
 #endif
 
+	dsbClear(rbuf);
 	retval = readResponse(sd, rbuf);
 	if (retval != 250) {
 		if (retval != ERROR) {
@@ -262,6 +629,7 @@ ehlo(dsocket *sd, const char *domain)
 		retval = ERROR;
 		goto end;
 	}
+	capsParse(sd, rbuf->str);
 
 #ifdef DEBUG_SMTP
 	printf("\r\n<-- %s", rbuf->str);
@@ -284,7 +652,7 @@ mailFrom(dsocket *sd, const char *email)
 
 	/* Create the MAIL FROM: command */
 	if (writeResponse(sd, "MAIL FROM:<%s>\r\n", email) < 0) {
-		smtpSetErr("Lost connection with SMTP server");
+		smtpSetNetErr("Lost connection with SMTP server");
 		retval = ERROR;
 		goto end;
 	}
@@ -322,7 +690,7 @@ rcpt(dsocket *sd, const char *email)
 	dstrbuf *rbuf = DSB_NEW;
 
 	if (writeResponse(sd, "RCPT TO: <%s>\r\n", email) < 0) {
-		smtpSetErr("Lost connection with SMTP server");
+		smtpSetNetErr("Lost connection with SMTP server");
 		retval = ERROR;
 		goto end;
 	}
@@ -364,7 +732,7 @@ quit(dsocket *sd)
 
 	/* Create QUIT command and send it */
 	if (writeResponse(sd, "QUIT\r\n") < 0) {
-		smtpSetErr("Lost Connection with SMTP server: Quit()");
+		smtpSetNetErr("Lost Connection with SMTP server: Quit()");
 		retval = ERROR;
 		goto end;
 	}
@@ -399,7 +767,7 @@ data(dsocket *sd)
 
 	/* Create the DATA command and send it */
 	if (writeResponse(sd, "DATA\r\n") < 0) {
-		smtpSetErr("Lost connection with SMTP server");
+		smtpSetNetErr("Lost connection with SMTP server");
 		retval = ERROR;
 		goto end;
 	}
@@ -438,7 +806,7 @@ rset(dsocket *sd)
 
 	/* Send the RSET command */
 	if (writeResponse(sd, "RSET\r\n") < 0) {
-		smtpSetErr("Socket write error: rset");
+		smtpSetNetErr("Socket write error: rset");
 		retval = ERROR;
 		goto end;
 	}
@@ -469,6 +837,268 @@ end:
 }
 
 
+/**
+ * Forget about any commands that have been queued for pipelining.
+ */
+static void
+pipeReset(void)
+{
+	size_t i;
+
+	for (i=0; i < pipelen; i++) {
+		xfree(pipecmds[i].arg);
+	}
+	pipelen = 0;
+	if (pipebuf) {
+		dsbClear(pipebuf);
+	}
+}
+
+/**
+ * Queue up a RSET, MAIL FROM or RCPT TO command to be sent along 
+ * with the rest of the envelope when pipeFlush() is called.
+ */
+static int
+pipeQueue(int type, const char *email)
+{
+	if (!pipebuf) {
+		pipebuf = DSB_NEW;
+	}
+	if (pipelen == pipesize) {
+		pipesize = pipesize ? pipesize * 2 : 16;
+		pipecmds = xrealloc(pipecmds, pipesize * sizeof(struct pipecmd));
+	}
+	if (type == PIPE_RSET) {
+		dsbPrintf(pipebuf, "RSET\r\n");
+	} else if (type == PIPE_MAIL) {
+		dsbPrintf(pipebuf, "MAIL FROM:<%s>\r\n", email);
+	} else if (type == PIPE_DATA) {
+		dsbCat(pipebuf, "DATA\r\n");
+	} else {
+		dsbPrintf(pipebuf, "RCPT TO: <%s>\r\n", email);
+	}
+	pipecmds[pipelen].type = type;
+	pipecmds[pipelen].arg = xstrdup(email);
+	pipecmds[pipelen].end = pipebuf->len;
+	pipelen++;
+	return SUCCESS;
+}
+
+/**
+ * Writes the next group of queued commands, starting with the
+ * one at *sent, and moves *sent past them.
+ */
+static int
+pipeWrite(dsocket *sd, size_t *sent)
+{
+	size_t i = *sent, start = i ? pipecmds[i - 1].end : 0, len;
+
+	do {
+		i++;
+	} while (i < pipelen && i - *sent < PIPE_GROUP_CMDS &&
+	    pipecmds[i].end - start <= PIPE_GROUP_BYTES);
+
+	len = pipecmds[i - 1].end - start;
+	if (writeData(sd, pipebuf->str + start, len) == ERROR) {
+		return ERROR;
+	}
+
+#ifdef DEBUG_SMTP
+	printf("\r\n--> %.*s", (int)len, pipebuf->str + start);
+	fflush(stdout);
+#endif
+
+	*sent = i;
+	return SUCCESS;
+}
+
+/**
+ * Sends the queued envelope, and the DATA command if with_data is set,
+ * and reads back each response in the order the commands were sent.
+ * Every rejected recipient is reported on it's own.  As long as the
+ * server accepted the sender and at least one recipient, the rest of 
+ * the recipients get the message.
+ */
+static int
+pipeFlush(dsocket *sd, bool with_data)
+{
+	size_t i, sent=0, group=0;
+	int retval=SUCCESS, code, accepted=0;
+	dstrbuf *rbuf = DSB_NEW;
+
+	if (with_data) {
+		pipeQueue(PIPE_DATA, "");
+	}
+	if (pipeWrite(sd, &sent) == ERROR) {
+		retval = ERROR;
+		goto end;
+	}
+
+	for (i=0; i < pipelen; i++) {
+		/* Starting on a group's responses, so the next can go out */
+		if (i == group && sent < pipelen) {
+			group = sent;
+			if (pipeWrite(sd, &sent) == ERROR) {
+				retval = ERROR;
+				goto end;
+			}
+		}
+
+		dsbClear(rbuf);
+		/* Only wait on the first response.  The rest are already on their
+		   way, and the receive timeout smtpInit() set covers them if not */
+		if (i == 0) {
+			code = readResponse(sd, rbuf);
+		} else {
+			code = readReply(sd, rbuf);
+		}
+		if (code == ERROR) {
+			retval = ERROR;
+			goto end;
+		}
+
+#ifdef DEBUG_SMTP
+		printf("<-- %s", rbuf->str);
+		fflush(stdout);
+#endif
+
+		if (pipecmds[i].type == PIPE_MAIL || pipecmds[i].type == PIPE_RSET) {
+			if (code != 250) {
+				smtpSetErr(rbuf->str);
+				retval = ERROR;
+			}
+		} else if (pipecmds[i].type == PIPE_DATA) {
+			if (accepted == 0) {
+				/* It wants a message with no one to send it to.  We
+				   won't send one, so the session is out of step. */
+				if (code == 354) {
+					lost = true;
+				}
+				retval = ERROR;
+			} else if (code != 354) {
+				if (retval != ERROR) {
+					smtpSetErr(rbuf->str);
+				}
+				retval = ERROR;
+			}
+		} else if ((code == 250) || (code == 251)) {
+			accepted++;
+		} else {
+			chomp(rbuf->str);
+			warning("Recipient <%s> was rejected: %s\n", 
+				pipecmds[i].arg, rbuf->str);
+			if (code / 100 == 4) {
+				if (!deferred) {
+					deferred = dlInit(deferredDestr);
+				}
+				dlInsertTop(deferred, xstrdup(pipecmds[i].arg));
+			}
+
+			/* The last rejection says why if none get through */
+			smtpSetErr(rbuf->str);
+		}
+	}
+
+	if (!with_data && accepted == 0) {
+		retval = ERROR;
+	}
+	if (accepted == 0 && deferred) {
+		/* Some of them might take it later */
+		errtemp = true;
+	}
+
+end:
+	pipeReset();
+	dsbDestroy(rbuf);
+	return retval;
+}
+
+/**
+ * Reads the response to a BDAT command which we've sent out earlier.
+ */
+static int
+bdatResponse(dsocket *sd)
+{
+	int retval;
+	dstrbuf *rbuf = DSB_NEW;
+
+	retval = readResponse(sd, rbuf);
+	if (retval != 250) {
+		if (retval != ERROR) {
+			smtpSetErr(rbuf->str);
+		}
+		retval = ERROR;
+	}
+
+#ifdef DEBUG_SMTP
+	printf("<-- %s", rbuf->str);
+	fflush(stdout);
+#endif
+
+	bdat_pending--;
+	dsbDestroy(rbuf);
+	return retval;
+}
+
+/**
+ * Sends len bytes of data as a BDAT chunk.  If last is set, this 
+ * is the end of the message and all outstanding responses are read.
+ */
+static int
+bdatSend(dsocket *sd, const char *data, size_t len, bool last)
+{
+	int retval=SUCCESS;
+
+	bool wait;
+
+	/* Without pipelining, each chunk has to be acknowledged on it's own */
+	wait = (!smtpHasCap(sd, SMTP_CAP_PIPELINING) || 
+	    bdat_pending + 1 >= BDAT_MAX_PENDING || last);
+
+	/* The command and it's chunk go out together */
+	if (queueResponse(sd, true, "BDAT %lu%s\r\n", (u_long)len, last ? " LAST" : "") < 0 ||
+	    outData(sd, data, len) == ERROR || outFlush(sd, !wait) == ERROR) {
+		return ERROR;
+	}
+	bdat_pending++;
+
+#ifdef DEBUG_SMTP
+	printf("--> BDAT %lu%s\n", (u_long)len, last ? " LAST" : "");
+	fflush(stdout);
+#endif
+
+	if (wait) {
+		while (bdat_pending > 0) {
+			if (bdatResponse(sd) == ERROR) {
+				retval = ERROR;
+			}
+		}
+	}
+	return retval;
+}
+
+/**
+ * Gets ready for a BDAT transfer.  BDAT_CHUNK_SIZE can be used to
+ * change the size of each chunk, or set to 0 to not use BDAT at all.
+ */
+static bool
+bdatInit(dsocket *sd)
+{
+	use_bdat = false;
+	bdat_pending = 0;
+	bdat_size = Conf.bdat_chunk_size;
+	if (!smtpHasCap(sd, SMTP_CAP_CHUNKING) || bdat_size == 0) {
+		return false;
+	}
+
+	if (!bdat_chunk) {
+		bdat_chunk = dsbNew(bdat_size);
+	}
+	dsbClear(bdat_chunk);
+	use_bdat = true;
+	return true;
+}
+
 /** 
  * SMTP AUTH login.
  */
@@ -481,7 +1111,7 @@ smtpAuthLogin(dsocket *sd, const char *user, const char *pass)
 
 	data = mimeB64EncodeString((u_char *)user, strlen(user), false);
 	if (writeResponse(sd, "AUTH LOGIN %s\r\n", data->str) < 0) {
-		smtpSetErr("Socket write error: smtp_auth_login");
+		smtpSetNetErr("Socket write error: smtp_auth_login");
 		retval = ERROR;
 		goto end;
 	}
@@ -509,7 +1139,7 @@ smtpAuthLogin(dsocket *sd, const char *user, const char *pass)
 	dsbDestroy(data);
 	data = mimeB64EncodeString((u_char *)pass, strlen(pass), false);
 	if (writeResponse(sd, "%s\r\n", data->str) < 0) {
-		smtpSetErr("Socket write error: smtp_auth_login");
+		smtpSetNetErr("Socket write error: smtp_auth_login");
 		retval = ERROR;
 		goto end;
 	}
@@ -549,7 +1179,7 @@ smtpAuthPlain(dsocket *sd, const char *user, const char *pass)
 	dstrbuf *rbuf = DSB_NEW;
 
 	if (writeResponse(sd, "AUTH PLAIN\r\n") < 0) {
-		smtpSetErr("Socket write error: smtp_auth_plain");
+		smtpSetNetErr("Socket write error: smtp_auth_plain");
 		retval = ERROR;
 		goto end;
 	}
@@ -576,7 +1206,7 @@ smtpAuthPlain(dsocket *sd, const char *user, const char *pass)
 	dsbPrintf(up, "%c%s%c%s", '\0', user, '\0', pass);
 	data = mimeB64EncodeString((u_char *)up->str, up->len, false);
 	if (writeResponse(sd, "%s\r\n", data->str) < 0) {
-		smtpSetErr("Socket write error: smtp_auth_plain");
+		smtpSetNetErr("Socket write error: smtp_auth_plain");
 		retval = ERROR;
 		goto end;
 	}
@@ -625,11 +1255,26 @@ int
 smtpInitAuth(dsocket *sd, const char *auth, const char *user, const char *pass)
 {
 	int retval=ERROR;
+
+	/* Don't bother if the server told us it can't do it */
+	if (smtpHasCap(sd, SMTP_CAP_AUTH) && !smtpHasAuth(sd, auth)) {
+		dstrbuf *err = DSB_NEW;
+		dsbPrintf(err, "SMTP server does not support AUTH %s", auth);
+		smtpSetErr(err->str);
+		dsbDestroy(err);
+		return ERROR;
+	}
+
 	if (strcasecmp(auth, "LOGIN") == 0) {
 		retval = smtpAuthLogin(sd, user, pass);
 	} else if (strcasecmp(auth, "PLAIN") == 0) {
 		retval = smtpAuthPlain(sd, user, pass);
-	} 
+	} else {
+		dstrbuf *err = DSB_NEW;
+		dsbPrintf(err, "Unknown SMTP_AUTH type %s", auth);
+		smtpSetErr(err->str);
+		dsbDestroy(err);
+	}
 
 	return retval;
 }
@@ -651,6 +1296,16 @@ int
 smtpInit(dsocket *sd, const char *domain)
 {
 	int retval;
+	struct timeval tv;
+
+	last_code = 0;
+	lost = false;
+
+	/* A reply that stops part way, or one of the replies to a pipelined
+	   envelope, mustn't leave us waiting forever either */
+	tv.tv_sec = Conf.timeout;
+	tv.tv_usec = 0;
+	setsockopt(dnetGetSock(sd), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
 	printProgress("Greeting the SMTP server...");
 	retval = ehlo(sd, domain);
@@ -667,6 +1322,116 @@ smtpInit(dsocket *sd, const char *domain)
 	return retval;
 }
 
+/**
+ * Throws away what's in a capability set, leaving it empty.
+ */
+void
+smtpCapsClear(struct smtpcaps *c)
+{
+	if (c->auth) {
+		dvDestroy(c->auth);
+	}
+	memset(c, 0, sizeof(struct smtpcaps));
+}
+
+/**
+ * Adds the extension named on one line of an EHLO response, which
+ * looks like "250-KEYWORD params" without the line ending, to c.
+ * Lines that don't name an extension we know about are let go.
+ */
+void
+smtpCapsLine(struct smtpcaps *c, const char *line)
+{
+	size_t klen;
+	const char *params;
+
+	if (strlen(line) < 5) {
+		return;
+	}
+
+	/* Split the keyword from it's parameters */
+	line += 4;
+	klen = strcspn(line, " =");
+	params = line + klen;
+	if (*params != '\0') {
+		params++;
+	}
+
+#define KEYWORD(k) (klen == strlen(k) && strncasecmp(line, k, klen) == 0)
+	if (KEYWORD("PIPELINING")) {
+		c->flags |= SMTP_CAP_PIPELINING;
+	} else if (KEYWORD("SIZE")) {
+		c->flags |= SMTP_CAP_SIZE;
+		c->size = strtoul(params, NULL, 10);
+	} else if (KEYWORD("8BITMIME")) {
+		c->flags |= SMTP_CAP_8BITMIME;
+	} else if (KEYWORD("CHUNKING")) {
+		c->flags |= SMTP_CAP_CHUNKING;
+	} else if (KEYWORD("SMTPUTF8")) {
+		c->flags |= SMTP_CAP_SMTPUTF8;
+	} else if (KEYWORD("STARTTLS")) {
+		c->flags |= SMTP_CAP_STARTTLS;
+	} else if (KEYWORD("AUTH")) {
+		/* Some servers say it twice (AUTH and AUTH=), keep the first */
+		c->flags |= SMTP_CAP_AUTH;
+		if (!c->auth) {
+			c->auth = explode(params, " ");
+		}
+	}
+#undef KEYWORD
+}
+
+/**
+ * Returns the extensions the server advertised in it's last
+ * EHLO response.  This is refreshed every time smtpInit() is
+ * called, so it is current after STARTTLS as well.
+ *
+ * Params
+ * 	sd - Socket descriptor
+ *
+ * Return
+ * 	- The capability set or NULL if the server didn't take EHLO
+ */
+struct smtpcaps *
+smtpGetCaps(dsocket *sd)
+{
+	if (sd == NULL || sd != caps_sd) {
+		return NULL;
+	}
+	return &caps;
+}
+
+/**
+ * Tells whether the server advertised the extension cap (SMTP_CAP_*)
+ */
+bool
+smtpHasCap(dsocket *sd, u_int cap)
+{
+	struct smtpcaps *c = smtpGetCaps(sd);
+	return (c != NULL && (c->flags & cap) == cap);
+}
+
+/**
+ * Tells whether the server listed mech as one of it's AUTH mechanisms
+ */
+bool
+smtpHasAuth(dsocket *sd, const char *mech)
+{
+	size_t i, veclen;
+	struct smtpcaps *c = smtpGetCaps(sd);
+
+	if (c == NULL || c->auth == NULL) {
+		return false;
+	}
+	veclen = dvLength(c->auth);
+	for (i=0; i < veclen; i++) {
+		if (strcasecmp((char *)c->auth[i], mech) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
 int
 smtpStartTls(dsocket *sd)
 {
@@ -676,7 +1441,7 @@ smtpStartTls(dsocket *sd)
 
 	printProgress("Starting TLS Communications...");
         if (writeResponse(sd, "STARTTLS\r\n") < 0) {
-                smtpSetErr("Lost connection to SMTP Server");
+                smtpSetNetErr("Lost connection to SMTP Server");
                 retval = ERROR;
                 goto end;
         }
@@ -690,7 +1455,10 @@ smtpStartTls(dsocket *sd)
         if (retval != 220) {
                 smtpSetErr(sb->str);
                 retval = ERROR;
-        }
+        } else {
+		/* Everything from here on has to go through dnet's TLS layer */
+		tls_sd = sd;
+	}
 
 #ifdef DEBUG_SMTP
 	printf("<-- %s\n", sb->str);
@@ -705,6 +1473,45 @@ end:
         return retval;
 }
 
+/**
+ * Resets the SMTP session so that another message can be sent
+ * over it.  When pipelining, the RSET is sent along with the 
+ * next envelope instead of costing a round trip of it's own.
+ *
+ * Params
+ * 	sd - Socket descriptor
+ *
+ * Return
+ * 	- ERROR
+ * 	- SUCCESS
+ */
+int
+smtpReset(dsocket *sd)
+{
+	if (smtpHasCap(sd, SMTP_CAP_PIPELINING)) {
+		pipeReset();
+		return pipeQueue(PIPE_RSET, "");
+	}
+	return rset(sd);
+}
+
+/**
+ * Tells whether the session can't be used anymore, either because
+ * the server closed it on us by dropping the connection or answering
+ * with a 421, or because a write failed or a reply never came.
+ *
+ * Params
+ * 	sd - Socket descriptor
+ *
+ * Return
+ * 	- true if the session can't be used anymore
+ */
+bool
+smtpIsClosed(dsocket *sd)
+{
+	return (dnetErr(sd) || last_code == 421 || lost);
+}
+
 /**
  * Sets who the message is from.  Basically runs the 
  * MAIL FROM: SMTP command
@@ -720,6 +1527,17 @@ end:
 int
 smtpSetMailFrom(dsocket *sd, const char *email)
 {
+	if (deferred) {
+		dlDestroy(deferred);
+		deferred = NULL;
+	}
+	if (smtpHasCap(sd, SMTP_CAP_PIPELINING)) {
+		/* Keep a RSET that was queued by smtpReset() */
+		if (pipelen != 1 || pipecmds[0].type != PIPE_RSET) {
+			pipeReset();
+		}
+		return pipeQueue(PIPE_MAIL, email);
+	}
 	return mailFrom(sd, email);
 }
 
@@ -729,6 +1547,10 @@ smtpSetMailFrom(dsocket *sd, const char *email)
  * are expected if you have multiple To, CC and BCC 
  * recipients.
  *
+ * If the server supports PIPELINING, the command is only
+ * queued here and the server's verdict on the recipient is 
+ * reported when smtpStartData() is called.
+ *
  * Params
  * 	sd - Socket descriptor
  * 	to - An e-mail address to send the message to
@@ -740,11 +1562,17 @@ smtpSetMailFrom(dsocket *sd, const char *email)
 int
 smtpSetRcpt(dsocket *sd, const char *to)
 {
+	if (smtpHasCap(sd, SMTP_CAP_PIPELINING)) {
+		return pipeQueue(PIPE_RCPT, to);
+	}
 	return rcpt(sd, to);
 }
 
 /** 
  * Send the DATA command to the smtp server (no data, just the command)
+ * When pipelining, the queued envelope goes out along with it.
+ * If the server supports CHUNKING, no DATA command is sent and the
+ * message will be sent with BDAT instead.
  *
  * Params
  * 	sd - Socket descriptor
@@ -756,13 +1584,65 @@ smtpSetRcpt(dsocket *sd, const char *to)
 int
 smtpStartData(dsocket *sd)
 {
+	bool chunking = bdatInit(sd);
+
+	data_bol = true;
+	if (pipelen > 0) {
+		return pipeFlush(sd, !chunking);
+	} else if (chunking) {
+		return SUCCESS;
+	}
 	return data(sd);
 }
 
+/**
+ * Writes data during DATA and doubles the dot of every line that
+ * starts with one (RFC 5321 4.5.2) so the server doesn't take it as 
+ * the end of the message.  Line starts are found with memchr() and 
+ * the data is only split up where a dot has to go in, so nothing 
+ * is copied.  The pieces are gathered up and sent in one batch.
+ */
+static int
+sendStuffed(dsocket *sd, const char *data, size_t len)
+{
+	const char *start=data, *ptr=data;
+	const char *end = data + len;
+
+	if (len == 0) {
+		return SUCCESS;
+	}
+	if (data_bol && *data == '.') {
+		if (outData(sd, ".", 1) == ERROR) {
+			return ERROR;
+		}
+	}
+	while ((ptr = memchr(ptr, '\n', end - ptr)) != NULL) {
+		if (++ptr == end) {
+			break;
+		}
+		if (*ptr == '.') {
+			/* Send the line along with it's extra dot */
+			if (outData(sd, start, ptr - start) == ERROR || 
+			    outData(sd, ".", 1) == ERROR) {
+				return ERROR;
+			}
+			start = ptr;
+		}
+	}
+	data_bol = (end[-1] == '\n');
+	if (outData(sd, start, end - start) == ERROR) {
+		return ERROR;
+	}
+	/* The end of data marker is still to come */
+	return outFlush(sd, true);
+}
+
 /**
  * Sends data to the smtp server. You can try and send the
  * whole chunk at once, or it may be a better idea to break
- * up the data into smaller chunks.
+ * up the data into smaller chunks.  For BDAT transfers the
+ * data is sent once a full chunk has been collected.  Otherwise
+ * lines that start with a dot are dot-stuffed on the way out.
  *
  * Params
  * 	sd - Socket descriptor
@@ -781,17 +1661,43 @@ smtpSendData(dsocket *sd, const char *data, size_t len)
 	assert(data != NULL);
 	assert(sd != NULL);
 
-	/* Write the data to the socket. */
-	dnetWrite(sd, data, len);
-	if (dnetErr(sd)) {
-		smtpSetErr("Error writing to socket.");
-		retval = ERROR;
+	/* Fill up the current chunk and send it off once it's full */
+	if (use_bdat) {
+		while (len > 0) {
+			size_t n = bdat_size - bdat_chunk->len;
+			/* Whole chunks can go straight out of the caller's data */
+			if (bdat_chunk->len == 0 && len >= bdat_size) {
+				if (bdatSend(sd, data, bdat_size, false) == ERROR) {
+					return ERROR;
+				}
+				data += bdat_size;
+				len -= bdat_size;
+				continue;
+			}
+			if (n > len) {
+				n = len;
+			}
+			dsbnCat(bdat_chunk, data, n);
+			data += n;
+			len -= n;
+			if (bdat_chunk->len == bdat_size) {
+				retval = bdatSend(sd, bdat_chunk->str, bdat_chunk->len, false);
+				dsbClear(bdat_chunk);
+				if (retval == ERROR) {
+					break;
+				}
+			}
+		}
+		return retval;
 	}
-	return retval;
+
+	/* Write the data to the socket. */
+	return sendStuffed(sd, data, len);
 }
 
 /**
  * Let's the SMTP server know it's the end of the data stream.
+ * For BDAT transfers, this sends the last chunk.
  *
  * Params
  * 	sd - Socket descriptor
@@ -807,7 +1713,11 @@ smtpEndData(dsocket *sd)
 	dstrbuf *rbuf = DSB_NEW;
 
 	printProgress("Ending Data...");
-	if (writeResponse(sd, "\r\n.\r\n") != ERROR) {
+	if (use_bdat) {
+		use_bdat = false;
+		retval = bdatSend(sd, bdat_chunk->str, bdat_chunk->len, true);
+		dsbClear(bdat_chunk);
+	} else if (writeResponse(sd, data_bol ? ".\r\n" : "\r\n.\r\n") != ERROR) {
 		retval = readResponse(sd, rbuf);
 		if (retval != 250) {
 			if (retval != ERROR) {
@@ -816,7 +1726,7 @@ smtpEndData(dsocket *sd)
 			}
 		}
 	} else {
-		smtpSetErr("Lost Connection with SMTP server: smtpEndData()");
+		smtpSetNetErr("Lost Connection with SMTP server: smtpEndData()");
 		retval = ERROR;
 	}
 
@@ -841,6 +1751,19 @@ smtpQuit(dsocket *sd)
 	printProgress("Sending QUIT...");
 	retval = quit(sd);
 	dsbDestroy(errorstr);
+	errorstr = NULL;
+	pipeReset();
+	dsbDestroy(pipebuf);
+	pipebuf = NULL;
+	dsbDestroy(bdat_chunk);
+	bdat_chunk = NULL;
+	use_bdat = false;
+	capsClear();
+	xfree(outtext);
+	outtext = NULL;
+	outtext_size = outtext_len = 0;
+	outcnt = 0;
+	tls_sd = NULL;
 	return retval;
 }
 
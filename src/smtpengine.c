@@ -0,0 +1,1386 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#include "email.h"
+#include "utils.h"
+#include "mimeutils.h"
+#include "smtpcommands.h"
+#include "smtpengine.h"
+#include "error.h"
+
+/**
+ * The engine talks to many SMTP servers at once from a single thread.
+ * Every session is a non-blocking socket with a state that says which
+ * reply it's waiting on.  epoll tells us which sessions can move along
+ * and each one takes a new job as soon as it's done with the last.
+ * When the server offers PIPELINING the whole envelope goes out at
+ * once, and with CHUNKING the message goes out with BDAT, the same
+ * as a message sent the normal way.  The message is written straight
+ * out of the job a piece at a time as the socket takes it.
+ */
+
+/**
+ * Creates a job for msg.  The job owns msg from here on.
+ */
+struct smtpjob *
+smtpJobNew(dstrbuf *msg)
+{
+	struct smtpjob *job = xmalloc(sizeof(struct smtpjob));
+
+	memset(job, 0, sizeof(struct smtpjob));
+	job->msg = msg;
+	job->status = ERROR;
+	return job;
+}
+
+/**
+ * Adds a recipient to the job.
+ */
+void
+smtpJobAddRcpt(struct smtpjob *job, const char *email)
+{
+	if (job->nrcpts == job->rcpts_size) {
+		job->rcpts_size = job->rcpts_size ? job->rcpts_size * 2 : 16;
+		job->rcpts = xrealloc(job->rcpts, sizeof(char *) * job->rcpts_size);
+	}
+	job->rcpts[job->nrcpts++] = xstrdup(email);
+}
+
+/**
+ * Notes a recipient the server turned away for now (a 4xx reply) 
+ * while the message went to the rest.  It can be tried again later.
+ */
+void
+smtpJobDefer(struct smtpjob *job, const char *email)
+{
+	job->deferred = xrealloc(job->deferred, sizeof(char *) * (job->ndeferred + 1));
+	job->deferred[job->ndeferred++] = xstrdup(email);
+}
+
+/**
+ * Forgets the recipients deferred on an earlier try.
+ */
+static void
+jobClearDeferred(struct smtpjob *job)
+{
+	while (job->ndeferred > 0) {
+		xfree(job->deferred[--job->ndeferred]);
+	}
+	xfree(job->deferred);
+	job->deferred = NULL;
+}
+
+/**
+ * Frees the job along with it's message.
+ */
+void
+smtpJobDestroy(struct smtpjob *job)
+{
+	size_t i;
+
+	if (!job) {
+		return;
+	}
+	for (i=0; i < job->nrcpts; i++) {
+		xfree(job->rcpts[i]);
+	}
+	xfree(job->rcpts);
+	jobClearDeferred(job);
+	dsbDestroy(job->msg);
+	dsbDestroy(job->err);
+	xfree(job);
+}
+
+/**
+ * Tells whether the engine can be used with the current configuration.
+ * TLS is done by dnet, which only knows blocking sockets, so those
+ * sessions have to go the old way.
+ */
+bool
+smtpEngineUsable(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	return !Conf.use_tls;
+#else
+	return false;
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define SESS_CONNECT	1
+#define SESS_GREETING	2
+#define SESS_EHLO	3
+#define SESS_HELO	4
+#define SESS_AUTH	5
+#define SESS_AUTH_USER	6
+#define SESS_AUTH_PASS	7
+#define SESS_MAIL	8
+#define SESS_RCPT	9
+#define SESS_DATA	10
+#define SESS_DOT	11
+#define SESS_RSET	12
+#define SESS_QUIT	13
+#define SESS_BDAT	14
+
+#define ENGINE_MAX_EVENTS  64
+#define ENGINE_READ_SIZE   4096
+
+/* How long a relay we couldn't reach is left alone */
+#define RELAY_DOWN_SECS    60
+
+struct relay {
+	struct smtprelay *conf;
+	struct addrinfo *addrs;
+	int current;		/* Where it stands in the weighted round-robin */
+	time_t down_until;
+};
+
+struct session {
+	int fd;
+	int state;
+	u_int serial;		/* Changes every time the socket does */
+	u_int idx;
+	u_int relay;
+	struct addrinfo *ai;	/* The relay's address being connected to */
+	time_t deadline;
+	bool want_out;
+	char *inbuf;
+	size_t inlen, insize;
+	dstrbuf *out;
+	size_t outoff;
+	const char *direct;	/* Part of the message to write after out */
+	size_t direct_len;
+	struct smtpcaps caps;	/* What the server offered */
+	struct smtpjob *job;
+	size_t rcpt;
+	size_t accepted;
+	bool piped;		/* The envelope went out all at once */
+	bool mail_ok;		/* The server took the MAIL FROM */
+	dstrbuf *err;		/* Why it didn't */
+	size_t data_off;	/* How much of the message is on it's way */
+	bool data_done;		/* All of it is */
+	u_int bdat_pending;	/* BDAT chunks waiting on a reply */
+	bool bdat_failed;
+	int msgs;
+};
+
+struct engine {
+	struct relay *relays;
+	u_int nrelays;
+	struct smtpjob **retry;	/* Jobs waiting on another relay */
+	size_t nretry;
+	int epfd;
+	int timeout;
+	int max_msgs;
+	char *from;
+	char *auth;
+	char *user;
+	char *pass;
+	size_t bdat_size;	/* 0 to not use BDAT */
+	char nodename[MAXBUF];
+	bool fed_all;
+	smtpjobfeed feed;
+	smtpjobdone done;
+	void *arg;
+};
+
+/**
+ * Gets the next job for a session.  Jobs waiting on another relay go
+ * first.  Unless any is set, only the jobs that haven't been tried on 
+ * the session's relay yet are handed out.
+ */
+static struct smtpjob *
+engineFeed(struct engine *e, struct session *s, bool any)
+{
+	size_t i;
+	struct smtpjob *job;
+
+	for (i=0; i < e->nretry; i++) {
+		job = e->retry[i];
+		if (any || !(job->tried & (1u << s->relay))) {
+			e->retry[i] = e->retry[--e->nretry];
+			return job;
+		}
+	}
+	if (e->fed_all) {
+		return NULL;
+	}
+	job = e->feed(e->arg);
+	if (!job) {
+		e->fed_all = true;
+	}
+	return job;
+}
+
+/**
+ * Hands a job back to the caller with the outcome.  If err is NULL
+ * the job keeps the error it already has.
+ */
+static void
+jobDone(struct engine *e, struct smtpjob *job, int status, const char *err)
+{
+	job->status = status;
+	if (status == ERROR) {
+		if (!job->err) {
+			job->err = DSB_NEW;
+		}
+		if (err) {
+			dsbCopy(job->err, err);
+			chomp(job->err->str);
+		}
+	}
+	e->done(job, e->arg);
+}
+
+/**
+ * Hands the session's job back to the caller with the outcome.
+ */
+static void
+jobFinish(struct engine *e, struct session *s, int status, const char *err)
+{
+	struct smtpjob *job = s->job;
+
+	if (job) {
+		s->job = NULL;
+		jobDone(e, job, status, err);
+	}
+}
+
+/**
+ * Picks the relay to send the job through next.  Relays get picked 
+ * in proportion to their weight (a smooth weighted round-robin), and
+ * the ones the job has already been tried on are left out.  Relays
+ * that are down are only picked if there is nothing else left.
+ * Returns -1 if there's no relay left to try.
+ */
+static int
+pickRelay(struct engine *e, struct smtpjob *job)
+{
+	u_int i;
+	int best=-1, total=0;
+	bool skip_down=false;
+	time_t now = time(NULL);
+	struct relay *r;
+
+	for (i=0; i < e->nrelays; i++) {
+		r = &e->relays[i];
+		if (r->addrs && !(job->tried & (1u << i)) && r->down_until <= now) {
+			skip_down = true;
+			break;
+		}
+	}
+	for (i=0; i < e->nrelays; i++) {
+		r = &e->relays[i];
+		if (!r->addrs || (job->tried & (1u << i)) || 
+		    (skip_down && r->down_until > now)) {
+			continue;
+		}
+		r->current += r->conf->weight;
+		total += r->conf->weight;
+		if (best < 0 || r->current > e->relays[best].current) {
+			best = i;
+		}
+	}
+	if (best >= 0) {
+		e->relays[best].current -= total;
+	}
+	return best;
+}
+
+/**
+ * Fails the session's job.  If it's something another relay might 
+ * not have a problem with (a 4xx reply, a timeout or a connection 
+ * that went bad) and there's a relay it hasn't been tried on, the 
+ * job is put aside for that relay instead.  err is either the reply
+ * that turned it down or says what happened to the connection.
+ */
+static void
+jobFail(struct engine *e, struct session *s, const char *err)
+{
+	u_int i;
+	int code = atoi(err);
+	struct smtpjob *job = s->job;
+
+	if (!job) {
+		return;
+	}
+	job->temporary = (code == 0 || code / 100 == 4);
+	if (!job->temporary) {
+		jobFinish(e, s, ERROR, err);
+		return;
+	}
+	for (i=0; i < e->nrelays; i++) {
+		if (e->relays[i].addrs && !(job->tried & (1u << i))) {
+			break;
+		}
+	}
+	if (i == e->nrelays) {
+		jobFinish(e, s, ERROR, err);
+		return;
+	}
+
+	if (Mopts.verbose) {
+		printf("Relay %s:%d failed (%s), trying another one\n", 
+			e->relays[s->relay].conf->host, e->relays[s->relay].conf->port, err);
+	}
+	if (!job->err) {
+		job->err = DSB_NEW;
+	}
+	dsbCopy(job->err, err);
+	chomp(job->err->str);
+	e->retry = xrealloc(e->retry, sizeof(struct smtpjob *) * (e->nretry + 1));
+	e->retry[e->nretry++] = job;
+	s->job = NULL;
+}
+
+/**
+ * Sets what we want to hear about from epoll for this session.
+ */
+static int
+sessionWatch(struct engine *e, struct session *s, int op, bool want_out)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (want_out) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.u64 = ((uint64_t)s->serial << 32) | s->idx;
+	s->want_out = want_out;
+	return epoll_ctl(e->epfd, op, s->fd, &ev);
+}
+
+/**
+ * Drops the session's connection.  Any job it had is left alone.
+ */
+static void
+sessionClose(struct engine *e, struct session *s)
+{
+	if (s->fd != -1) {
+		epoll_ctl(e->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+		close(s->fd);
+		s->fd = -1;
+	}
+	s->serial++;
+	s->state = 0;
+	s->msgs = 0;
+	s->inlen = 0;
+	s->outoff = 0;
+	s->direct_len = 0;
+	smtpCapsClear(&s->caps);
+	s->bdat_pending = 0;
+	dsbClear(s->out);
+}
+
+/**
+ * Starts connecting to the session's relay, trying it's addresses
+ * from ai on until one of them gets going.  This only gets the 
+ * connect going, epoll tells us when it's through.  On failure errno
+ * says what went wrong with the last address.
+ */
+static int
+sessionConnect(struct engine *e, struct session *s, struct addrinfo *ai)
+{
+	int fd, err=0;
+
+	for (; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+		    (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && 
+		    errno != EINPROGRESS)) {
+			err = errno;
+			close(fd);
+			continue;
+		}
+
+		s->fd = fd;
+		s->ai = ai;
+		s->serial++;
+		s->state = SESS_CONNECT;
+		s->deadline = time(NULL) + e->timeout;
+		if (sessionWatch(e, s, EPOLL_CTL_ADD, true) < 0) {
+			err = errno;
+			close(fd);
+			s->fd = -1;
+			continue;
+		}
+		return SUCCESS;
+	}
+	errno = err;
+	return ERROR;
+}
+
+/**
+ * Gives an idle session it's next job, picks a relay for it and 
+ * starts connecting.  A job that can't even get a connection started 
+ * is failed (or put aside for another relay) and the next one is tried.
+ */
+static void
+sessionOpen(struct engine *e, struct session *s)
+{
+	int relay;
+
+	while ((s->job = engineFeed(e, s, true)) != NULL) {
+		relay = pickRelay(e, s->job);
+		if (relay < 0) {
+			if (!s->job->err) {
+				s->job->temporary = true;
+			}
+			jobFinish(e, s, ERROR, s->job->err ? NULL : "No relay left to try");
+			continue;
+		}
+		s->relay = relay;
+		s->job->tried |= (1u << relay);
+		if (sessionConnect(e, s, e->relays[relay].addrs) != ERROR) {
+			break;
+		}
+		e->relays[relay].down_until = time(NULL) + RELAY_DOWN_SECS;
+		jobFail(e, s, strerror(errno));
+	}
+}
+
+/**
+ * Fails the current job, drops the connection and starts over with
+ * the next job on a fresh connection.  If we never got as far as a
+ * greeting, the relay is left alone for a while.
+ */
+static void
+sessionFail(struct engine *e, struct session *s, const char *err)
+{
+	if (s->state == SESS_CONNECT || s->state == SESS_GREETING) {
+		e->relays[s->relay].down_until = time(NULL) + RELAY_DOWN_SECS;
+	}
+	jobFail(e, s, err);
+	sessionClose(e, s);
+	sessionOpen(e, s);
+}
+
+/**
+ * A connect that didn't go through moves on to the relay's next
+ * address.  Only once there are none left does the session fail.
+ */
+static void
+sessionConnectFail(struct engine *e, struct session *s, const char *err)
+{
+	struct addrinfo *next = s->ai->ai_next;
+
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	s->fd = -1;
+	if (!next || sessionConnect(e, s, next) == ERROR) {
+		sessionFail(e, s, err);
+	}
+}
+
+/**
+ * Queues the next piece of the message during DATA: the message up
+ * to the next line that starts with a dot, with the extra dot that
+ * line needs (RFC 5321 4.5.2), or the end of data marker.
+ */
+static void
+sessionFillData(struct session *s)
+{
+	const char *msg = s->job->msg->str;
+	size_t len = s->job->msg->len;
+	const char *ptr = msg + s->data_off, *end = msg + len, *next = end, *nl;
+
+	if (s->data_off == len) {
+		dsbCat(s->out, (len == 0 || end[-1] == '\n') ? ".\r\n" : "\r\n.\r\n");
+		s->data_done = true;
+		return;
+	}
+	if (*ptr == '.' && (s->data_off == 0 || ptr[-1] == '\n')) {
+		dsbCatChar(s->out, '.');
+	}
+	for (nl = ptr; (nl = memchr(nl, '\n', end - nl)) != NULL && ++nl < end; ) {
+		if (*nl == '.') {
+			next = nl;
+			break;
+		}
+	}
+	s->direct = ptr;
+	s->direct_len = next - ptr;
+	s->data_off = next - msg;
+}
+
+/**
+ * Queues the next BDAT chunk of the message.
+ */
+static void
+sessionFillBdat(struct engine *e, struct session *s)
+{
+	size_t len = s->job->msg->len - s->data_off;
+
+	if (len > e->bdat_size) {
+		len = e->bdat_size;
+	}
+	s->data_done = (s->data_off + len == s->job->msg->len);
+	dsbPrintf(s->out, "BDAT %lu%s\r\n", (u_long)len, s->data_done ? " LAST" : "");
+	s->direct = s->job->msg->str + s->data_off;
+	s->direct_len = len;
+	s->data_off += len;
+	s->bdat_pending++;
+}
+
+/**
+ * Queues more of the message once what's queued has been written.
+ * Without pipelining, each BDAT chunk waits on the reply to the last.
+ *
+ * Return
+ * 	- true if there's more to write
+ */
+static bool
+sessionFill(struct engine *e, struct session *s)
+{
+	u_int max_pending = (s->caps.flags & SMTP_CAP_PIPELINING) ? BDAT_MAX_PENDING : 1;
+
+	if (s->state == SESS_DOT && !s->data_done) {
+		sessionFillData(s);
+		return true;
+	}
+	if (s->state == SESS_BDAT && !s->data_done && !s->bdat_failed &&
+	    s->bdat_pending < max_pending) {
+		sessionFillBdat(e, s);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Writes out as much of the session's output as the socket will take,
+ * and then as much of the message as there is to send.  If it won't 
+ * take all of it, epoll lets us know when to try again.
+ */
+static int
+sessionWrite(struct engine *e, struct session *s)
+{
+	int cnt;
+	ssize_t n;
+	size_t outlen;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	while (true) {
+		if (s->outoff == s->out->len && s->direct_len == 0 && !sessionFill(e, s)) {
+			break;
+		}
+		cnt = 0;
+		outlen = s->out->len - s->outoff;
+		if (outlen > 0) {
+			iov[cnt].iov_base = s->out->str + s->outoff;
+			iov[cnt++].iov_len = outlen;
+		}
+		if (s->direct_len > 0) {
+			iov[cnt].iov_base = (char *)s->direct;
+			iov[cnt++].iov_len = s->direct_len;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
+		n = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!s->want_out) {
+					sessionWatch(e, s, EPOLL_CTL_MOD, true);
+				}
+				return SUCCESS;
+			}
+			return ERROR;
+		}
+		if ((size_t)n < outlen) {
+			s->outoff += n;
+		} else {
+			dsbClear(s->out);
+			s->outoff = 0;
+			s->direct += n - outlen;
+			s->direct_len -= n - outlen;
+		}
+		s->deadline = time(NULL) + e->timeout;
+	}
+
+	if (s->want_out) {
+		sessionWatch(e, s, EPOLL_CTL_MOD, false);
+	}
+	return SUCCESS;
+}
+
+/**
+ * Sends a command and moves the session to the state that waits
+ * on it's reply.
+ */
+static void
+sessionSend(struct engine *e, struct session *s, int state, const char *cmd)
+{
+	dsbCat(s->out, cmd);
+	s->state = state;
+	if (sessionWrite(e, s) == ERROR) {
+		sessionFail(e, s, "Error writing to socket.");
+	}
+}
+
+/**
+ * Whether the message goes out with BDAT (RFC 3030) instead of DATA.
+ * BDAT_CHUNK_SIZE set to 0 turns it off, the same as it does
+ * for a message sent the normal way.
+ */
+static bool
+sessionChunking(struct engine *e, struct session *s)
+{
+	return (s->caps.flags & SMTP_CAP_CHUNKING) && e->bdat_size > 0;
+}
+
+/**
+ * Starts sending the message, with BDAT or after DATA was accepted.
+ */
+static void
+sessionData(struct engine *e, struct session *s, int state)
+{
+	s->data_off = 0;
+	s->data_done = false;
+	s->bdat_pending = 0;
+	s->bdat_failed = false;
+	sessionSend(e, s, state, "");
+}
+
+/**
+ * Starts the next transaction on a session that's ready for one, or
+ * says goodbye if there's nothing left for it to do.
+ */
+static void
+sessionNext(struct engine *e, struct session *s)
+{
+	size_t i;
+	dstrbuf *cmd;
+
+	while (true) {
+		/* A fresh session already has the job it was opened for */
+		if (!s->job) {
+			if (e->max_msgs > 0 && s->msgs >= e->max_msgs) {
+				sessionSend(e, s, SESS_QUIT, "QUIT\r\n");
+				return;
+			}
+			s->job = engineFeed(e, s, false);
+			if (s->job) {
+				s->job->tried |= (1u << s->relay);
+			}
+		}
+		if (!s->job) {
+			sessionSend(e, s, SESS_QUIT, "QUIT\r\n");
+			return;
+		}
+		if (s->caps.size == 0 || s->job->msg->len <= s->caps.size) {
+			break;
+		}
+
+		/* Don't send what the server already told us it won't take */
+		cmd = DSB_NEW;
+		dsbPrintf(cmd, "Message is %lu bytes, but the SMTP server only "
+			"accepts %lu bytes", (u_long)s->job->msg->len, 
+			(u_long)s->caps.size);
+		s->job->temporary = false;
+		jobFinish(e, s, ERROR, cmd->str);
+		dsbDestroy(cmd);
+	}
+
+	s->rcpt = 0;
+	s->accepted = 0;
+	s->mail_ok = false;
+	jobClearDeferred(s->job);
+	s->piped = (s->caps.flags & SMTP_CAP_PIPELINING) != 0;
+	cmd = DSB_NEW;
+	dsbPrintf(cmd, "MAIL FROM:<%s>\r\n", e->from);
+	if (s->piped) {
+		/* The rest of the envelope goes along with it (RFC 2920) */
+		for (i=0; i < s->job->nrcpts; i++) {
+			dsbPrintf(cmd, "RCPT TO: <%s>\r\n", s->job->rcpts[i]);
+		}
+		if (!sessionChunking(e, s)) {
+			dsbCat(cmd, "DATA\r\n");
+		}
+	}
+	sessionSend(e, s, SESS_MAIL, cmd->str);
+	dsbDestroy(cmd);
+}
+
+/**
+ * Gives up on the current job but keeps the session.
+ */
+static void
+sessionAbort(struct engine *e, struct session *s, const char *err)
+{
+	jobFail(e, s, err);
+	sessionSend(e, s, SESS_RSET, "RSET\r\n");
+}
+
+/**
+ * Gives up on a job when the server took neither the sender nor
+ * any of the recipients.  If any were only turned away for now, 
+ * it can be tried again later.
+ */
+static void
+sessionRefused(struct engine *e, struct session *s)
+{
+	if (!s->mail_ok) {
+		sessionAbort(e, s, s->err->str);
+		return;
+	}
+	s->job->temporary = (s->job->ndeferred > 0);
+	jobFinish(e, s, ERROR, s->job->err ? NULL :
+		"No recipients were accepted by the SMTP server");
+	sessionSend(e, s, SESS_RSET, "RSET\r\n");
+}
+
+/**
+ * Sends the next RCPT command, or DATA once they're all done.  When 
+ * pipelining they've already been sent, so this just waits on the 
+ * next reply.
+ */
+static void
+sessionRcpt(struct engine *e, struct session *s)
+{
+	dstrbuf *cmd;
+
+	if (s->rcpt < s->job->nrcpts) {
+		if (s->piped) {
+			s->state = SESS_RCPT;
+			return;
+		}
+		cmd = DSB_NEW;
+		dsbPrintf(cmd, "RCPT TO: <%s>\r\n", s->job->rcpts[s->rcpt]);
+		sessionSend(e, s, SESS_RCPT, cmd->str);
+		dsbDestroy(cmd);
+	} else if (s->piped && !sessionChunking(e, s)) {
+		s->state = SESS_DATA;
+	} else if (!s->mail_ok || s->accepted == 0) {
+		sessionRefused(e, s);
+	} else if (sessionChunking(e, s)) {
+		sessionData(e, s, SESS_BDAT);
+	} else {
+		sessionSend(e, s, SESS_DATA, "DATA\r\n");
+	}
+}
+
+/**
+ * Sends an AUTH step with it's data base64 encoded.
+ */
+static void
+sessionAuthSend(struct engine *e, struct session *s, int state,
+		const char *data, size_t len)
+{
+	dstrbuf *enc = mimeB64EncodeString((u_char *)data, len, false);
+
+	dsbCat(enc, "\r\n");
+	sessionSend(e, s, state, enc->str);
+	dsbDestroy(enc);
+}
+
+/**
+ * Logs in if SMTP_AUTH is set, otherwise gets the first job going.
+ */
+static void
+sessionLogin(struct engine *e, struct session *s)
+{
+	if (!e->auth) {
+		sessionNext(e, s);
+	} else if (strcasecmp(e->auth, "LOGIN") == 0) {
+		sessionSend(e, s, SESS_AUTH, "AUTH LOGIN\r\n");
+	} else {
+		sessionSend(e, s, SESS_AUTH, "AUTH PLAIN\r\n");
+	}
+}
+
+/**
+ * Moves the session along based on the reply to what it sent last.
+ * text is the last line of the reply.
+ */
+static void
+sessionReply(struct engine *e, struct session *s, int code, const char *text)
+{
+	size_t ulen, plen;
+	char *plain;
+
+	/* The server is shutting down the session on us */
+	if (code == 421 && s->state != SESS_QUIT) {
+		sessionFail(e, s, text);
+		return;
+	}
+
+	switch (s->state) {
+	case SESS_GREETING:
+		if (code != 220) {
+			sessionFail(e, s, text);
+		} else {
+			dstrbuf *cmd = DSB_NEW;
+			dsbPrintf(cmd, "EHLO %s\r\n", e->nodename);
+			smtpCapsClear(&s->caps);
+			sessionSend(e, s, SESS_EHLO, cmd->str);
+			dsbDestroy(cmd);
+		}
+		break;
+
+	case SESS_EHLO:
+		if (code != 250) {
+			smtpCapsClear(&s->caps);
+			dstrbuf *cmd = DSB_NEW;
+			dsbPrintf(cmd, "HELO %s\r\n", e->nodename);
+			sessionSend(e, s, SESS_HELO, cmd->str);
+			dsbDestroy(cmd);
+		} else {
+			sessionLogin(e, s);
+		}
+		break;
+
+	case SESS_HELO:
+		if (code != 250) {
+			sessionFail(e, s, text);
+		} else {
+			sessionLogin(e, s);
+		}
+		break;
+
+	case SESS_AUTH:
+		if (code != 334) {
+			sessionFail(e, s, text);
+		} else if (strcasecmp(e->auth, "LOGIN") == 0) {
+			sessionAuthSend(e, s, SESS_AUTH_USER, e->user, strlen(e->user));
+		} else {
+			ulen = strlen(e->user);
+			plen = strlen(e->pass);
+			plain = xmalloc(ulen + plen + 2);
+			plain[0] = '\0';
+			memcpy(plain + 1, e->user, ulen);
+			plain[ulen + 1] = '\0';
+			memcpy(plain + ulen + 2, e->pass, plen);
+			sessionAuthSend(e, s, SESS_AUTH_PASS, plain, ulen + plen + 2);
+			xfree(plain);
+		}
+		break;
+
+	case SESS_AUTH_USER:
+		if (code != 334) {
+			sessionFail(e, s, text);
+		} else {
+			sessionAuthSend(e, s, SESS_AUTH_PASS, e->pass, strlen(e->pass));
+		}
+		break;
+
+	case SESS_AUTH_PASS:
+		if (code != 235) {
+			sessionFail(e, s, text);
+		} else {
+			sessionNext(e, s);
+		}
+		break;
+
+	case SESS_MAIL:
+		s->mail_ok = (code == 250);
+		if (!s->mail_ok && !s->piped) {
+			sessionAbort(e, s, text);
+		} else {
+			/* When pipelining, the rest of the replies still come */
+			dsbCopy(s->err, text);
+			sessionRcpt(e, s);
+		}
+		break;
+
+	case SESS_RCPT:
+		if (!s->mail_ok) {
+			/* Only the reply to MAIL FROM matters */
+		} else if ((code == 250) || (code == 251)) {
+			s->accepted++;
+		} else {
+			warning("Recipient <%s> was rejected: %s\n",
+				s->job->rcpts[s->rcpt], text);
+			if (code / 100 == 4) {
+				smtpJobDefer(s->job, s->job->rcpts[s->rcpt]);
+			}
+			if (!s->job->err) {
+				s->job->err = DSB_NEW;
+			}
+			dsbCopy(s->job->err, text);
+		}
+		s->rcpt++;
+		sessionRcpt(e, s);
+		break;
+
+	case SESS_DATA:
+		if (s->mail_ok && s->accepted > 0) {
+			if (code != 354) {
+				sessionAbort(e, s, text);
+			} else {
+				sessionData(e, s, SESS_DOT);
+			}
+		} else if (code == 354) {
+			/* It wants a message with no one to send it to, so hang up */
+			if (!s->mail_ok) {
+				jobFail(e, s, s->err->str);
+			} else {
+				s->job->temporary = (s->job->ndeferred > 0);
+				jobFinish(e, s, ERROR, s->job->err ? NULL :
+					"No recipients were accepted by the SMTP server");
+			}
+			sessionClose(e, s);
+			sessionOpen(e, s);
+		} else {
+			sessionRefused(e, s);
+		}
+		break;
+
+	case SESS_BDAT:
+		s->bdat_pending--;
+		if (code != 250 && !s->bdat_failed) {
+			/* No more chunks go out, but the replies to the rest still come */
+			s->bdat_failed = true;
+			dsbCopy(s->err, text);
+		}
+		if (s->bdat_pending > 0 || (!s->data_done && !s->bdat_failed)) {
+			if (sessionWrite(e, s) == ERROR) {
+				sessionFail(e, s, "Error writing to socket.");
+			}
+		} else if (s->bdat_failed) {
+			sessionAbort(e, s, s->err->str);
+		} else {
+			jobFinish(e, s, SUCCESS, NULL);
+			s->msgs++;
+			sessionNext(e, s);
+		}
+		break;
+
+	case SESS_DOT:
+		if (code != 250) {
+			jobFail(e, s, text);
+		} else {
+			jobFinish(e, s, SUCCESS, NULL);
+		}
+		s->msgs++;
+		sessionNext(e, s);
+		break;
+
+	case SESS_RSET:
+		if (code != 250) {
+			sessionFail(e, s, text);
+		} else {
+			sessionNext(e, s);
+		}
+		break;
+
+	case SESS_QUIT:
+		sessionClose(e, s);
+		sessionOpen(e, s);
+		break;
+	}
+}
+
+/**
+ * Picks complete replies out of what's been read so far and hands
+ * them off.  The last line of a reply has a space in the 4th column.
+ */
+static void
+sessionParse(struct engine *e, struct session *s)
+{
+	char *line, *nl, *end;
+	u_int serial = s->serial;
+
+	line = s->inbuf;
+	end = s->inbuf + s->inlen;
+	while ((nl = memchr(line, '\n', end - line)) != NULL) {
+		*nl = '\0';
+		chomp(line);
+		if (s->state == SESS_EHLO && line[0] == '2') {
+			smtpCapsLine(&s->caps, line);
+		}
+		if (nl - line >= 4 && line[3] != ' ') {
+			line = nl + 1;
+			continue;
+		}
+		sessionReply(e, s, atoi(line), line);
+		if (s->serial != serial) {
+			/* The session was closed on the way, the rest is of no use */
+			return;
+		}
+		line = nl + 1;
+	}
+
+	/* Keep whatever is left of a reply that isn't all here yet */
+	s->inlen = end - line;
+	memmove(s->inbuf, line, s->inlen);
+}
+
+/**
+ * Reads whatever the server has sent us.
+ */
+static void
+sessionRead(struct engine *e, struct session *s)
+{
+	ssize_t n;
+	u_int serial = s->serial;
+
+	while (true) {
+		if (s->insize - s->inlen < ENGINE_READ_SIZE) {
+			s->insize = s->inlen + ENGINE_READ_SIZE;
+			s->inbuf = xrealloc(s->inbuf, s->insize);
+		}
+		n = recv(s->fd, s->inbuf + s->inlen, s->insize - s->inlen, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			sessionFail(e, s, "Lost connection with SMTP server");
+			return;
+		} else if (n == 0) {
+			/* See what the server had to say before it hung up */
+			sessionParse(e, s);
+			if (s->serial != serial) {
+				return;
+			}
+			if (s->state == SESS_QUIT) {
+				sessionClose(e, s);
+				sessionOpen(e, s);
+			} else {
+				sessionFail(e, s, "Lost connection with SMTP server");
+			}
+			return;
+		}
+		s->inlen += n;
+		s->deadline = time(NULL) + e->timeout;
+	}
+	sessionParse(e, s);
+}
+
+/**
+ * Handles what epoll told us about a session.
+ */
+static void
+sessionEvent(struct engine *e, struct session *s, uint32_t events)
+{
+	int err=0;
+	socklen_t len = sizeof(err);
+	u_int serial = s->serial;
+
+	if (s->state == SESS_CONNECT) {
+		if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+			err = errno;
+		}
+		if (err) {
+			sessionConnectFail(e, s, strerror(err));
+			return;
+		}
+		s->state = SESS_GREETING;
+		s->deadline = time(NULL) + e->timeout;
+		sessionWatch(e, s, EPOLL_CTL_MOD, false);
+		return;
+	}
+
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		sessionRead(e, s);
+	}
+	if (s->serial == serial && (events & EPOLLOUT)) {
+		if (sessionWrite(e, s) == ERROR) {
+			sessionFail(e, s, "Error writing to socket.");
+		}
+	}
+}
+
+/**
+ * Reads in the configuration the sessions need.
+ */
+static int
+engineConf(struct engine *e)
+{
+	e->timeout = Conf.timeout;
+	e->max_msgs = Conf.smtp_max_messages;
+	e->bdat_size = Conf.bdat_chunk_size;
+	e->from = Conf.my_email;
+	if (gethostname(e->nodename, sizeof(e->nodename) - 1) < 0) {
+		snprintf(e->nodename, sizeof(e->nodename) - 1, "geek");
+	}
+
+	e->auth = Conf.smtp_auth;
+	if (!e->auth) {
+		return SUCCESS;
+	}
+	if (strcasecmp(e->auth, "LOGIN") != 0 && strcasecmp(e->auth, "PLAIN") != 0) {
+		fatal("SMTP_AUTH must be LOGIN or PLAIN\n");
+		return ERROR;
+	}
+	e->user = Conf.smtp_auth_user;
+	if (!e->user) {
+		fatal("You must set SMTP_AUTH_USER in order to user SMTP_AUTH\n");
+		return ERROR;
+	}
+	e->pass = Conf.smtp_auth_pass;
+	if (!e->pass) {
+		e->pass = getpass("Enter your SMTP Password: ");
+		if (!e->pass) {
+			fatal("Failed to get SMTP Password.\n");
+			return ERROR;
+		}
+		e->pass = xstrdup(e->pass);
+		setConfValue("SMTP_AUTH_PASS", e->pass);
+		Conf.smtp_auth_pass = e->pass;
+	}
+	return SUCCESS;
+}
+
+/**
+ * Looks up where each relay is.  Relays that can't be found are 
+ * left out.  Returns how many of them can be used.
+ */
+static u_int
+engineResolve(struct engine *e, struct smtprelay *relays, u_int nrelays)
+{
+	int err;
+	u_int i, usable=0;
+	char service[16];
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	e->nrelays = nrelays;
+	e->relays = xmalloc(sizeof(struct relay) * nrelays);
+	memset(e->relays, 0, sizeof(struct relay) * nrelays);
+	for (i=0; i < nrelays; i++) {
+		e->relays[i].conf = &relays[i];
+		snprintf(service, sizeof(service), "%d", relays[i].port);
+		err = getaddrinfo(relays[i].host, service, &hints, &e->relays[i].addrs);
+		if (err != 0) {
+			warning("Could not find server %s: %s\n", relays[i].host, gai_strerror(err));
+			e->relays[i].addrs = NULL;
+			continue;
+		}
+		if (Mopts.verbose) {
+			printf("Using relay %s on port %d with weight %u\n",
+				relays[i].host, relays[i].port, relays[i].weight);
+		}
+		usable++;
+	}
+	return usable;
+}
+
+/**
+ * Sends every job feed() hands us through the relays, over as many 
+ * as sessions connections at a time.  The connections are spread over 
+ * the relays by weight, and a job that fails on one relay for a reason
+ * that may be temporary is tried on the next.  done() is called for 
+ * each job once it's been sent or has failed for good.
+ *
+ * Params
+ * 	relays - SMTP servers to send through
+ * 	nrelays - How many of them there are (at most SMTP_MAX_RELAYS)
+ * 	sessions - How many sessions to run at once
+ * 	feed - Hands out jobs
+ * 	done - Takes jobs back
+ * 	arg - Passed along to feed() and done()
+ *
+ * Return
+ * 	- ERROR if the engine couldn't get going or had to give up
+ * 	- SUCCESS
+ */
+int
+smtpEngineRun(struct smtprelay *relays, u_int nrelays, u_int sessions,
+	smtpjobfeed feed, smtpjobdone done, void *arg)
+{
+	int retval=SUCCESS, n, i, wait;
+	u_int j, active;
+	time_t now;
+	size_t k;
+	struct engine e;
+	struct session *sess=NULL, *s;
+	struct smtpjob *job;
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+
+	assert(nrelays > 0 && nrelays <= SMTP_MAX_RELAYS);
+
+	memset(&e, 0, sizeof(e));
+	e.epfd = -1;
+	e.feed = feed;
+	e.done = done;
+	e.arg = arg;
+	if (engineConf(&e) == ERROR) {
+		retval = ERROR;
+		goto end;
+	}
+	if (engineResolve(&e, relays, nrelays) == 0) {
+		fatal("None of the SMTP servers could be found\n");
+		retval = ERROR;
+		goto end;
+	}
+	e.epfd = epoll_create(sessions);
+	if (e.epfd < 0) {
+		fatal("Could not set up epoll");
+		retval = ERROR;
+		goto end;
+	}
+
+	if (Mopts.verbose) {
+		printf("Sending over %u sessions\n", sessions);
+	}
+	sess = xmalloc(sizeof(struct session) * sessions);
+	memset(sess, 0, sizeof(struct session) * sessions);
+	for (j=0; j < sessions; j++) {
+		sess[j].fd = -1;
+		sess[j].idx = j;
+		sess[j].out = DSB_NEW;
+		sess[j].err = DSB_NEW;
+		sessionOpen(&e, &sess[j]);
+	}
+
+	while (true) {
+		/* Wait no longer than it takes the first session to time out */
+		now = time(NULL);
+		active = 0;
+		wait = -1;
+		for (j=0; j < sessions; j++) {
+			if (sess[j].fd == -1) {
+				continue;
+			}
+			active++;
+			n = (sess[j].deadline > now) ? (sess[j].deadline - now) * 1000 : 0;
+			if (wait < 0 || n < wait) {
+				wait = n;
+			}
+		}
+		if (active == 0) {
+			break;
+		}
+
+		n = epoll_wait(e.epfd, events, ENGINE_MAX_EVENTS, wait);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fatal("epoll_wait failed");
+			retval = ERROR;
+			break;
+		}
+		for (i=0; i < n; i++) {
+			s = &sess[events[i].data.u64 & 0xffffffff];
+			/* Events for a socket the session has already let go of */
+			if (s->fd == -1 || s->serial != (events[i].data.u64 >> 32)) {
+				continue;
+			}
+			sessionEvent(&e, s, events[i].events);
+		}
+
+		now = time(NULL);
+		for (j=0; j < sessions; j++) {
+			if (sess[j].fd == -1 || now < sess[j].deadline) {
+				continue;
+			}
+			if (sess[j].state == SESS_CONNECT) {
+				sessionConnectFail(&e, &sess[j], 
+					"Timeout while connecting to SMTP server");
+			} else {
+				sessionFail(&e, &sess[j], "Timeout while waiting on SMTP server");
+			}
+		}
+	}
+
+end:
+	/* If we bailed out early, everything still around has failed */
+	if (retval == ERROR) {
+		for (j=0; sess && j < sessions; j++) {
+			if (sess[j].job) {
+				sess[j].job->temporary = true;
+			}
+			jobFinish(&e, &sess[j], ERROR, "Delivery was aborted");
+		}
+		for (k=0; k < e.nretry; k++) {
+			jobDone(&e, e.retry[k], ERROR, NULL);
+		}
+		e.nretry = 0;
+		while (!e.fed_all && (job = feed(arg)) != NULL) {
+			job->temporary = true;
+			jobDone(&e, job, ERROR, "Delivery was aborted");
+		}
+	}
+
+	if (sess) {
+		for (j=0; j < sessions; j++) {
+			sessionClose(&e, &sess[j]);
+			dsbDestroy(sess[j].out);
+			dsbDestroy(sess[j].err);
+			xfree(sess[j].inbuf);
+		}
+		xfree(sess);
+	}
+	if (e.epfd != -1) {
+		close(e.epfd);
+	}
+	for (j=0; j < e.nrelays; j++) {
+		if (e.relays[j].addrs) {
+			freeaddrinfo(e.relays[j].addrs);
+		}
+	}
+	xfree(e.relays);
+	xfree(e.retry);
+	return retval;
+}
+
+#else
+
+int
+smtpEngineRun(struct smtprelay *relays, u_int nrelays, u_int sessions,
+	smtpjobfeed feed, smtpjobdone done, void *arg)
+{
+	relays = relays;
+	nrelays = nrelays;
+	sessions = sessions;
+	feed = feed;
+	done = done;
+	arg = arg;
+	return ERROR;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
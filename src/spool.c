@@ -0,0 +1,591 @@
+/**
+    eMail is a command line SMTP client.
+
+    Copyright (C) 2001 - 2008 email by Dean Jones
+    Software supplied and written by http://www.cleancode.org
+
+    This file is part of eMail.
+
+    eMail is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    eMail is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with eMail; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**/
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "email.h"
+#include "utils.h"
+#include "addy_book.h"
+#include "remotesmtp.h"
+#include "smtpengine.h"
+#include "spool.h"
+#include "error.h"
+
+/**
+ * Every message in the spool is two files named after it's id.
+ * <id>.msg holds the message exactly as it will be sent and <id>.env
+ * holds the envelope: who it goes to and when to try it next.  The 
+ * envelope is written last and renamed into place, so a message 
+ * without one is never picked up.  Messages we give up on have their 
+ * envelope renamed to <id>.failed and are left for someone to look at.
+**/
+
+#define SPOOL_RETRY_FIRST  60		/* Seconds before the first retry */
+#define SPOOL_RETRY_MAX    14400	/* Never wait more than 4 hours */
+#define SPOOL_MAX_AGE      432000	/* Give up after 5 days */
+#define SPOOL_READ_SIZE    8192
+
+/* What the envelope says about a spooled message */
+struct spoolentry {
+	char *id;
+	time_t created;
+	u_int attempts;
+	time_t next;
+	dstrbuf *err;		/* Why the last try failed */
+};
+
+/* Where a flush is at */
+struct flush {
+	dstrbuf *dir;
+	char **ids;
+	size_t nids;
+	size_t cur;
+	time_t now;
+	int sent;
+	int deferred;
+	int failed;
+	int waiting;
+};
+
+/* Where spoolJobs() is at */
+struct spoolctx {
+	dstrbuf *dir;
+	smtpjobfeed feed;
+	smtpjobdone done;
+	void *arg;
+};
+
+/**
+ * Returns the spool directory from SPOOL_DIR, creating it if 
+ * it isn't there yet.  NULL if it's not set or can't be made.
+**/
+static dstrbuf *
+spoolDir(void)
+{
+	dstrbuf *path;
+
+	if (!Conf.spool_dir) {
+		fatal("SPOOL_DIR must be set to use the spool\n");
+		return NULL;
+	}
+	path = DSB_NEW;
+	dsbCopy(path, Conf.spool_dir);
+	if (mkdir(path->str, 0700) == -1 && errno != EEXIST) {
+		fatal("Could not create spool directory %s", path->str);
+		dsbDestroy(path);
+		return NULL;
+	}
+	return path;
+}
+
+/**
+ * Builds the path to one of a message's files.
+**/
+static dstrbuf *
+spoolPath(const dstrbuf *dir, const char *id, const char *ext)
+{
+	dstrbuf *path = DSB_NEW;
+
+	dsbPrintf(path, "%s/%s%s", dir->str, id, ext);
+	return path;
+}
+
+/**
+ * Writes the message to file and makes sure it's on the disk.
+**/
+static int
+spoolWriteFile(const char *file, struct msgstream *msg)
+{
+	FILE *out = fopen(file, "w");
+
+	if (!out) {
+		warning("Could not open file: %s", file);
+		return ERROR;
+	}
+	if (msgStreamWrite(msg, out) == ERROR || fflush(out) != 0 ||
+	    fsync(fileno(out)) == -1) {
+		warning("Could not write to file: %s", file);
+		fclose(out);
+		unlink(file);
+		return ERROR;
+	}
+	fclose(out);
+	return SUCCESS;
+}
+
+/**
+ * How long to wait before trying a message again, doubling 
+ * with every attempt.
+**/
+static time_t
+spoolBackoff(u_int attempts)
+{
+	time_t wait = SPOOL_RETRY_FIRST;
+
+	while (--attempts > 0 && wait < SPOOL_RETRY_MAX) {
+		wait *= 2;
+	}
+	if (wait > SPOOL_RETRY_MAX) {
+		wait = SPOOL_RETRY_MAX;
+	}
+	return wait;
+}
+
+/**
+ * Writes the envelope for a message and renames it into place.
+**/
+static int
+spoolWriteEnv(const dstrbuf *dir, const struct spoolentry *ent, 
+		char **rcpts, size_t nrcpts)
+{
+	size_t i;
+	int retval = ERROR;
+	dstrbuf *env = DSB_NEW;
+	struct msgstream *msg = msgStreamFromBuf(env, true);
+	dstrbuf *tmp = spoolPath(dir, ent->id, ".tmp");
+	dstrbuf *path = spoolPath(dir, ent->id, ".env");
+
+	dsbPrintf(env, "created %ld\nattempts %u\nnext %ld\n",
+		(long)ent->created, ent->attempts, (long)ent->next);
+	if (ent->err && ent->err->len > 0) {
+		dsbPrintf(env, "error %s\n", ent->err->str);
+	}
+	for (i=0; i < nrcpts; i++) {
+		dsbPrintf(env, "rcpt %s\n", rcpts[i]);
+	}
+
+	if (spoolWriteFile(tmp->str, msg) == ERROR) {
+		goto end;
+	}
+	if (rename(tmp->str, path->str) == -1) {
+		warning("Could not rename %s", tmp->str);
+		unlink(tmp->str);
+		goto end;
+	}
+	retval = SUCCESS;
+
+end:
+	msgStreamFree(msg);
+	dsbDestroy(env);
+	dsbDestroy(tmp);
+	dsbDestroy(path);
+	return retval;
+}
+
+/**
+ * Copies err to the entry, keeping only the first line of it.
+**/
+static void
+spoolSetErr(struct spoolentry *ent, const char *err)
+{
+	if (!ent->err) {
+		ent->err = DSB_NEW;
+	}
+	dsbClear(ent->err);
+	dsbnCat(ent->err, err, strcspn(err, "\r\n"));
+}
+
+static void
+spoolEntryDestroy(struct spoolentry *ent)
+{
+	if (ent) {
+		xfree(ent->id);
+		dsbDestroy(ent->err);
+		xfree(ent);
+	}
+}
+
+/**
+ * Puts a message in the spool.  If err is set, the message was 
+ * already tried once and failed with it, so it waits a while before
+ * it's tried again.  Otherwise the next flush sends it.
+**/
+static int
+spoolAdd(const dstrbuf *dir, struct msgstream *msg, char **rcpts, 
+		size_t nrcpts, const char *err)
+{
+	int retval = ERROR;
+	static u_int seq=0;
+	dstrbuf *rstr = randomString(8);
+	dstrbuf *id = DSB_NEW, *path;
+	struct spoolentry ent;
+
+	/* The count keeps messages spooled at the same moment apart */
+	dsbPrintf(id, "%lx.%d.%u.%s", (long)time(NULL), (int)getpid(), seq++, rstr->str);
+	dsbDestroy(rstr);
+
+	memset(&ent, 0, sizeof(ent));
+	ent.id = id->str;
+	ent.created = ent.next = time(NULL);
+	if (err) {
+		ent.attempts = 1;
+		ent.next += spoolBackoff(ent.attempts);
+		spoolSetErr(&ent, err);
+	}
+
+	path = spoolPath(dir, ent.id, ".msg");
+	if (spoolWriteFile(path->str, msg) == ERROR) {
+		goto end;
+	}
+	if (spoolWriteEnv(dir, &ent, rcpts, nrcpts) == ERROR) {
+		unlink(path->str);
+		goto end;
+	}
+	retval = SUCCESS;
+
+end:
+	dsbDestroy(path);
+	dsbDestroy(ent.err);
+	dsbDestroy(id);
+	return retval;
+}
+
+/**
+ * Reads a spooled message back in as a job with it's entry kept
+ * in job->data.  Returns NULL if it can't be read.
+**/
+static struct smtpjob *
+spoolRead(const dstrbuf *dir, const char *id)
+{
+	size_t len;
+	FILE *in;
+	char chunk[SPOOL_READ_SIZE];
+	dstrbuf *path, *line, *msg;
+	struct smtpjob *job;
+	struct spoolentry *ent;
+
+	path = spoolPath(dir, id, ".env");
+	in = fopen(path->str, "r");
+	dsbDestroy(path);
+	if (!in) {
+		/* Another flush probably got to it first */
+		return NULL;
+	}
+
+	ent = xmalloc(sizeof(struct spoolentry));
+	memset(ent, 0, sizeof(struct spoolentry));
+	ent->id = xstrdup(id);
+	job = smtpJobNew(NULL);
+	job->data = ent;
+
+	line = DSB_NEW;
+	while (dsbReadline(line, in) > 0) {
+		chomp(line->str);
+		if (strncmp(line->str, "created ", 8) == 0) {
+			ent->created = (time_t)atol(line->str + 8);
+		} else if (strncmp(line->str, "attempts ", 9) == 0) {
+			ent->attempts = (u_int)atoi(line->str + 9);
+		} else if (strncmp(line->str, "next ", 5) == 0) {
+			ent->next = (time_t)atol(line->str + 5);
+		} else if (strncmp(line->str, "error ", 6) == 0) {
+			spoolSetErr(ent, line->str + 6);
+		} else if (strncmp(line->str, "rcpt ", 5) == 0) {
+			smtpJobAddRcpt(job, line->str + 5);
+		}
+	}
+	dsbDestroy(line);
+	fclose(in);
+
+	path = spoolPath(dir, id, ".msg");
+	in = fopen(path->str, "r");
+	dsbDestroy(path);
+	if (!in) {
+		warning("Spooled message %s has no message file", id);
+		goto fail;
+	}
+	msg = DSB_NEW;
+	while ((len = fread(chunk, sizeof(char), sizeof(chunk), in)) > 0) {
+		dsbnCat(msg, chunk, len);
+	}
+	fclose(in);
+	job->msg = msg;
+
+	if (job->nrcpts == 0) {
+		warning("Spooled message %s has no recipients\n", id);
+		goto fail;
+	}
+	return job;
+
+fail:
+	spoolEntryDestroy(ent);
+	smtpJobDestroy(job);
+	return NULL;
+}
+
+/**
+ * Takes the message out of the spool.
+**/
+static void
+spoolRemove(const dstrbuf *dir, const char *id)
+{
+	dstrbuf *path;
+
+	path = spoolPath(dir, id, ".env");
+	unlink(path->str);
+	dsbDestroy(path);
+	path = spoolPath(dir, id, ".msg");
+	unlink(path->str);
+	dsbDestroy(path);
+}
+
+/**
+ * Puts the message in the spool addressed to everyone in the To, 
+ * Cc and Bcc lists.  err is why sending it right away failed, or 
+ * NULL if it wasn't tried.
+**/
+int
+spoolMessage(struct msgstream *msg, const char *err)
+{
+	int retval;
+	dlist rcpts;
+	char *next=NULL;
+	struct smtpjob *job;
+	dstrbuf *dir;
+
+	if (!(dir = spoolDir())) {
+		return ERROR;
+	}
+
+	job = smtpJobNew(NULL);
+	rcpts = getRcpts(Mopts.to, Mopts.cc, Mopts.bcc);
+	while ((next = (char *)dlGetNext(rcpts)) != NULL) {
+		smtpJobAddRcpt(job, next);
+	}
+	dlDestroy(rcpts);
+	retval = spoolAdd(dir, msg, job->rcpts, job->nrcpts, err);
+	if (retval == SUCCESS && Mopts.verbose) {
+		printf("Message queued in %s\n", dir->str);
+	}
+	smtpJobDestroy(job);
+	dsbDestroy(dir);
+	return retval;
+}
+
+/**
+ * Puts every message feed() hands out in the spool instead of 
+ * sending it.  done() gets each one back with status SUCCESS if 
+ * it made it into the spool.
+**/
+int
+spoolJobs(smtpjobfeed feed, smtpjobdone done, void *arg)
+{
+	struct smtpjob *job;
+	struct msgstream *msg;
+	dstrbuf *dir;
+
+	if (!(dir = spoolDir())) {
+		return ERROR;
+	}
+	while ((job = feed(arg)) != NULL) {
+		msg = msgStreamFromBuf(job->msg, true);
+		job->status = spoolAdd(dir, msg, job->rcpts, job->nrcpts, NULL);
+		msgStreamFree(msg);
+		done(job, arg);
+	}
+	dsbDestroy(dir);
+	return SUCCESS;
+}
+
+/**
+ * Hands out the next spooled message that's due.
+**/
+static struct smtpjob *
+flushFeed(void *arg)
+{
+	struct flush *f = arg;
+	struct smtpjob *job;
+	struct spoolentry *ent;
+	dstrbuf *rcpts;
+	size_t i;
+
+	while (f->cur < f->nids) {
+		job = spoolRead(f->dir, f->ids[f->cur++]);
+		if (!job) {
+			continue;
+		}
+		ent = job->data;
+		if (ent->next > f->now) {
+			f->waiting++;
+			spoolEntryDestroy(ent);
+			smtpJobDestroy(job);
+			continue;
+		}
+
+		/* sendmail() takes it's recipients from Mopts */
+		rcpts = DSB_NEW;
+		for (i=0; i < job->nrcpts; i++) {
+			dsbPrintf(rcpts, "%s%s", i ? "," : "", job->rcpts[i]);
+		}
+		if (Mopts.to) {
+			dlDestroy(Mopts.to);
+		}
+		Mopts.to = getNames(rcpts->str);
+		dsbDestroy(rcpts);
+		return job;
+	}
+	return NULL;
+}
+
+/**
+ * Takes a sent message out of the spool.  One that failed for a 
+ * reason that might go away is tried again later, waiting twice as
+ * long each time.  The rest are given up on.  If the server took it
+ * for some recipients but turned others away for now, only those 
+ * others are kept for the next try.
+**/
+static void
+flushDone(struct smtpjob *job, void *arg)
+{
+	struct flush *f = arg;
+	struct spoolentry *ent = job->data;
+	const char *err = (job->err && job->err->len > 0) ? job->err->str : NULL;
+	char **rcpts = job->rcpts;
+	size_t nrcpts = job->nrcpts;
+	bool temporary = job->temporary;
+	dstrbuf *from, *to;
+
+	if (job->status != ERROR) {
+		if (job->ndeferred == 0) {
+			spoolRemove(f->dir, ent->id);
+			f->sent++;
+			goto end;
+		}
+		rcpts = job->deferred;
+		nrcpts = job->ndeferred;
+		temporary = true;
+	}
+
+	ent->attempts++;
+	if (err) {
+		spoolSetErr(ent, err);
+	}
+	if (temporary && f->now - ent->created < SPOOL_MAX_AGE) {
+		ent->next = f->now + spoolBackoff(ent->attempts);
+		spoolWriteEnv(f->dir, ent, rcpts, nrcpts);
+		f->deferred++;
+		goto end;
+	}
+
+	/* Keep the last error with it for whoever looks at it */
+	spoolWriteEnv(f->dir, ent, rcpts, nrcpts);
+	from = spoolPath(f->dir, ent->id, ".env");
+	to = spoolPath(f->dir, ent->id, ".failed");
+	warning("Giving up on spooled message %s. It's left in %s\n", 
+		ent->id, to->str);
+	rename(from->str, to->str);
+	dsbDestroy(from);
+	dsbDestroy(to);
+	f->failed++;
+
+end:
+	spoolEntryDestroy(ent);
+	smtpJobDestroy(job);
+}
+
+/**
+ * Sends every message in the spool that's due.  Only one flush runs
+ * at a time; if another one has the spool locked we leave it be.
+**/
+int
+spoolFlush(void)
+{
+	int lock, retval = ERROR;
+	size_t len;
+	DIR *dp;
+	struct dirent *dent;
+	struct flush f;
+	dstrbuf *path;
+
+	memset(&f, 0, sizeof(f));
+	if (!(f.dir = spoolDir())) {
+		return ERROR;
+	}
+
+	path = DSB_NEW;
+	dsbPrintf(path, "%s/.lock", f.dir->str);
+	lock = open(path->str, O_RDWR | O_CREAT, 0600);
+	dsbDestroy(path);
+	if (lock == -1) {
+		fatal("Could not lock spool directory %s", f.dir->str);
+		goto end;
+	}
+	if (flock(lock, LOCK_EX | LOCK_NB) == -1) {
+		if (Mopts.verbose) {
+			printf("The spool is already being flushed\n");
+		}
+		retval = SUCCESS;
+		goto end;
+	}
+
+	if (!(dp = opendir(f.dir->str))) {
+		fatal("Could not open spool directory %s", f.dir->str);
+		goto end;
+	}
+	while ((dent = readdir(dp)) != NULL) {
+		len = strlen(dent->d_name);
+		if (len <= 4 || strcmp(dent->d_name + len - 4, ".env") != 0) {
+			continue;
+		}
+		f.ids = xrealloc(f.ids, sizeof(char *) * (f.nids + 1));
+		f.ids[f.nids++] = xstrdup(dent->d_name);
+		f.ids[f.nids - 1][len - 4] = '\0';
+	}
+	closedir(dp);
+
+	f.now = time(NULL);
+	retval = sendmailBatch(flushFeed, flushDone, &f);
+	if (Mopts.verbose) {
+		printf("Sent %d message(s), %d deferred, %d failed, %d not due yet\n",
+			f.sent, f.deferred, f.failed, f.waiting);
+	}
+	if (f.failed) {
+		retval = ERROR;
+	}
+
+end:
+	if (lock != -1) {
+		close(lock);
+	}
+	while (f.nids > 0) {
+		xfree(f.ids[--f.nids]);
+	}
+	if (f.ids) {
+		xfree(f.ids);
+	}
+	dsbDestroy(f.dir);
+	return retval;
+}
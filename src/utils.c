@@ -52,6 +52,9 @@
 #include "utils.h"
 #include "error.h"
 #include "mimeutils.h"
+#include "msgstream.h"
+#include "addy_book.h"
+#include "conf.h"
 
 /**
  * Return number of printable chars in a utf8 string
@@ -275,10 +278,11 @@ deadLetter()
 	dstrbuf *path = expandPath("~/dead.letter");
 	FILE *out = fopen(path->str, "w");
 
-	if (!out || !global_msg) {
+	if (!out || !global_msg || msgStreamWrite(global_msg, out) == ERROR) {
 		warning("Could not save dead letter to %s", path->str);
-	} else {
-		fwrite(global_msg->str, sizeof(char), global_msg->len, out);
+	}
+	if (out) {
+		fclose(out);
 	}
 	dsbDestroy(path);
 }
@@ -354,7 +358,7 @@ properExit(int sig)
 	if (sig != 0 && global_msg) {
 		deadLetter();
 	}
-	dsbDestroy(global_msg);
+	msgStreamFree(global_msg);
 
 	/* Free lists */
 	if (Mopts.attach) {
@@ -373,6 +377,9 @@ properExit(int sig)
 		dlDestroy(Mopts.bcc);
 	}
 
+	mimeFreeTypes();
+	freeAddrBook();
+	freeConfOptions();
 	dhDestroy(table);
 	exit(sig);
 }